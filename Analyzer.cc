@@ -0,0 +1,299 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "EventCodec.h"
+#include "EventDecoder.h"
+#include "FlightRecorder.h"
+#include "LoggerConsts.h"
+#include "RemoteAnalyzers.h"
+#include "SharedRegion.h"
+
+/**
+ * Analyzer process for the event buffers of a FastLog process. Either:
+ *  - attached to the shared region of the application (see SharedRegion):
+ *    processes the event buffers in the order they are published, reading
+ *    the events in place, and lets the application recycle each buffer once
+ *    done. Exits when the application is gone and the ring is drained.
+ *  - or as an analyzer node (see RemoteAnalyzers): accepts one connection
+ *    from the application, processes the event buffers it's sent, and
+ *    grants a credit back for each. Exits when the connection is closed.
+ *    --cost adds a busy loop of the given # ns per 1000 events, to stand in
+ *    for an actual analysis.
+ *
+ * Usage: FastLogAnalyzer <region path, e.g., /proc/<pid>/fd/<fd>>
+ *        FastLogAnalyzer --listen <port> [--cost <ns>]
+ */
+
+/// How long to sleep at a time while the ring is empty, before checking if
+/// the application is still alive.
+static const int64_t IDLE_TIMEOUT_NS = 100 * 1000000;
+
+static SharedRegionHeader* header;
+
+/// Translate an address in the application to our mapping of the region.
+template <typename T>
+static T*
+at(uint64_t appAddr)
+{
+    return reinterpret_cast<T*>(reinterpret_cast<char*>(header) +
+            (appAddr - header->appBase));
+}
+
+/**
+ * Invoke \p func(events, n) on each contiguous chunk of events of a buffer;
+ * see EventBuffer::forEachChunk().
+ */
+template <typename Func>
+static void
+forEachChunk(const SharedBufferDesc& desc, Func func)
+{
+    EventSegment* seg = desc.firstSegment ?
+            at<EventSegment>(desc.firstSegment) : NULL;
+    while (seg) {
+        EventSegment* next = seg->next ?
+                at<EventSegment>(uint64_t(seg->next)) : NULL;
+        int end = next ? next->begin : desc.events;
+        func(static_cast<const uint64_t*>(seg->events), end - seg->begin);
+        seg = next;
+    }
+}
+
+static bool
+appAlive()
+{
+    return (kill(header->appPid, 0) == 0) || (errno != ESRCH);
+}
+
+/// Stats.
+static uint64_t buffers = 0;
+static uint64_t events = 0;
+static uint64_t accesses = 0;
+
+/**
+ * Process a contiguous chunk of events of a buffer.
+ *
+ * \param addrBase
+ *      Upper address bits of the memory accesses; updated by the markers in
+ *      the chunk, if any.
+ */
+static void
+analyzeChunk(EventDecoder* decoder, const TraceLayoutRecord& layout,
+        const uint64_t* chunk, int n, uint64_t* addrBase)
+{
+    // TODO: like the in-process workers, just decode the events and count
+    // memory accesses for now.
+    bool truncated = (layout.layoutId != EVENT_LAYOUT_128);
+    auto analyze = [&](uint64_t code, uint64_t addr) {
+        if (code == TSAN_HDR_ADDR_BASE) {
+            *addrBase = addr;
+        } else if (code & TSAN_HDR_MEM_ACCESS) {
+            accesses++;
+            // TODO: hand the access to the actual analysis.
+            uint64_t fullAddr = truncated ? rebuildAddr(*addrBase, addr) :
+                    addr;
+            (void) fullAddr;
+        }
+    };
+    if (layout.layoutId != EVENT_LAYOUT_64) {
+        forEachEvent(layout, chunk, n, [&](const DecodedEvent& e) {
+            events++;
+            analyze(e.header, e.addr);
+        });
+        return;
+    }
+    for (int i = 0; i < n; i += EventColumns::CHUNK_EVENTS) {
+        int count = std::min(n - i, int(EventColumns::CHUNK_EVENTS));
+        const EventColumns& c = decoder->decodeChunk(chunk + i, count);
+        events += c.size;
+        for (int k = 0; k < c.size; k++) {
+            analyze(c.header[k], c.addr[k]);
+        }
+    }
+}
+
+/**
+ * Read exactly \p n bytes from \p fd.
+ *
+ * \return
+ *      False on EOF or error.
+ */
+static bool
+readAll(int fd, void* dst, size_t n)
+{
+    char* p = static_cast<char*>(dst);
+    while (n > 0) {
+        ssize_t got = ::read(fd, p, n);
+        if (got <= 0) {
+            if ((got < 0) && (errno == EINTR)) {
+                continue;
+            }
+            return false;
+        }
+        p += got;
+        n -= size_t(got);
+    }
+    return true;
+}
+
+/**
+ * Serve as an analyzer node listening on \p port.
+ *
+ * \param costNs
+ *      # ns of busy loop per 1000 events analyzed.
+ */
+static int
+listenMain(int port, int64_t costNs)
+{
+    // # credits granted upfront, i.e., # buffers that may be in flight.
+    static const uint32_t INITIAL_CREDITS = 8;
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(uint16_t(port));
+    if ((listener < 0) || (bind(listener,
+            reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) ||
+            (listen(listener, 1) != 0)) {
+        perror("listen");
+        return 1;
+    }
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    close(listener);
+    if (fd < 0) {
+        perror("accept");
+        return 1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    CreditMsg credit = {INITIAL_CREDITS, 0, 0};
+    if (::send(fd, &credit, sizeof(credit), MSG_NOSIGNAL) < 0) {
+        perror("send");
+        return 1;
+    }
+
+    EventDecoder decoder;
+    EventCodec codec;
+    std::vector<uint8_t> data;
+    std::vector<uint64_t> decompressed;
+    uint64_t epochs = 0;
+    FlightRecord record;
+    while (readAll(fd, &record, sizeof(record))) {
+        if ((record.magic != FlightRecord::MAGIC) ||
+                (record.version != FlightRecord::VERSION)) {
+            fprintf(stderr, "bad record from the application\n");
+            return 1;
+        }
+        if (record.flags & FlightRecord::END_OF_EPOCH) {
+            epochs++;
+            continue;
+        }
+        data.resize(record.bytes + EventCodec::PADDING);
+        if (!readAll(fd, data.data(), record.bytes)) {
+            break;
+        }
+        const uint64_t* chunk = reinterpret_cast<uint64_t*>(data.data());
+        int n = int(record.bytes / EventBuffer::EVENT_SIZE);
+        if (record.flags & FlightRecord::COMPRESSED) {
+            std::memset(&data[record.bytes], 0, EventCodec::PADDING);
+            decompressed.clear();
+            codec.decompress(data.data(), &decompressed);
+            chunk = decompressed.data();
+            n = int(decompressed.size());
+        }
+
+        uint64_t before = events;
+        uint64_t addrBase = 0;
+        int64_t start = steadyClockNs();
+        analyzeChunk(&decoder, record.layout, chunk, n, &addrBase);
+        int64_t deadline = start + int64_t(events - before) * costNs / 1000;
+        while (steadyClockNs() < deadline) {
+        }
+        buffers++;
+
+        credit = {1, 0, events - before};
+        if (::send(fd, &credit, sizeof(credit), MSG_NOSIGNAL) < 0) {
+            break;
+        }
+    }
+    close(fd);
+    printf("Analyzer processed %lu epochs, %lu buffers, %lu events (%lu "
+           "memory accesses)\n", epochs, buffers, events, accesses);
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    if ((argc >= 3) && (strcmp(argv[1], "--listen") == 0)) {
+        int64_t costNs = ((argc == 5) && (strcmp(argv[3], "--cost") == 0)) ?
+                atoll(argv[4]) : 0;
+        return listenMain(atoi(argv[2]), costNs);
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <shared region path>\n"
+                "       %s --listen <port> [--cost <ns per 1000 events>]\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+    int fd = open(argv[1], O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+        perror(argv[1]);
+        return 1;
+    }
+    void* mem = mmap(NULL, size_t(st.st_size), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    header = static_cast<SharedRegionHeader*>(mem);
+    if ((header->magic != SharedRegionHeader::MAGIC) ||
+            (header->version != SharedRegionHeader::VERSION)) {
+        fprintf(stderr, "%s: not a FastLog shared region\n", argv[1]);
+        return 1;
+    }
+
+    EventDecoder decoder;
+    while (true) {
+        int head = header->head.load(std::memory_order_relaxed);
+        int tail = header->tail.load(std::memory_order_acquire);
+        if (head == tail) {
+            if (!appAlive()) {
+                break;
+            }
+            futexWait(&header->tail, tail, IDLE_TIMEOUT_NS, true);
+            continue;
+        }
+
+        const SharedBufferDesc& desc =
+                header->ring[uint32_t(head) % SharedRegionHeader::RING_SLOTS];
+        uint64_t addrBase = 0;
+        TraceLayoutRecord layout = describeLayout(EventLayoutId(desc.layout));
+        forEachChunk(desc, [&](const uint64_t* chunk, int n) {
+            analyzeChunk(&decoder, layout, chunk, n, &addrBase);
+        });
+        buffers++;
+
+        // Done with the buffer; the application may now recycle it.
+        header->head.store(head + 1, std::memory_order_release);
+        futexWake(&header->head, true);
+    }
+    printf("Analyzer processed %lu buffers, %lu events (%lu memory "
+           "accesses)\n", buffers, events, accesses);
+    return 0;
+}
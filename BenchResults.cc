@@ -0,0 +1,459 @@
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+#include "BenchResults.h"
+
+double
+MetricSamples::mean() const
+{
+    double sum = 0;
+    for (double x : samples) {
+        sum += x;
+    }
+    return samples.empty() ? 0 : sum / double(samples.size());
+}
+
+/**
+ * Sample standard deviation.
+ */
+double
+MetricSamples::stddev() const
+{
+    if (samples.size() < 2) {
+        return 0;
+    }
+    double m = mean();
+    double sum = 0;
+    for (double x : samples) {
+        sum += (x - m) * (x - m);
+    }
+    return std::sqrt(sum / double(samples.size() - 1));
+}
+
+/**
+ * Half-width of the 95% confidence interval of the mean (Student's t).
+ */
+double
+MetricSamples::ci95() const
+{
+    // Two-sided 95% quantiles of Student's t for 1 to 30 degrees of freedom.
+    static const double T95[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447,
+            2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131,
+            2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+            2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    size_t n = samples.size();
+    if (n < 2) {
+        return 0;
+    }
+    double t = (n - 1 <= 30) ? T95[n - 2] : 1.96;
+    return t * stddev() / std::sqrt(double(n));
+}
+
+/// Identifies the configuration, to match results across runs.
+std::string
+BenchResult::key() const
+{
+    std::ostringstream s;
+    s << logOp << "/" << workload << "/threads=" << threads << "/length="
+      << length << "/bufferEvents=" << bufferEvents;
+    return s.str();
+}
+
+void
+BenchResult::add(const std::string& metric, double sample)
+{
+    for (auto& m : metrics) {
+        if (m.first == metric) {
+            m.second.samples.push_back(sample);
+            return;
+        }
+    }
+    metrics.emplace_back(metric, MetricSamples());
+    metrics.back().second.samples.push_back(sample);
+}
+
+/**
+ * \return
+ *      The samples of a metric; NULL if it wasn't measured.
+ */
+const MetricSamples*
+BenchResult::find(const std::string& metric) const
+{
+    for (auto& m : metrics) {
+        if (m.first == metric) {
+            return &m.second;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write results as JSON: {"results": [{<config>, "metrics": {<name>:
+ * {"mean", "stddev", "ci95", "samples"}}}]}.
+ *
+ * \throw std::system_error
+ *      The file can't be written.
+ */
+void
+writeBenchResults(const char* path, const std::vector<BenchResult>& results)
+{
+    std::ofstream out(path);
+    if (!out) {
+        throw std::system_error(errno, std::system_category(), path);
+    }
+    out.precision(10);
+    out << "{\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"logOp\": \"" << r.logOp
+            << "\", \"workload\": \"" << r.workload << "\", \"threads\": "
+            << r.threads << ", \"length\": " << r.length
+            << ", \"bufferEvents\": " << r.bufferEvents
+            << ",\n     \"metrics\": {";
+        for (size_t k = 0; k < r.metrics.size(); k++) {
+            const MetricSamples& m = r.metrics[k].second;
+            out << (k ? ",\n" : "\n") << "       \"" << r.metrics[k].first
+                << "\": {\"mean\": " << m.mean() << ", \"stddev\": "
+                << m.stddev() << ", \"ci95\": " << m.ci95()
+                << ", \"samples\": [";
+            for (size_t s = 0; s < m.samples.size(); s++) {
+                out << (s ? ", " : "") << m.samples[s];
+            }
+            out << "]}";
+        }
+        out << "}}";
+    }
+    out << "\n  ]\n}\n";
+    if (!out) {
+        throw std::system_error(errno, std::system_category(), path);
+    }
+}
+
+namespace {
+
+/**
+ * Just enough of a JSON reader for the output of writeBenchResults():
+ * objects, arrays, strings without escapes, and numbers.
+ */
+class JsonReader {
+  public:
+    explicit JsonReader(const std::string& text)
+        : text(text)
+        , pos(0)
+    {}
+
+    /// Skip whitespace and return the next character (0 at the end).
+    char
+    peek()
+    {
+        while ((pos < text.size()) && std::isspace(text[pos])) {
+            pos++;
+        }
+        return (pos < text.size()) ? text[pos] : 0;
+    }
+
+    /// Consume \p c if it's next.
+    bool
+    accept(char c)
+    {
+        if (peek() == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void
+    expect(char c)
+    {
+        if (!accept(c)) {
+            fail(std::string("expected '") + c + "'");
+        }
+    }
+
+    std::string
+    string()
+    {
+        expect('"');
+        size_t end = text.find('"', pos);
+        if (end == std::string::npos) {
+            fail("unterminated string");
+        }
+        std::string s = text.substr(pos, end - pos);
+        pos = end + 1;
+        return s;
+    }
+
+    double
+    number()
+    {
+        peek();
+        char* end;
+        double x = std::strtod(text.c_str() + pos, &end);
+        if (end == text.c_str() + pos) {
+            fail("expected a number");
+        }
+        pos = size_t(end - text.c_str());
+        return x;
+    }
+
+    /// Skip a value of any type.
+    void
+    skip()
+    {
+        if (accept('{')) {
+            if (!accept('}')) {
+                do {
+                    string();
+                    expect(':');
+                    skip();
+                } while (accept(','));
+                expect('}');
+            }
+        } else if (accept('[')) {
+            if (!accept(']')) {
+                do {
+                    skip();
+                } while (accept(','));
+                expect(']');
+            }
+        } else if (peek() == '"') {
+            string();
+        } else {
+            number();
+        }
+    }
+
+    [[noreturn]] void
+    fail(const std::string& what)
+    {
+        throw std::runtime_error("bad benchmark results at offset " +
+                std::to_string(pos) + ": " + what);
+    }
+
+  private:
+    const std::string& text;
+    size_t pos;
+};
+
+MetricSamples
+readMetric(JsonReader* in)
+{
+    MetricSamples m;
+    in->expect('{');
+    do {
+        std::string field = in->string();
+        in->expect(':');
+        if (field != "samples") {
+            in->skip();
+            continue;
+        }
+        in->expect('[');
+        if (!in->accept(']')) {
+            do {
+                m.samples.push_back(in->number());
+            } while (in->accept(','));
+            in->expect(']');
+        }
+    } while (in->accept(','));
+    in->expect('}');
+    return m;
+}
+
+BenchResult
+readResult(JsonReader* in)
+{
+    BenchResult r;
+    in->expect('{');
+    do {
+        std::string field = in->string();
+        in->expect(':');
+        if (field == "logOp") {
+            r.logOp = in->string();
+        } else if (field == "workload") {
+            r.workload = in->string();
+        } else if (field == "threads") {
+            r.threads = int(in->number());
+        } else if (field == "length") {
+            r.length = int(in->number());
+        } else if (field == "bufferEvents") {
+            r.bufferEvents = int(in->number());
+        } else if (field == "metrics") {
+            in->expect('{');
+            if (!in->accept('}')) {
+                do {
+                    std::string name = in->string();
+                    in->expect(':');
+                    r.metrics.emplace_back(name, readMetric(in));
+                } while (in->accept(','));
+                in->expect('}');
+            }
+        } else {
+            in->skip();
+        }
+    } while (in->accept(','));
+    in->expect('}');
+    return r;
+}
+
+} // namespace
+
+/**
+ * Read back results written by writeBenchResults(). Only the samples are
+ * read; the statistics are recomputed from them.
+ *
+ * \throw std::system_error
+ *      The file can't be read.
+ * \throw std::runtime_error
+ *      The file is malformed.
+ */
+std::vector<BenchResult>
+loadBenchResults(const char* path)
+{
+    std::ifstream file(path);
+    if (!file) {
+        throw std::system_error(errno, std::system_category(), path);
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string text = buffer.str();
+
+    std::vector<BenchResult> results;
+    JsonReader in(text);
+    in.expect('{');
+    do {
+        std::string field = in.string();
+        in.expect(':');
+        if (field != "results") {
+            in.skip();
+            continue;
+        }
+        in.expect('[');
+        if (!in.accept(']')) {
+            do {
+                results.push_back(readResult(&in));
+            } while (in.accept(','));
+            in.expect(']');
+        }
+    } while (in.accept(','));
+    in.expect('}');
+    return results;
+}
+
+/**
+ * Compare each metric of each configuration against a baseline and print a
+ * report. A metric regressed if its mean grew by more than \p thresholdPct
+ * and the confidence intervals don't overlap, i.e., the slowdown is both
+ * large and unlikely to be noise.
+ *
+ * \return
+ *      # regressions.
+ */
+int
+compareBenchResults(const std::vector<BenchResult>& baseline,
+        const std::vector<BenchResult>& current, double thresholdPct)
+{
+    int regressions = 0;
+    for (const BenchResult& cur : current) {
+        const BenchResult* base = NULL;
+        for (const BenchResult& b : baseline) {
+            if (b.key() == cur.key()) {
+                base = &b;
+                break;
+            }
+        }
+        if (base == NULL) {
+            printf("%s: not in the baseline\n", cur.key().c_str());
+            continue;
+        }
+        for (const auto& metric : cur.metrics) {
+            const MetricSamples* b = base->find(metric.first);
+            if ((b == NULL) || (b->mean() == 0)) {
+                continue;
+            }
+            const MetricSamples& c = metric.second;
+            double changePct = 100.0 * (c.mean() - b->mean()) / b->mean();
+            bool separated = (c.mean() - c.ci95() > b->mean() + b->ci95()) ||
+                    (c.mean() + c.ci95() < b->mean() - b->ci95());
+            const char* verdict = "ok";
+            if (separated && (changePct > thresholdPct)) {
+                verdict = "REGRESSION";
+                regressions++;
+            } else if (separated && (changePct < -thresholdPct)) {
+                verdict = "improvement";
+            }
+            printf("%s %s: %.4g -> %.4g (%+.1f%%, ci95 %.3g -> %.3g) %s\n",
+                    cur.key().c_str(), metric.first.c_str(), b->mean(),
+                    c.mean(), changePct, b->ci95(), c.ci95(), verdict);
+        }
+    }
+    printf("%d regressions (threshold %.1f%%)\n", regressions, thresholdPct);
+    return regressions;
+}
+
+/**
+ * Print the slowdown of each instrumented variant of a benchmark relative to
+ * the uninstrumented baseline, in cycles per write, for each workload, #
+ * threads and array length of the baseline. Results are matched regardless
+ * of the experiment and the buffer capacity (the first match wins), since
+ * those are what differs between the variants.
+ *
+ * \param labels
+ *      Name of each variant, for the header.
+ * \param instrumented
+ *      Results of each variant.
+ */
+void
+printSlowdowns(const std::vector<BenchResult>& baseline,
+        const std::vector<std::string>& labels,
+        const std::vector<std::vector<BenchResult>>& instrumented)
+{
+    printf("%-18s %7s %9s %12s", "workload", "threads", "length",
+            "baseCycles");
+    for (const std::string& label : labels) {
+        printf(" %24s", label.c_str());
+    }
+    printf("\n");
+
+    for (const BenchResult& base : baseline) {
+        const MetricSamples* b = base.find("cyclesPerWrite");
+        if ((b == NULL) || (b->mean() == 0)) {
+            continue;
+        }
+        printf("%-18s %7d %9d %12.2f", base.workload.c_str(), base.threads,
+                base.length, b->mean());
+        for (const std::vector<BenchResult>& results : instrumented) {
+            const MetricSamples* c = NULL;
+            for (const BenchResult& r : results) {
+                if ((r.workload == base.workload) &&
+                        (r.threads == base.threads) &&
+                        (r.length == base.length)) {
+                    c = r.find("cyclesPerWrite");
+                    break;
+                }
+            }
+            if (c == NULL) {
+                printf(" %24s", "-");
+                continue;
+            }
+            // Relative errors add up in quadrature for a ratio.
+            double ratio = c->mean() / b->mean();
+            double error = ratio * std::sqrt(
+                    std::pow(b->ci95() / b->mean(), 2) +
+                    std::pow(c->ci95() / c->mean(), 2));
+            char cell[64];
+            snprintf(cell, sizeof(cell), "%.2f (%.2fx +- %.2f)", c->mean(),
+                    ratio, error);
+            printf(" %24s", cell);
+        }
+        printf("\n");
+    }
+}
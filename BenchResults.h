@@ -0,0 +1,59 @@
+#ifndef FASTLOG_BENCHRESULTS_H
+#define FASTLOG_BENCHRESULTS_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Repeated measurements of one metric of a benchmark configuration. All
+ * metrics are lower-is-better (e.g., cycles per write).
+ */
+struct MetricSamples {
+    std::vector<double> samples;
+
+    double mean() const;
+    double stddev() const;
+    double ci95() const;
+};
+
+/**
+ * Results of one configuration of a benchmark sweep (see `FastLog --sweep`).
+ */
+struct BenchResult {
+    BenchResult()
+        : logOp()
+        , workload()
+        , threads(0)
+        , length(0)
+        , bufferEvents(0)
+        , metrics()
+    {}
+
+    std::string key() const;
+    void add(const std::string& metric, double sample);
+    const MetricSamples* find(const std::string& metric) const;
+
+    std::string logOp;
+    std::string workload;
+    int threads;
+    int length;
+
+    /// Capacity of the event buffers of the buffer manager; 0 if the
+    /// experiment doesn't use it.
+    int bufferEvents;
+
+    /// Samples of each metric, in the order they were first added.
+    std::vector<std::pair<std::string, MetricSamples>> metrics;
+};
+
+void writeBenchResults(const char* path,
+        const std::vector<BenchResult>& results);
+std::vector<BenchResult> loadBenchResults(const char* path);
+int compareBenchResults(const std::vector<BenchResult>& baseline,
+        const std::vector<BenchResult>& current, double thresholdPct);
+void printSlowdowns(const std::vector<BenchResult>& baseline,
+        const std::vector<std::string>& labels,
+        const std::vector<std::vector<BenchResult>>& instrumented);
+
+#endif //FASTLOG_BENCHRESULTS_H
@@ -1,7 +1,18 @@
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <system_error>
 #include <thread>
+#include <unistd.h>
 #include "BufferManager.h"
 #include "Context.h"
+#include "FlightRecorder.h"
+#include "PerCpuBuffers.h"
+#include "RuntimeStats.h"
 #include "Worker.h"
 
 #define LOCK(x) std::lock_guard<std::mutex> _(x)
@@ -18,51 +29,357 @@
  *
  * \pre
  *      The caller's thread-local event buffer pointer must be NULL before
- *      invoking this function (i.e., getLogBuffer() will return NULL).
+ *      invoking this function (i.e., getLogBuffer() will return NULL), or
+ *      point to an event buffer of some past epoch.
  * \return
  *      An empty event buffer ready to use.
  */
 EventBuffer*
 BufferManager::allocBuffer()
 {
+    int64_t startNs = __runtime_stats.enabled() ? steadyClockNs() : 0;
+
+    // Fast path: switch to our spare buffer without taking the lock.
+    EventBuffer* spare = swapInSpare();
+    if (spare) {
+        if (__runtime_stats.enabled()) {
+            __runtime_stats.bufferSwitched(spare->threadId, startNs, false);
+        }
+        return spare;
+    }
+
     LOCK(monitor);
-    assert(__atomic_load_n(&__log_buffer, __ATOMIC_RELAXED) == NULL);
+    assert((getLogBuffer() == NULL) || (getLogBuffer()->epoch != epoch));
 
     // Obtain an empty event buffer. Attempt to reuse old ones if possible.
-    EventBuffer* buf;
-    if (freeBufs.empty()) {
-        buf = new EventBuffer();
-    } else {
-        buf = freeBufs.back();
-        freeBufs.pop_back();
-        buf->reset();
-    }
+    EventBuffer* buf = takeFreeBuffer(capacityFor(__thr_context.threadId));
     buf->threadId = __thr_context.threadId;
     buf->epoch = epoch;
+    buf->closeQueue = closeQueue;
+    buf->openTime = steadyClockNs();
 
     // TODO: I am not entirely satisfied with all these updates. Easy to forget.
     // TODO: improve doc; update our records.
     __atomic_store_n(&__log_buffer, buf, __ATOMIC_RELAXED);
-    __thr_context.logBuffer = buf;
+    __thr_context.logBuffer.store(buf);
     allocatedBufs.push_back(buf);
     tlsBufAddrs.insert(&__log_buffer);
+    threads.insert(&__thr_context);
+    if (__runtime_stats.enabled()) {
+        __runtime_stats.bufferSwitched(buf->threadId, startNs, true);
+    }
+    return buf;
+}
+
+/**
+ * Attempt to switch the calling thread to the spare event buffer armed for it
+ * (see Context::spareBuf), which has already been registered in the current
+ * epoch. Lock-free; called without holding the monitor lock.
+ *
+ * \return
+ *      The spare buffer, now our current event buffer; NULL if there is no
+ *      spare armed for the current epoch.
+ */
+EventBuffer*
+BufferManager::swapInSpare()
+{
+    EventBuffer* spare = __thr_context.spareBuf.exchange(NULL);
+    if (spare == NULL) {
+        return NULL;
+    }
+
+    // Publish the buffer pointer *before* checking the epoch. If a coordinator
+    // ends the spare's epoch concurrently, either we see the new generation
+    // here or its (later) reclamation of `__log_buffer` overwrites our store.
+    __atomic_store_n(&__log_buffer, spare, __ATOMIC_RELAXED);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int curEpoch = __epoch_generation.value.load(std::memory_order_relaxed);
+    if (LIKELY(spare->epoch == curEpoch)) {
+        __thr_context.logBuffer.store(spare);
+        spare->openTime = steadyClockNs();
+        return spare;
+    }
+
+    // We lagged behind the buffer manager. If the spare's epoch has passed,
+    // close it (empty) so it doesn't hold up the worker; if it hasn't begun
+    // yet, keep it for later.
+    __atomic_store_n(&__log_buffer, NULL, __ATOMIC_RELAXED);
+    if (spare->epoch < curEpoch) {
+        spare->close();
+    } else {
+        __thr_context.spareBuf.store(spare);
+    }
+    return NULL;
+}
+
+/**
+ * Arm a spare event buffer for the next epoch for every thread that takes
+ * part in the current epoch and doesn't have one yet, so that these threads
+ * can move to the next epoch without contacting us (see swapInSpare()).
+ * Invoked off the application threads' critical path (i.e., by workers).
+ *
+ * \pre
+ *      The caller must hold the monitor lock.
+ */
+void
+BufferManager::armSpares()
+{
+    for (Context* context : threads) {
+        EventBuffer* curBuf = context->logBuffer.load();
+        if ((curBuf == NULL) || (curBuf->epoch != epoch) ||
+                context->spareBuf.load()) {
+            continue;
+        }
+
+        EventBuffer* spare = takeFreeBuffer(capacityFor(context->threadId));
+        spare->prefault();
+        spare->threadId = context->threadId;
+        spare->epoch = epoch + 1;
+        spare->closeQueue = nextCloseQueue;
+        nextAllocatedBufs.push_back(spare);
+        nextTlsBufAddrs.insert(context->tlsBufAddr);
+        context->spareBuf.store(spare, std::memory_order_release);
+    }
+}
+
+/**
+ * Obtain an empty event buffer, reusing a free one if possible.
+ *
+ * \param capacity
+ *      # events the buffer should hold.
+ * \pre
+ *      The caller must hold the monitor lock.
+ */
+EventBuffer*
+BufferManager::takeFreeBuffer(int capacity)
+{
+    StatsPage* stats = __runtime_stats.get();
+    if (stats) {
+        stats->buffersInFlight.add(1);
+    }
+
+    // Event buffers only take memory for the segments in use, so any free
+    // buffer will do regardless of its previous capacity.
+    if (freeBufs.empty()) {
+        return EventBuffer::createSegmented(capacity);
+    }
+    EventBuffer* buf = freeBufs.back();
+    freeBufs.pop_back();
+    buf->capacity = capacity;
+    buf->addSegment(0);
     return buf;
 }
 
+/**
+ * Get the capacity of the next event buffer for a thread.
+ *
+ * \pre
+ *      The caller must hold the monitor lock.
+ */
+int
+BufferManager::capacityFor(int threadId)
+{
+    if (targetEpochNs == 0) {
+        return bufferCapacity;
+    }
+    auto it = threadCapacities.find(threadId);
+    return (it == threadCapacities.end()) ?
+            std::min(int(MIN_ADAPTIVE_EVENTS), bufferCapacity) : it->second;
+}
+
+/**
+ * Adjust the capacity of the future event buffers of the thread that owned
+ * the given (closed) buffer, such that the thread would fill them up in about
+ * the target epoch duration at the logging rate it has shown in this one.
+ *
+ * \pre
+ *      The caller must hold the monitor lock.
+ */
+void
+BufferManager::adaptCapacity(EventBuffer* buf)
+{
+    if ((targetEpochNs == 0) || (buf->closeTime <= buf->openTime)) {
+        return;
+    }
+
+    // Move towards the ideal capacity gradually (at most 4x up or 2x down per
+    // epoch) so one unusual epoch doesn't throw us off.
+    int oldCapacity = capacityFor(buf->threadId);
+    double eventsPerNs =
+            double(buf->events) / double(buf->closeTime - buf->openTime);
+    double ideal = eventsPerNs * double(targetEpochNs);
+    ideal = std::max(ideal, oldCapacity / 2.0);
+    ideal = std::min(ideal, oldCapacity * 4.0);
+    ideal = std::max(ideal, double(MIN_ADAPTIVE_EVENTS));
+    ideal = std::min(ideal, double(bufferCapacity));
+
+    // Round up to a multiple of BATCH_SIZE; the capacity is only checked at
+    // the end of each batch anyway.
+    int batches = int(ideal) / EventBuffer::BATCH_SIZE + 1;
+    threadCapacities[buf->threadId] = batches * EventBuffer::BATCH_SIZE;
+}
+
+/**
+ * Set the capacity of the event buffers allocated from now on (or the maximum
+ * capacity if adaptive epoch sizing is enabled). Can also be set via the
+ * environment variable FASTLOG_BUFFER_EVENTS. Out-of-range values are clamped
+ * to [EventBuffer::BATCH_SIZE, EventBuffer::MAX_EVENTS].
+ */
+void
+BufferManager::setBufferCapacity(int events)
+{
+    LOCK(monitor);
+    bufferCapacity = validCapacity(events);
+}
+
+/**
+ * Enable adaptive epoch sizing: size each thread's event buffers based on its
+ * observed logging rate so that it fills them up in about the target duration.
+ * Can also be enabled via the environment variable FASTLOG_EPOCH_US (in
+ * microseconds).
+ *
+ * \param targetNs
+ *      Target epoch duration in nanoseconds; 0 disables adaptive sizing.
+ */
+void
+BufferManager::setTargetEpochDuration(int64_t targetNs)
+{
+    LOCK(monitor);
+    targetEpochNs = targetNs;
+    threadCapacities.clear();
+}
+
 /**
  * Invoked by RV-Predict worker threads to return event buffers they have
  * finished processing.
  *
  * \param bufsToRelease
  *      Event buffers to return.
+ * \param queue
+ *      Queue which the event buffers were handed to the worker through.
  */
 void
-BufferManager::release(std::vector<EventBuffer*>* bufsToRelease)
+BufferManager::release(std::vector<EventBuffer*>* bufsToRelease,
+        ClosedBufferQueue* queue)
 {
     LOCK(monitor);
     activeWorkers--;
+    StatsPage* stats = __runtime_stats.get();
+    if (stats) {
+        stats->workerQueueDepth.set(uint64_t(activeWorkers));
+    }
     for (auto buf : *bufsToRelease) {
+        if (buf->segmented) {
+            adaptCapacity(buf);
+        }
+        recycle(buf);
+    }
+    freeQueues.push_back(queue);
+    reclaimDroppedEpochs();
+
+    transitionCycles += queue->allClosedTime - queue->handoffTime;
+    transitions++;
+    if (queue->processedEvents > 0) {
+        int64_t latencyNs = steadyClockNs() - queue->handoffNs;
+        analyzedEpochs++;
+        workerEvents += queue->processedEvents;
+        workerBusyNs += queue->busyNs;
+        epochLatencyNs += latencyNs;
+        maxEpochLatencyNs = std::max(maxEpochLatencyNs, latencyNs);
+    }
+
+    // Now that we have plenty of free buffers, refill the spares.
+    armSpares();
+}
+
+/**
+ * Invoked by worker threads to return a closed event buffer of their epoch
+ * before the rest of the epoch is done with (e.g., once its events have been
+ * archived). The buffer must not be passed to release() later.
+ */
+void
+BufferManager::recycleClosed(EventBuffer* buf)
+{
+    LOCK(monitor);
+    if (buf->segmented) {
+        adaptCapacity(buf);
+    }
+    recycle(buf);
+}
+
+/**
+ * Return an event buffer that is no longer in use to the right pool.
+ *
+ * \pre
+ *      The caller must hold the monitor lock.
+ */
+void
+BufferManager::recycle(EventBuffer* buf)
+{
+    if (__runtime_stats.enabled()) {
+        __runtime_stats.bufferRecycled(buf);
+    }
+
+    // Return the segments to the pool right away so that the memory is
+    // proportional to the # events in flight.
+    buf->reset();
+    if (buf->segmented) {
         freeBufs.push_back(buf);
+    } else {
+        freeCpuBufs.push_back(buf);
+    }
+}
+
+/**
+ * Obtain an empty queue for the event buffers of a new epoch.
+ *
+ * \pre
+ *      The caller must hold the monitor lock.
+ */
+ClosedBufferQueue*
+BufferManager::allocQueue()
+{
+    // The last owners of a past epoch may still be inside push() even though
+    // its worker thread is done; skip their queue until they have left.
+    for (size_t i = 0; i < freeQueues.size(); i++) {
+        ClosedBufferQueue* queue = freeQueues[i];
+        if (queue->quiescent()) {
+            freeQueues[i] = freeQueues.back();
+            freeQueues.pop_back();
+            queue->reset();
+            return queue;
+        }
+    }
+    return ClosedBufferQueue::create();
+}
+
+/**
+ * Return the event buffers of skipped epochs to the pool once their owners
+ * have closed all of them. Until then, they may still be written.
+ *
+ * \pre
+ *      The caller must hold the monitor lock.
+ */
+void
+BufferManager::reclaimDroppedEpochs()
+{
+    // A dump may be writing them.
+    if (dumpsInProgress > 0) {
+        return;
+    }
+    for (size_t i = 0; i < droppedEpochs.size(); ) {
+        DroppedEpoch& dropped = droppedEpochs[i];
+        if (dropped.queue->closedBufs < int(dropped.bufs.size())) {
+            i++;
+            continue;
+        }
+        for (auto buf : dropped.bufs) {
+            assert(buf->closed);
+            recycle(buf);
+        }
+        freeQueues.push_back(dropped.queue);
+        dropped = droppedEpochs.back();
+        droppedEpochs.pop_back();
     }
 }
 
@@ -83,36 +400,228 @@ BufferManager::release(std::vector<EventBuffer*>* bufsToRelease)
 bool
 BufferManager::tryIncEpoch(EventBuffer::Ref* ref)
 {
+    return tryIncEpoch(ref->logBuf->epoch);
+}
+
+/**
+ * Increment the epoch number if it's still \p curEpoch. See above; used by
+ * PerCpuBuffers, whose buffers are not owned by any thread.
+ *
+ * \param curEpoch
+ *      Epoch of the full event buffer.
+ * \return
+ *      True if this thread successfully increments the epoch number.
+ */
+bool
+BufferManager::tryIncEpoch(int curEpoch)
+{
+    // Most threads lose the race; don't make them wait for the lock.
+    if (__epoch_generation.value.load() != curEpoch) {
+        return false;
+    }
+
     LOCK(monitor);
-    if (epoch != ref->logBuf->epoch) {
+    if (epoch != curEpoch) {
         return false;
     }
+    StatsPage* stats = __runtime_stats.get();
+    int64_t startNs = stats ? steadyClockNs() : 0;
 
     // We are the coordinator thread. Reclaim all event buffers allocated in
-    // this epoch by setting the "thread-local" event buffer pointers of all
-    // participating threads (including ourselves) to NULL.
-    for (auto tlsAddr : tlsBufAddrs) {
-        __atomic_store_n(tlsAddr, NULL, __ATOMIC_RELAXED);
+    // this epoch, either by setting the "thread-local" event buffer pointers
+    // of all participating threads (including ourselves) to NULL, or by just
+    // bumping the epoch generation and letting them find out by themselves.
+    uint64_t notifyStart = rdtsc();
+    __epoch_generation.value.store(epoch + 1, std::memory_order_release);
+    if (notifyMode == RECLAIM_TLS_BUFFER) {
+        for (auto tlsAddr : tlsBufAddrs) {
+            __atomic_store_n(tlsAddr, NULL, __ATOMIC_RELAXED);
+        }
     }
     tlsBufAddrs.clear();
+    notifyCycles += rdtsc() - notifyStart;
+    closeQueue->handoffTime = rdtsc();
+    closeQueue->handoffNs = steadyClockNs();
 
-    // Fire-and-forget a worker thread.
-    if (activeWorkers < MAX_WORKERS) {
-        std::thread worker(workerMain, this, allocatedBufs);
+    // Fire-and-forget a worker thread. It will start processing the event
+    // buffers as soon as their owners close them. In flight recorder mode,
+    // keep the epoch around instead and let go of the oldest one.
+    if (recorderEpochs > 0) {
+        recordedEpochs.push_back({allocatedBufs, closeQueue});
+        while (int(recordedEpochs.size()) > recorderEpochs) {
+            droppedEpochs.push_back(recordedEpochs.front());
+            recordedEpochs.pop_front();
+        }
+        // No worker will revoke the buffers of idle threads for us.
+        closeIdleBuffers();
+    } else if (__remote_analyzers.enabled() &&
+            !__remote_analyzers.hasCredit()) {
+        // Analyzer nodes are falling behind; shed load rather than piling up
+        // event buffers.
+        DEBUG("No credit from analyzer nodes. Skip processing epoch %d\n",
+                epoch);
+        droppedEpochs.push_back({allocatedBufs, closeQueue});
+        if (stats) {
+            stats->droppedEpochs.add(1);
+        }
+    } else if (activeWorkers < MAX_WORKERS) {
+        // With a shared region or analyzer nodes, the analysis is done by
+        // other processes; we only need to hand the buffers over.
+        std::thread worker(__remote_analyzers.enabled() ? senderMain :
+                __shared_region.enabled() ? forwarderMain : workerMain,
+                this, allocatedBufs, closeQueue);
         worker.detach();
         activeWorkers++;
+        if (stats) {
+            stats->handedOffEpochs.add(1);
+            stats->workerQueueDepth.set(uint64_t(activeWorkers));
+        }
     } else {
         DEBUG("Too many active workers. Skip processing epoch %d\n", epoch);
-        freeBufs.insert(freeBufs.end(), allocatedBufs.begin(),
-                allocatedBufs.end());
+        droppedEpochs.push_back({allocatedBufs, closeQueue});
+        if (stats) {
+            stats->droppedEpochs.add(1);
+        }
     }
+    // Put the epoch in the ring before its buffers can be recycled, or their
+    // events won't be accounted for in it.
+    if (stats) {
+        int64_t now = steadyClockNs();
+        __runtime_stats.epochEnded(epoch, now - epochStartNs,
+                int(allocatedBufs.size()));
+        epochStartNs = now;
+    }
+    reclaimDroppedEpochs();
+
+    // Spares armed for the next epoch are already part of it.
     allocatedBufs.clear();
+    allocatedBufs.swap(nextAllocatedBufs);
+    tlsBufAddrs.swap(nextTlsBufAddrs);
+    closeQueue = nextCloseQueue;
+    nextCloseQueue = allocQueue();
 
     // Start of the new epoch.
     epoch++;
+    if (recorderEpochs > 0) {
+        publishRecorderSnapshot();
+    }
+    if (stats) {
+        stats->tryIncEpochNs.record(steadyClockNs() - startNs);
+    }
     return true;
 }
 
+/**
+ * Invoked by PerCpuBuffers to get an event buffer for some CPU in the current
+ * epoch. Unlike per-thread buffers, per-CPU buffers are contiguous: there are
+ * only a few of them and they are shared by many threads, so they fill up
+ * quickly anyway.
+ *
+ * \return
+ *      An empty event buffer registered in the current epoch; the caller is
+ *      responsible for closing it at the end of the epoch.
+ */
+EventBuffer*
+BufferManager::allocCpuBuffer()
+{
+    LOCK(monitor);
+    StatsPage* stats = __runtime_stats.get();
+    if (stats) {
+        stats->buffersInFlight.add(1);
+    }
+    EventBuffer* buf;
+    if (freeCpuBufs.empty()) {
+        buf = EventBuffer::create(bufferCapacity);
+    } else {
+        // Contiguous storage can't grow; only reuse buffers that are just
+        // right in case the capacity has been changed.
+        buf = freeCpuBufs.back();
+        freeCpuBufs.pop_back();
+        if (buf->capacity != bufferCapacity) {
+            EventBuffer::destroy(buf);
+            buf = EventBuffer::create(bufferCapacity);
+        }
+    }
+    buf->epoch = epoch;
+    buf->closeQueue = closeQueue;
+    buf->openTime = steadyClockNs();
+    allocatedBufs.push_back(buf);
+    return buf;
+}
+
+/**
+ * Invoked by worker threads, when they have waited too long for the event
+ * buffers of an old epoch to be closed, to close the buffers of threads that
+ * are not currently logging (e.g., blocked in a system call or simply idle).
+ * Spare buffers armed for an old epoch but never switched to are closed too,
+ * and so are the per-CPU buffers of an old epoch.
+ *
+ * It's safe to close such a buffer on the owner's behalf: its #events has
+ * been published when the owner left the fast path, and the owner will see
+ * its `__log_buffer` reclaimed and switch to a fresh buffer once it's back.
+ * The buffer is taken away from the owner before it's closed, so the owner
+ * won't close it again after it has been recycled.
+ * Buffers of threads in the fast path are left alone; they will be closed by
+ * their owners as soon as they log the next event.
+ */
+void
+BufferManager::revokeIdleBuffers()
+{
+    {
+        LOCK(monitor);
+        closeIdleBuffers();
+    }
+
+    // Rotating the per-CPU buffers takes the monitor lock itself (after the
+    // lock of PerCpuBuffers).
+    __cpu_buffers.rotateStale();
+}
+
+/**
+ * Close the event buffers of old epochs whose owners are not currently
+ * logging; see revokeIdleBuffers().
+ *
+ * \pre
+ *      The caller must hold the monitor lock.
+ */
+void
+BufferManager::closeIdleBuffers()
+{
+    // Pairs with the fence in getLogBufferRef(): any thread entering the fast
+    // path after this point is guaranteed to see its `__log_buffer` reclaimed
+    // (or the new epoch generation) by tryIncEpoch, which happens-before us
+    // via the monitor lock.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (Context* context : threads) {
+        // The owner may be swapping in its spare right now; whoever clears
+        // `spareBuf` first gets to decide what to do with it.
+        EventBuffer* spare = context->spareBuf.load();
+        if (spare && (spare->epoch < epoch) &&
+                context->spareBuf.compare_exchange_strong(spare, NULL)) {
+            spare->close();
+        }
+
+        // The buffer can't be recycled (and reused) under our feet: that
+        // takes the monitor lock.
+        EventBuffer* buf = context->logBuffer.load();
+        if ((buf == NULL) || (buf->epoch == epoch) ||
+                context->inFastPath.load(std::memory_order_acquire)) {
+            continue;
+        }
+
+        // The owner may be entering the fast path right now; whoever clears
+        // `logBuffer` first closes the buffer. `__log_buffer` still points to
+        // the buffer in EPOCH_GENERATION mode, so reclaim it too (unless the
+        // owner has moved on already).
+        if (context->logBuffer.compare_exchange_strong(buf, NULL)) {
+            EventBuffer* expected = buf;
+            __atomic_compare_exchange_n(context->tlsBufAddr, &expected, NULL,
+                    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            buf->close();
+        }
+    }
+}
+
 /**
  * Invoked by application threads to return their event buffer when they
  * are about to exit.
@@ -122,8 +631,354 @@ BufferManager::threadExit()
 {
     LOCK(monitor);
     DEBUG("thread %d exits\n", __thr_context.threadId);
-    if (__thr_context.logBuffer) {
-        __thr_context.logBuffer->closed = true;
+    threadCapacities.erase(__thr_context.threadId);
+    EventBuffer* buf = __thr_context.logBuffer.exchange(NULL);
+    if (buf) {
+        buf->close();
+    }
+    EventBuffer* spare = __thr_context.spareBuf.exchange(NULL);
+    if (spare) {
+        spare->close();
     }
     tlsBufAddrs.erase(&__log_buffer);
+    nextTlsBufAddrs.erase(&__log_buffer);
+    threads.erase(&__thr_context);
+}
+
+/**
+ * Print statistics about the epoch transitions so far.
+ */
+void
+BufferManager::printStats()
+{
+    LOCK(monitor);
+    printf("epochs %d, notifyCyclesPerEpoch %.2f, "
+           "transitionCyclesPerEpoch %.2f\n", epoch,
+           epoch ? double(notifyCycles) / epoch : 0.0,
+           transitions ? double(transitionCycles) / transitions : 0.0);
+    if (workerEvents > 0) {
+        printf("analyzedEpochs %d, workerEvents %lu, "
+               "eventsPerWorkerSec %.2fM, epochLatencyMs avg %.2f max %.2f\n",
+                analyzedEpochs, workerEvents,
+                double(workerEvents) / double(workerBusyNs) * 1e3,
+                double(epochLatencyNs) / analyzedEpochs * 1e-6,
+                double(maxEpochLatencyNs) * 1e-6);
+    }
+    if (recorderEpochs > 0) {
+        printf("recordedEpochs %lu, recorderEpochs %d\n",
+                recordedEpochs.size(), recorderEpochs);
+    }
+}
+
+/**
+ * \return
+ *      # epochs that have ended but whose worker thread hasn't returned the
+ *      event buffers yet (or, in flight recorder mode, that are recorded).
+ */
+int
+BufferManager::pendingEpochs()
+{
+    LOCK(monitor);
+    return epoch - transitions;
+}
+
+static void
+handleDumpSignal(int)
+{
+    __buf_manager.requestFlightRecorderDump();
+}
+
+static void
+handleAbortSignal(int)
+{
+    __buf_manager.dumpFlightRecorderOnAbort();
+
+    // The handler has been reset; terminate as if we hadn't caught the signal
+    // (it's delivered again once we return), even if it didn't come from
+    // abort().
+    raise(SIGABRT);
+}
+
+/**
+ * Dump the flight recorder on SIGUSR2 (from the dumper thread) and when the
+ * program aborts. Only sets things up once, except for (re)opening the dump
+ * path for the SIGABRT handler.
+ *
+ * \pre
+ *      The caller must hold the monitor lock, or be the constructor.
+ * \throw std::system_error
+ *      The pipe to the dumper thread couldn't be created.
+ */
+void
+BufferManager::installFlightRecorderHooks()
+{
+    openAbortDumpFile();
+    if (recorderHooksInstalled) {
+        return;
+    }
+    if (pipe2(dumpPipe, O_CLOEXEC) != 0) {
+        throw std::system_error(errno, std::system_category(), "pipe2");
+    }
+    // The signal handler mustn't block; if the pipe is full, there are
+    // enough dumps pending already.
+    fcntl(dumpPipe[1], F_SETFL, O_NONBLOCK);
+    std::thread dumper(dumperMain, this);
+    dumper.detach();
+    recorderHooksInstalled = true;
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = handleDumpSignal;
+    sigaction(SIGUSR2, &action, NULL);
+
+    // Let abort() go on with the default action once we are done.
+    action.sa_flags = SA_RESETHAND;
+    action.sa_handler = handleAbortSignal;
+    sigaction(SIGABRT, &action, NULL);
+}
+
+/**
+ * Open the dump path in advance for the SIGABRT handler, closing the file
+ * opened for the previous path, if any. The file is created if needed but
+ * not truncated, so a dump from an earlier run survives until there is a new
+ * one.
+ */
+void
+BufferManager::openAbortDumpFile()
+{
+    int fd = ::open(recorderPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC,
+            0644);
+    int old = abortDumpFd.exchange(fd);
+    if (old >= 0) {
+        ::close(old);
+    }
+}
+
+/**
+ * Rebuild the snapshot of the close queues read by the SIGABRT handler (see
+ * #snapshotQueues) from the epochs kept so far.
+ *
+ * \pre
+ *      The caller must hold the monitor lock, or be the constructor.
+ */
+void
+BufferManager::resetRecorderSnapshot()
+{
+    for (std::atomic<ClosedBufferQueue*>& queue : snapshotQueues) {
+        queue.store(NULL);
+    }
+    int recorded = epoch - int(recordedEpochs.size());
+    for (const DroppedEpoch& dropped : recordedEpochs) {
+        snapshotQueues[recorded++ % SNAPSHOT_SLOTS].store(dropped.queue);
+    }
+    publishRecorderSnapshot();
+}
+
+/**
+ * Add the close queue of the current epoch to the snapshot read by the
+ * SIGABRT handler. The queues of the epochs kept by the flight recorder are
+ * there already.
+ *
+ * \pre
+ *      The caller must hold the monitor lock, or be the constructor.
+ */
+void
+BufferManager::publishRecorderSnapshot()
+{
+    snapshotQueues[epoch % SNAPSHOT_SLOTS].store(closeQueue,
+            std::memory_order_release);
+    snapshotEpoch.store(epoch, std::memory_order_release);
+}
+
+/**
+ * Main loop of the dumper thread, which writes the dumps requested with
+ * SIGUSR2. Signal handlers can't safely do it themselves, and leaving it to
+ * the coordinator of the next epoch change would stall an application
+ * thread.
+ */
+void
+BufferManager::dumperMain(BufferManager* manager)
+{
+    char request;
+    while (true) {
+        ssize_t n = ::read(manager->dumpPipe[0], &request, sizeof(request));
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        try {
+            int dumped = manager->dumpFlightRecorder();
+            DEBUG("Flight recorder dumped %d event buffers\n", dumped);
+        } catch (const std::system_error& e) {
+            DEBUG("Flight recorder dump failed: %s\n", e.what());
+        }
+    }
+}
+
+/**
+ * Ask the dumper thread for a dump of the flight recorder to its dump path.
+ * Async-signal-safe: only writes a byte to a pipe.
+ */
+void
+BufferManager::requestFlightRecorderDump()
+{
+    int savedErrno = errno;
+    char request = 0;
+    ssize_t written = ::write(dumpPipe[1], &request, sizeof(request));
+    (void) written;
+    errno = savedErrno;
+}
+
+/**
+ * Turn the flight recorder mode on or off. In this mode, no worker threads
+ * are started; the event buffers of the last \p epochs epochs are kept
+ * instead, so that the trace leading up to an incident can be dumped (see
+ * dumpFlightRecorder()). Older epochs are recycled as soon as their buffers
+ * are closed, so memory stays bounded by the # epochs kept. Can also be
+ * turned on via the environment variables FASTLOG_RECORDER_EPOCHS and
+ * FASTLOG_RECORDER_PATH.
+ *
+ * \param epochs
+ *      # epochs to keep, at most MAX_RECORDER_EPOCHS; 0 turns the flight
+ *      recorder off.
+ * \param dumpPath
+ *      Where to dump the epochs on SIGUSR2 or abort().
+ */
+void
+BufferManager::setFlightRecorder(int epochs, const std::string& dumpPath)
+{
+    LOCK(monitor);
+    recorderEpochs = validRecorderEpochs(epochs);
+    recorderPath = dumpPath;
+    while (int(recordedEpochs.size()) > recorderEpochs) {
+        droppedEpochs.push_back(recordedEpochs.front());
+        recordedEpochs.pop_front();
+    }
+    reclaimDroppedEpochs();
+    if (recorderEpochs > 0) {
+        installFlightRecorderHooks();
+        resetRecorderSnapshot();
+    }
+}
+
+/**
+ * Write the closed event buffers of the epochs kept by the flight recorder,
+ * and of the current epoch, to a file (see FlightRecord for the format).
+ * Buffers that are still being written are skipped. The file is written
+ * without the monitor lock: epochs may end meanwhile, but no buffer is
+ * recycled until the dump is done.
+ *
+ * \param path
+ *      File to write; NULL for the dump path of the flight recorder.
+ * \param compress
+ *      Compress the events with EventCodec.
+ * \return
+ *      # event buffers written.
+ * \throw std::system_error
+ *      The file couldn't be written.
+ */
+int
+BufferManager::dumpFlightRecorder(const char* path, bool compress)
+{
+    std::string dumpPath;
+    std::vector<EventBuffer*> bufs;
+    {
+        LOCK(monitor);
+        dumpPath = path ? path : recorderPath;
+        for (const DroppedEpoch& recorded : recordedEpochs) {
+            bufs.insert(bufs.end(), recorded.bufs.begin(),
+                    recorded.bufs.end());
+        }
+        bufs.insert(bufs.end(), allocatedBufs.begin(), allocatedBufs.end());
+        dumpsInProgress++;
+    }
+
+    int fd = ::open(dumpPath.c_str(),
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int dumped = (fd < 0) ? -1 : writeFlightRecorder(fd, bufs, compress);
+    int error = errno;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    {
+        LOCK(monitor);
+        dumpsInProgress--;
+        reclaimDroppedEpochs();
+    }
+    if (dumped < 0) {
+        throw std::system_error(error, std::system_category(), dumpPath);
+    }
+    return dumped;
+}
+
+/**
+ * Invoked from the SIGABRT handler to dump the flight recorder, uncompressed,
+ * to its dump path. Only async-signal-safe: writes to the file opened in
+ * advance, and finds the closed buffers of each epoch by walking its close
+ * queue (see #snapshotQueues), most recently closed first. Buffers that are
+ * still open, such as the aborting thread's, are left out. Best effort: an
+ * epoch change at the same time may cause buffers to be missed or written
+ * twice.
+ */
+void
+BufferManager::dumpFlightRecorderOnAbort()
+{
+    int fd = abortDumpFd.load();
+    if ((recorderEpochs == 0) || (fd < 0)) {
+        return;
+    }
+    // Nothing else writes through this file, so it's still at offset 0.
+    if (ftruncate(fd, 0) != 0) {
+        return;
+    }
+    int newest = snapshotEpoch.load(std::memory_order_acquire);
+    for (int e = std::max(0, newest - recorderEpochs); e <= newest; e++) {
+        ClosedBufferQueue* queue = snapshotQueues[e % SNAPSHOT_SLOTS].load(
+                std::memory_order_acquire);
+        if (queue == NULL) {
+            continue;
+        }
+        EventBuffer* buf = queue->head.load(std::memory_order_acquire);
+        for (; buf != NULL; buf = buf->nextClosed) {
+            if (!writeFlightRecord(fd, buf)) {
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Write the closed event buffers among \p bufs to \p fd.
+ *
+ * \return
+ *      # event buffers written; -1 if a write failed (with errno set).
+ */
+int
+BufferManager::writeFlightRecorder(int fd,
+        const std::vector<EventBuffer*>& bufs, bool compress)
+{
+    std::unique_ptr<EventCodec> codec(compress ? new EventCodec() : NULL);
+    int dumped = 0;
+    for (EventBuffer* buf : bufs) {
+        if (!buf->closed) {
+            continue;
+        }
+        bool ok;
+        if (codec) {
+            ArchivedEpoch archived(buf->epoch);
+            EpochArchive::archive(buf, codec.get(), &archived);
+            ok = writeFlightRecord(fd, buf->epoch, archived.buffers[0]);
+        } else {
+            ok = writeFlightRecord(fd, buf);
+        }
+        if (!ok) {
+            return -1;
+        }
+        dumped++;
+    }
+    return dumped;
 }
@@ -1,56 +1,329 @@
 #ifndef FASTLOG_BUFFERMANAGER_H
 #define FASTLOG_BUFFERMANAGER_H
 
+#include <algorithm>
 #include <atomic>
+#include <deque>
 #include <mutex>
+#include <string>
 #include <vector>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "EventBuffer.h"
 #include "Utils.h"
 
+struct Context;
+
+/// A word on a cache line of its own: aligning the type pads its size to a
+/// whole line too, so the variables that follow can't share it.
+struct CACHE_ALIGNED EpochGeneration {
+    std::atomic<int> value;
+};
+
+/// Current epoch number, published by the buffer manager for application
+/// threads to poll. Written once per epoch, so it stays in the caches of the
+/// reading cores. Kept outside BufferManager to avoid false sharing with the
+/// monitor lock.
+extern EpochGeneration __epoch_generation;
+
 /// TODO: doc
 class BufferManager {
   public:
+    /// How the coordinator tells other application threads about an epoch
+    /// change.
+    enum NotifyMode {
+        /// Store NULL into the `__log_buffer` of every participating thread.
+        /// Threads check the pointer on each event.
+        RECLAIM_TLS_BUFFER,
+
+        /// Only bump `__epoch_generation`. Threads compare it against the
+        /// epoch of their event buffers on the periodic (nextRdtscTime) slow
+        /// path, so the coordinator's cost doesn't grow with #threads.
+        EPOCH_GENERATION,
+    };
+
     explicit BufferManager()
         : monitor()
+        , notifyMode(RECLAIM_TLS_BUFFER)
         , activeWorkers()
         , epoch(0)
+        , epochStartNs(steadyClockNs())
+        , bufferCapacity(validCapacity(getEnvInt("FASTLOG_BUFFER_EVENTS",
+                EventBuffer::MAX_EVENTS)))
+        , targetEpochNs(getEnvInt("FASTLOG_EPOCH_US", 0) * 1000)
+        , threadCapacities()
         , allocatedBufs()
+        , closeQueue(ClosedBufferQueue::create())
+        , nextAllocatedBufs()
+        , nextCloseQueue(ClosedBufferQueue::create())
         , freeBufs()
+        , freeCpuBufs()
+        , freeQueues()
+        , droppedEpochs()
+        , recorderEpochs(validRecorderEpochs(
+                getEnvInt("FASTLOG_RECORDER_EPOCHS", 0)))
+        , recorderPath(std::getenv("FASTLOG_RECORDER_PATH") ?
+                std::getenv("FASTLOG_RECORDER_PATH") : "fastlog-recorder.bin")
+        , recordedEpochs()
+        , dumpsInProgress(0)
+        , recorderHooksInstalled(false)
+        , dumpPipe{-1, -1}
+        , abortDumpFd(-1)
+        , snapshotEpoch(0)
+        , snapshotQueues()
         , tlsBufAddrs()
-    {}
+        , nextTlsBufAddrs()
+        , threads()
+        , notifyCycles(0)
+        , transitionCycles(0)
+        , transitions(0)
+        , analyzedEpochs(0)
+        , workerEvents(0)
+        , workerBusyNs(0)
+        , epochLatencyNs(0)
+        , maxEpochLatencyNs(0)
+    {
+        if (recorderEpochs > 0) {
+            installFlightRecorderHooks();
+            resetRecorderSnapshot();
+        }
+    }
 
     EventBuffer* allocBuffer();
-    void release(std::vector<EventBuffer*>* bufsToRelease);
+    void release(std::vector<EventBuffer*>* bufsToRelease,
+            ClosedBufferQueue* queue);
+    void recycleClosed(EventBuffer* buf);
     bool tryIncEpoch(EventBuffer::Ref* ref);
+    bool tryIncEpoch(int curEpoch);
+    EventBuffer* allocCpuBuffer();
+    void revokeIdleBuffers();
     void threadExit();
+    void printStats();
+    int pendingEpochs();
+    void setFlightRecorder(int epochs, const std::string& dumpPath);
+    int dumpFlightRecorder(const char* path = NULL, bool compress = false);
+    void dumpFlightRecorderOnAbort();
+    void requestFlightRecorderDump();
+
+    /// True if the flight recorder mode is on (see setFlightRecorder()).
+    bool
+    flightRecorderEnabled() const
+    {
+        return recorderEpochs > 0;
+    }
+
+    void
+    setNotifyMode(NotifyMode mode)
+    {
+        notifyMode = mode;
+    }
+
+    void setBufferCapacity(int events);
+    void setTargetEpochDuration(int64_t targetNs);
+
+    /// Capacity of the first event buffer of each thread when adaptive epoch
+    /// sizing is enabled. Small so that short-lived threads (and programs)
+    /// pay little for logging.
+    static const int MIN_ADAPTIVE_EVENTS = 1 << 16;
+
+    /// How long a worker thread waits for the next event buffer of its epoch
+    /// to be closed before asking the buffer manager to revoke the buffers of
+    /// idle threads. Should be much larger than the cross-core communication
+    /// delay and much smaller than the duration of an epoch.
+    static const int64_t REVOKE_TIMEOUT_NS = 100000;
+
+    /// Most epochs the flight recorder can keep.
+    static const int MAX_RECORDER_EPOCHS = 1024;
 
   private:
+    /**
+     * Clamp a requested event buffer capacity to [BATCH_SIZE, MAX_EVENTS]:
+     * the fast path only checks for a full buffer once per batch, and the
+     * runtime isn't sized for buffers larger than MAX_EVENTS.
+     */
+    static int
+    validCapacity(int64_t events)
+    {
+        return int(std::max<int64_t>(EventBuffer::BATCH_SIZE,
+                std::min<int64_t>(events, EventBuffer::MAX_EVENTS)));
+    }
+
+    /**
+     * Clamp a requested # epochs for the flight recorder to keep to
+     * [0, MAX_RECORDER_EPOCHS], which the snapshot read on abort is sized
+     * for.
+     */
+    static int
+    validRecorderEpochs(int64_t epochs)
+    {
+        return int(std::max<int64_t>(0,
+                std::min<int64_t>(epochs, MAX_RECORDER_EPOCHS)));
+    }
+
+    EventBuffer* swapInSpare();
+    void armSpares();
+    EventBuffer* takeFreeBuffer(int capacity);
+    int capacityFor(int threadId);
+    void adaptCapacity(EventBuffer* buf);
+    ClosedBufferQueue* allocQueue();
+    void reclaimDroppedEpochs();
+    void recycle(EventBuffer* buf);
+    void closeIdleBuffers();
+    void installFlightRecorderHooks();
+    void openAbortDumpFile();
+    void resetRecorderSnapshot();
+    void publishRecorderSnapshot();
+    static void dumperMain(BufferManager* manager);
+    static int writeFlightRecorder(int fd,
+            const std::vector<EventBuffer*>& bufs, bool compress);
+
+    /// Event buffers of an epoch that no worker thread processes, either
+    /// because there were too many active workers or because the flight
+    /// recorder keeps them. They can be reused once their owners have closed
+    /// them.
+    struct DroppedEpoch {
+        std::vector<EventBuffer*> bufs;
+        ClosedBufferQueue* queue;
+    };
+
     /// Provides monitor-style synchronization for this class, effectively
     /// serializing all member function calls.
     std::mutex monitor;
 
+    /// How to notify application threads about epoch changes.
+    NotifyMode notifyMode;
+
     /// # worker threads currently active.
     int activeWorkers;
 
     /// Definitive truth of our current epoch.
     int epoch;
 
+    /// When the current epoch started; only kept up to date if the runtime
+    /// publishes its stats (see RuntimeStats).
+    int64_t epochStartNs;
+
+    /// # events each event buffer can hold (at most, in adaptive mode).
+    int bufferCapacity;
+
+    /// Target epoch duration in nanoseconds. 0 if adaptive epoch sizing is
+    /// disabled.
+    int64_t targetEpochNs;
+
+    /// Event buffer capacity chosen for each thread (identified by thread ID)
+    /// in adaptive mode.
+    std::unordered_map<int, int> threadCapacities;
+
     /// Event buffers allocated in the current epoch. Must be passed to a worker
     /// thread for processing at the end of the epoch. Always empty at the
     /// beginning of a new epoch.
     std::vector<EventBuffer*> allocatedBufs;
 
-    /// Pool of event buffers that are currently available.
+    /// Queue that the event buffers allocated in the current epoch will be
+    /// pushed onto as they are closed. Handed to the worker thread together
+    /// with allocatedBufs at the end of the epoch.
+    ClosedBufferQueue* closeQueue;
+
+    /// Spare event buffers armed for the next epoch (see Context::spareBuf).
+    /// Become part of allocatedBufs when the next epoch starts.
+    std::vector<EventBuffer*> nextAllocatedBufs;
+
+    /// Queue that the buffers in nextAllocatedBufs will be pushed onto.
+    ClosedBufferQueue* nextCloseQueue;
+
+    /// Pool of event buffers that are currently available. They don't hold
+    /// any segments.
     std::vector<EventBuffer*> freeBufs;
 
+    /// Pool of (contiguous) per-CPU event buffers that are currently
+    /// available (see PerCpuBuffers).
+    std::vector<EventBuffer*> freeCpuBufs;
+
+    /// Pool of closed buffer queues that are currently available.
+    std::vector<ClosedBufferQueue*> freeQueues;
+
+    /// Epochs skipped due to too many active workers whose event buffers are
+    /// not all closed yet.
+    std::vector<DroppedEpoch> droppedEpochs;
+
+    /// # most recent epochs the flight recorder keeps instead of handing them
+    /// to worker threads; 0 if the flight recorder is off. Set via the
+    /// environment variable FASTLOG_RECORDER_EPOCHS.
+    int recorderEpochs;
+
+    /// Where to dump the flight recorder on request or abort. Set via the
+    /// environment variable FASTLOG_RECORDER_PATH.
+    std::string recorderPath;
+
+    /// Epochs kept by the flight recorder, oldest first.
+    std::deque<DroppedEpoch> recordedEpochs;
+
+    /// # dumps being written without the monitor lock. The buffers of
+    /// dropped epochs aren't recycled until they are done.
+    int dumpsInProgress;
+
+    /// True once the signal handlers and the dumper thread are set up.
+    bool recorderHooksInstalled;
+
+    /// Self-pipe from the SIGUSR2 handler (write end) to the dumper thread
+    /// (read end), one byte per dump requested.
+    int dumpPipe[2];
+
+    /// The dump path, opened in advance for the SIGABRT handler, which can't
+    /// open it safely itself; -1 if it couldn't be opened.
+    std::atomic<int> abortDumpFd;
+
+    /// # of the newest epoch in #snapshotQueues.
+    std::atomic<int> snapshotEpoch;
+
+    /// Close queues of the epochs kept by the flight recorder and of the
+    /// current epoch, indexed by epoch # modulo the array size. The SIGABRT
+    /// handler can neither take the monitor lock nor walk our vectors; it
+    /// finds the closed buffers of each epoch through these instead. One
+    /// slot more than ever read, so that the slot of the newest epoch isn't
+    /// one a handler running concurrently may still be reading.
+    static const int SNAPSHOT_SLOTS = MAX_RECORDER_EPOCHS + 2;
+    std::atomic<ClosedBufferQueue*> snapshotQueues[SNAPSHOT_SLOTS];
+
     /// Pointers to the global thread local variable `__log_buffer` of all
     /// threads that are participating in the current epoch. When a thread
     /// exits, its TLS address will become invalid and must be removed from
     /// this set (that's why we need to keep a separate allocatedBufs).
     std::unordered_set<EventBuffer**> tlsBufAddrs;
 
+    /// `__log_buffer` addresses of the threads with a spare event buffer
+    /// armed for the next epoch. Become tlsBufAddrs when the next epoch starts.
+    std::unordered_set<EventBuffer**> nextTlsBufAddrs;
+
+    /// Contexts of all live threads that have been assigned an event buffer.
+    /// Used to revoke the buffers of threads that have gone idle.
+    std::unordered_set<Context*> threads;
+
+    /// Total # cycles spent by coordinators notifying other threads about
+    /// epoch changes.
+    uint64_t notifyCycles;
+
+    /// Total # cycles between the end of an epoch and the moment its worker
+    /// thread got hold of the last event buffer of the epoch.
+    uint64_t transitionCycles;
+
+    /// # epoch transitions measured in #transitionCycles.
+    int transitions;
+
+    /// # epochs analyzed by in-process worker threads.
+    int analyzedEpochs;
+
+    /// Total # events analyzed by worker threads, and the time they spent
+    /// doing so; measures the throughput of the consumer side.
+    uint64_t workerEvents;
+    int64_t workerBusyNs;
+
+    /// Total and maximum time between the end of an epoch and the moment its
+    /// worker thread was done with it.
+    int64_t epochLatencyNs;
+    int64_t maxEpochLatencyNs;
+
     // TODO: how to set this? std::thread::hardware_concurrency()? How to
     // avoid #AppThreads+#Workers > cores? How to dynamically adjust #workers?
     // How to avoid meaningless thread migrations?
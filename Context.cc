@@ -1,7 +1,47 @@
+#include <pthread.h>
+
 #include "Context.h"
+#include "EpochArchive.h"
+#include "PerCpuBuffers.h"
+#include "RemoteAnalyzers.h"
+#include "RuntimeStats.h"
+#include "SharedRegion.h"
 
-__thread EventBuffer* __log_buffer = NULL;
-thread_local BufferManager __buf_manager;
+CACHE_ALIGNED __thread EventBuffer* __log_buffer = NULL;
+RuntimeStats __runtime_stats;
+BufferManager __buf_manager;
+SharedRegion __shared_region;
+SegmentPool __segment_pool;
+PerCpuBuffers __cpu_buffers;
+EpochArchive __epoch_archive;
+RemoteAnalyzers __remote_analyzers;
+EpochGeneration __epoch_generation = {{0}};
 thread_local Context __thr_context;
 std::atomic<int> Context::threadCounter(0);
-std::atomic<uint32_t> __event_id_counter(0);
+uint32_t __event_id_counter = 0;
+
+/**
+ * Look up the bounds of the calling thread's stack. For the main thread,
+ * these cover the size the stack may grow to (RLIMIT_STACK).
+ *
+ * \return
+ *      Empty bounds if they can't be determined, so that nothing is
+ *      filtered.
+ */
+StackBounds
+Context::lookUpStackBounds()
+{
+    StackBounds bounds = {0, 0};
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return bounds;
+    }
+    void* addr;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        bounds.lo = uintptr_t(addr);
+        bounds.size = size;
+    }
+    pthread_attr_destroy(&attr);
+    return bounds;
+}
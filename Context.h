@@ -1,6 +1,8 @@
 #ifndef FASTLOG_CONTEXT_H
 #define FASTLOG_CONTEXT_H
 
+#include <new>
+
 #include "BufferManager.h"
 
 // TODO: introduce a namespace __rvp_context?
@@ -9,9 +11,87 @@
 // two reasons: 1) I need a thread-unsafe version of read in getLogBufferUnsafe
 // 2) "__thread" requires trivial ctor and "thread_local" seems to result in
 // worse code?
+// Note: the coordinator writes this pointer of other threads, so it's defined
+// on a cache line of its own (the next TLS variable, __thr_context, is cache
+// line aligned as well).
 extern __thread EventBuffer* __log_buffer;
 
-extern thread_local BufferManager __buf_manager;
+/// The buffer manager shared by all threads.
+extern BufferManager __buf_manager;
+
+/// Bounds of a thread's stack: [lo, lo + size).
+struct StackBounds {
+    uintptr_t lo;
+    uintptr_t size;
+
+    /// One subtraction and one comparison, cheap enough for the fast path.
+    __attribute__((always_inline, target("no-sse")))
+    bool
+    contains(const void* addr) const
+    {
+        return uintptr_t(addr) - lo < size;
+    }
+};
+
+// TODO:
+struct CACHE_ALIGNED Context {
+    // FIXME: the ctor should be called by the interceptor of pthread_create?
+    Context()
+        : threadId(threadCounter.fetch_add(1))
+        , logBuffer(NULL)
+        , inFastPath(false)
+        , spareBuf(NULL)
+        , tlsBufAddr(&__log_buffer)
+        , stack(lookUpStackBounds())
+    {
+        printf("thread context %d init\n", threadId);
+    }
+
+    ~Context()
+    {
+        __buf_manager.threadExit();
+        printf("context destroyed\n");
+        // TODO: return my event buffer to buffer manager
+    }
+
+    /// Unique identifier of the thread this context belongs to.
+    const int threadId;
+
+    /// The most recent event buffer that is assigned to us. NULL once it has
+    /// been closed, by us or by the buffer manager on our behalf (see
+    /// BufferManager::revokeIdleBuffers()); whoever clears it first closes
+    /// the buffer, so that we never close a buffer that has been recycled.
+    std::atomic<EventBuffer*> logBuffer;
+
+    /// True while this thread holds an EventBuffer::Ref, i.e., it may be
+    /// writing to `logBuffer` without having published its #events. The
+    /// buffer manager can close `logBuffer` on our behalf only when this flag
+    /// is clear. Instrumented code must leave the fast path (i.e., drop its
+    /// Ref) around blocking calls, or it can hold its epoch open.
+    std::atomic<bool> inFastPath;
+
+    /// Empty event buffer armed by the buffer manager for the epoch after
+    /// that of `logBuffer`. We switch to it at the epoch boundary with one
+    /// atomic exchange instead of calling into the buffer manager; NULL if
+    /// none has been armed (yet). Written by the buffer manager, so it gets
+    /// a cache line of its own.
+    CACHE_ALIGNED std::atomic<EventBuffer*> spareBuf;
+
+    /// Address of our `__log_buffer`.
+    EventBuffer** const tlsBufAddr;
+
+    /// Bounds of our stack, looked up once since that takes a few system
+    /// calls. Accesses to the stack can be dropped on the fast path (see
+    /// isThreadPrivate()); empty if the bounds are unknown.
+    const StackBounds stack;
+
+    static StackBounds lookUpStackBounds();
+
+    /// Used to generate unique thread IDs.
+    static std::atomic<int> threadCounter;
+};
+
+extern thread_local Context __thr_context;
 
 // FIXME: make methods in this header static? meaning?
 
@@ -29,6 +109,19 @@ getLogBuffer()
     return __atomic_load_n(&__log_buffer, __ATOMIC_RELAXED);
 }
 
+/**
+ * Check if an event buffer belongs to a past epoch, in which case it must be
+ * closed and replaced. Only needed in BufferManager::EPOCH_GENERATION mode;
+ * otherwise, the buffer manager reclaims `__log_buffer` directly.
+ */
+inline bool
+epochChanged(EventBuffer* logBuf)
+{
+    // Buffers not managed by the buffer manager (i.e., epoch -1) never expire.
+    return (logBuf->epoch >= 0) && (logBuf->epoch !=
+            __epoch_generation.value.load(std::memory_order_relaxed));
+}
+
 // TODO: is it OK to use getLogBufferUnsafe to read __log_buffer? My worry is that
 // with the current impl. after inlining X small methods we will end up with X
 // atomic loads in the parent method, which ideally could use just one atomic load.
@@ -37,43 +130,65 @@ getLogBuffer()
 inline EventBuffer::Ref
 getLogBufferRef()
 {
+    // Announce that we are entering the fast path *before* loading the buffer
+    // pointer. Pairs with the fence in BufferManager::revokeIdleBuffers(): the
+    // buffer manager either sees our flag set or we see the NULL pointer.
+    std::atomic<bool>* inFastPath = &__thr_context.inFastPath;
+    inFastPath->store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
     EventBuffer* logBuf = getLogBuffer();
-    if (logBuf == NULL) {
+    if ((logBuf == NULL) || epochChanged(logBuf)) {
+        // Our previous event buffer has been reclaimed while we were away
+        // (unless the buffer manager has already closed it for us). Once
+        // closed, it may be recycled and handed out again at any time, so
+        // don't keep pointing to it.
+        __atomic_store_n(&__log_buffer, NULL, __ATOMIC_RELAXED);
+        EventBuffer* oldBuf = __thr_context.logBuffer.exchange(NULL);
+        if (oldBuf) {
+            oldBuf->close();
+        }
         logBuf = __buf_manager.allocBuffer();
     }
-    return logBuf->getRef();
+    return EventBuffer::Ref(logBuf, inFastPath);
 }
 
-// TODO:
-struct Context {
-    // FIXME: the ctor should be called by the interceptor of pthread_create?
-    Context()
-        : threadId(threadCounter.fetch_add(1))
-        , logBuffer(NULL)
-    {
-        printf("thread context %d init\n", threadId);
-    }
-
-    ~Context()
-    {
-        __buf_manager.threadExit();
-        printf("context destroyed\n");
-        // TODO: return my event buffer to buffer manager
-    }
-
-    /// Unique identifier of the thread this context belongs to.
-    const int threadId;
-
-    /// The most recent event buffer that is assigned to us.
-    EventBuffer* logBuffer;
+/**
+ * Run \p block, a call that may block (e.g., locking a contended mutex),
+ * outside of the fast path: drop \p ref, and take it again afterwards (see
+ * Context::inFastPath). By then, our event buffer may have been replaced.
+ */
+template <typename Func>
+inline void
+blockOutsideFastPath(EventBuffer::Ref* ref, Func block)
+{
+    ref->~Ref();
+    block();
+    new (ref) EventBuffer::Ref(getLogBufferRef());
+}
 
-    /// Used to generate unique thread IDs.
-    static std::atomic<int> threadCounter;
-};
 
-extern thread_local Context __thr_context;
+/**
+ * Check if an access can be left out of the trace because it's to the stack
+ * of the accessing thread, which no other thread is supposed to touch.
+ * Instrumented code should copy `__thr_context.stack` into a local once per
+ * function (or loop), like getLogBufferRef(), so the check stays cheap.
+ *
+ * Note: stack objects shared with other threads (e.g., a flag passed by
+ * reference to a thread that is joined before returning) do exist; accesses
+ * to them are missed, so races on them go undetected. Locals that provably
+ * don't escape should rather not be instrumented in the first place.
+ */
+__attribute__((always_inline, target("no-sse")))
+inline bool
+isThreadPrivate(const StackBounds& stack, const void* addr)
+{
+    return stack.contains(addr);
+}
 
-/// Global atomic counter used to allocate event IDs.
-extern std::atomic<uint32_t> __event_id_counter;
+/// Global counter used to allocate event IDs. Bumped with __atomic_fetch_add()
+/// rather than through std::atomic, whose members can't be inlined into the
+/// no-sse instrumented functions.
+extern uint32_t __event_id_counter;
 
 #endif //FASTLOG_CONTEXT_H
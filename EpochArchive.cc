@@ -0,0 +1,96 @@
+#include <cstring>
+
+#include "EpochArchive.h"
+#include "Utils.h"
+
+EpochArchive::EpochArchive()
+    : mutex()
+    , epochs()
+    , budgetBytes(size_t(getEnvInt("FASTLOG_ARCHIVE_MB", 0)) << 20)
+    , usedBytes(0)
+    , totalRawBytes(0)
+    , totalCompressedBytes(0)
+    , evictedEpochs(0)
+{}
+
+void
+EpochArchive::setBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> _(mutex);
+    budgetBytes = bytes;
+}
+
+/**
+ * Compress the events of a closed event buffer into \p epoch with \p codec
+ * (one per worker thread; codecs are not thread-safe). Doesn't touch
+ * the archive itself, so worker threads can do it without synchronization
+ * and recycle the buffer right away.
+ */
+void
+EpochArchive::archive(const EventBuffer* logBuf, EventCodec* codec,
+        ArchivedEpoch* epoch)
+{
+    epoch->buffers.emplace_back();
+    ArchivedBuffer& buf = epoch->buffers.back();
+    buf.threadId = logBuf->threadId;
+    buf.layout = logBuf->layout;
+    buf.events = logBuf->events;
+    if (logBuf->layout == EVENT_LAYOUT_64) {
+        buf.data.reserve(size_t(logBuf->events) * 2);
+        codec->compress(logBuf, &buf.data);
+    } else {
+        logBuf->forEachChunk([&buf](const uint64_t* events, int n) {
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(events);
+            buf.data.insert(buf.data.end(), bytes,
+                    bytes + n * EventBuffer::EVENT_SIZE);
+        });
+    }
+    buf.data.shrink_to_fit();
+    epoch->rawBytes += size_t(logBuf->events) * EventBuffer::EVENT_SIZE;
+    epoch->compressedBytes += buf.data.size();
+}
+
+/**
+ * Add an epoch to the archive (taking over its buffers), evicting the oldest
+ * ones if the archive outgrows its budget.
+ */
+void
+EpochArchive::add(ArchivedEpoch* epoch)
+{
+    std::lock_guard<std::mutex> _(mutex);
+    totalRawBytes += epoch->rawBytes;
+    totalCompressedBytes += epoch->compressedBytes;
+    usedBytes += epoch->compressedBytes;
+    epochs.push_back(std::move(*epoch));
+    while ((usedBytes > budgetBytes) && !epochs.empty()) {
+        usedBytes -= epochs.front().compressedBytes;
+        epochs.pop_front();
+        evictedEpochs++;
+    }
+}
+
+/**
+ * Decompress the events of an archived buffer and append them to \p events.
+ */
+void
+EpochArchive::restore(const ArchivedBuffer& buf, std::vector<uint64_t>* events)
+{
+    if (buf.layout == EVENT_LAYOUT_64) {
+        EventCodec codec;
+        codec.decompress(buf.data.data(), events);
+        return;
+    }
+    size_t pos = events->size();
+    events->resize(pos + buf.data.size() / EventBuffer::EVENT_SIZE);
+    std::memcpy(&(*events)[pos], buf.data.data(), buf.data.size());
+}
+
+void
+EpochArchive::printStats()
+{
+    std::lock_guard<std::mutex> _(mutex);
+    printf("archivedEpochs %lu, evictedEpochs %d, archiveMB %.2f, "
+           "compressionRatio %.2f\n", epochs.size(), evictedEpochs,
+            double(usedBytes) / (1 << 20), totalCompressedBytes ?
+            double(totalRawBytes) / double(totalCompressedBytes) : 0.0);
+}
@@ -0,0 +1,102 @@
+#ifndef FASTLOG_EPOCHARCHIVE_H
+#define FASTLOG_EPOCHARCHIVE_H
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "EventBuffer.h"
+#include "EventCodec.h"
+
+/// Events of one event buffer, compressed with EventCodec (or stored as is if
+/// the codec doesn't support their layout).
+struct ArchivedBuffer {
+    int threadId;
+    EventLayoutId layout;
+    int events;
+    std::vector<uint8_t> data;
+};
+
+/// Compressed event buffers of one epoch.
+struct ArchivedEpoch {
+    explicit ArchivedEpoch(int epoch)
+        : epoch(epoch)
+        , buffers()
+        , rawBytes(0)
+        , compressedBytes(0)
+    {}
+
+    int epoch;
+    std::vector<ArchivedBuffer> buffers;
+
+    /// # bytes of events before and after compression.
+    size_t rawBytes;
+    size_t compressedBytes;
+};
+
+/**
+ * In-memory archive of the most recent epochs, compressed so that a much
+ * deeper trace history fits in the same memory as the raw event buffers.
+ * Worker threads archive the buffers of their epoch as they are closed (see
+ * archive()) and hand the whole epoch over once done; the oldest epochs are
+ * evicted to stay within the memory budget.
+ *
+ * Thread-safe.
+ */
+class EpochArchive {
+  public:
+    EpochArchive();
+
+    /// True if there is a memory budget for the archive; set via the
+    /// environment variable FASTLOG_ARCHIVE_MB.
+    bool
+    enabled() const
+    {
+        return budgetBytes > 0;
+    }
+
+    void setBudget(size_t bytes);
+    static void archive(const EventBuffer* logBuf, EventCodec* codec,
+            ArchivedEpoch* epoch);
+    void add(ArchivedEpoch* epoch);
+    static void restore(const ArchivedBuffer& buf,
+            std::vector<uint64_t>* events);
+    void printStats();
+
+    /**
+     * Invoke \p func(const ArchivedEpoch&) on each epoch in the archive, from
+     * the oldest to the newest. Holds the archive lock throughout.
+     */
+    template <typename Func>
+    void
+    forEachEpoch(Func func)
+    {
+        std::lock_guard<std::mutex> _(mutex);
+        for (const ArchivedEpoch& epoch : epochs) {
+            func(epoch);
+        }
+    }
+
+  private:
+    /// Serializes all accesses to the fields below.
+    std::mutex mutex;
+
+    /// Archived epochs, oldest first.
+    std::deque<ArchivedEpoch> epochs;
+
+    /// Max. # bytes of compressed events to keep. 0 disables the archive.
+    size_t budgetBytes;
+
+    /// # bytes of compressed events currently kept.
+    size_t usedBytes;
+
+    /// Totals over all the epochs ever added, for printStats().
+    size_t totalRawBytes;
+    size_t totalCompressedBytes;
+    int evictedEpochs;
+};
+
+extern EpochArchive __epoch_archive;
+
+#endif //FASTLOG_EPOCHARCHIVE_H
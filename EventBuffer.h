@@ -3,7 +3,124 @@
 
 #include <atomic>
 #include <cassert>
+#include <climits>
 #include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+#ifdef FASTLOG_STRESS_PUSH
+#include <sched.h>
+#endif
+
+#include "EventLayout.h"
+#include "SegmentPool.h"
+#include "Utils.h"
+
+struct EventBuffer;
+
+/**
+ * Event buffers of one epoch, in the order their owners closed them. Owners
+ * push their buffers onto the queue as they close them; the worker thread of
+ * the epoch drains it and sleeps on a futex while there is nothing to do.
+ *
+ * Queues are recycled by BufferManager instead of being deleted because an
+ * owner may still be inside push() when the worker has popped its buffer.
+ */
+struct ClosedBufferQueue {
+    explicit ClosedBufferQueue()
+        : head(NULL)
+        , closedBufs(0)
+        , enteredPushes(0)
+        , finishedPushes(0)
+        , sleeping(false)
+        , handoffTime(0)
+        , allClosedTime(0)
+        , handoffNs(0)
+        , processedEvents(0)
+        , busyNs(0)
+    {}
+
+    /**
+     * Allocate a queue, keeping the fields that are on cache lines of their
+     * own apart (see alignedAlloc()).
+     */
+    static ClosedBufferQueue*
+    create()
+    {
+        return new (alignedAlloc(sizeof(ClosedBufferQueue)))
+                ClosedBufferQueue();
+    }
+
+    void push(EventBuffer* buf);
+    EventBuffer* popAll(size_t* count);
+    bool waitForMore(int closed, int64_t timeoutNs = -1);
+
+    /**
+     * Check if all owners that entered push() have returned from it, i.e.,
+     * nobody but the worker thread will touch the queue again until it's
+     * reused. Only meaningful once every buffer of the epoch has been
+     * pushed (i.e., its worker thread is done, or all of them were closed).
+     */
+    bool
+    quiescent() const
+    {
+        return finishedPushes.load(std::memory_order_acquire) ==
+                enteredPushes.load();
+    }
+
+    void
+    reset()
+    {
+        head = NULL;
+        closedBufs = 0;
+        enteredPushes = 0;
+        finishedPushes = 0;
+        sleeping = false;
+        handoffTime = 0;
+        allClosedTime = 0;
+        handoffNs = 0;
+        processedEvents = 0;
+        busyNs = 0;
+    }
+
+    /// Most recently closed buffer; earlier ones are linked via
+    /// EventBuffer::nextClosed. NULL if the queue is empty.
+    CACHE_ALIGNED std::atomic<EventBuffer*> head;
+
+    /// # buffers pushed to this queue so far. Also used as the futex word
+    /// the worker thread sleeps on.
+    std::atomic<int> closedBufs;
+
+    /// # owners that have entered push(). Bumped before the buffer is linked
+    /// into the queue, so that an owner preempted right after linking it is
+    /// accounted for even though #closedBufs doesn't count it yet.
+    std::atomic<int> enteredPushes;
+
+    /// # owners that have returned from push(). Lags behind #enteredPushes
+    /// while some owner is still inside; the queue must not be reset until
+    /// they are equal (see quiescent()).
+    std::atomic<int> finishedPushes;
+
+    /// True if the worker thread is (about to be) blocked in futexWait().
+    /// Saves owners a futexWake() syscall when nobody is waiting. Written by
+    /// the worker only, so kept apart from the fields owners update.
+    CACHE_ALIGNED std::atomic<bool> sleeping;
+
+    /// Time (in rdtsc cycles) when the coordinator ended the epoch.
+    uint64_t handoffTime;
+
+    /// Time (in rdtsc cycles) when the worker thread got hold of the last
+    /// event buffer of the epoch.
+    uint64_t allClosedTime;
+
+    /// Time (in steadyClockNs()) when the coordinator ended the epoch.
+    int64_t handoffNs;
+
+    /// # events the worker thread analyzed, and the time it spent doing so
+    /// (i.e., not waiting for buffers to be closed).
+    uint64_t processedEvents;
+    int64_t busyNs;
+};
 
 struct EventBuffer {
 
@@ -17,18 +134,47 @@ struct EventBuffer {
         uint64_t* buf;
         int events;
         int nextRdtscTime;
+        uint64_t addrBase;
+
+        /// Flag of the owner thread to clear once this reference goes away,
+        /// which tells the buffer manager that it's now safe to close the
+        /// buffer on our behalf. NULL if nobody cares.
+        std::atomic<bool>* inFastPath;
 
-        explicit Ref(EventBuffer* logBuf)
+        explicit Ref(EventBuffer* logBuf,
+                std::atomic<bool>* inFastPath = NULL)
             : logBuf(logBuf)
-            , buf(logBuf->buf)
+            , buf(logBuf->base)
             , events(logBuf->events)
             , nextRdtscTime(logBuf->nextRdtscTime)
+            , addrBase(logBuf->addrBase)
+            , inFastPath(inFastPath)
         {}
 
+        Ref(const Ref&) = delete;
+        Ref& operator=(const Ref&) = delete;
+
+        Ref(Ref&& other)
+            : logBuf(other.logBuf)
+            , buf(other.buf)
+            , events(other.events)
+            , nextRdtscTime(other.nextRdtscTime)
+            , addrBase(other.addrBase)
+            , inFastPath(other.inFastPath)
+        {
+            other.inFastPath = NULL;
+        }
+
         ~Ref()
         {
             logBuf->events = events;
             logBuf->nextRdtscTime = nextRdtscTime;
+            logBuf->addrBase = addrBase;
+            if (inFastPath) {
+                // Release: #events must be visible to whoever closes the
+                // buffer once it observes the flag cleared.
+                inFastPath->store(false, std::memory_order_release);
+            }
         }
 
         /**
@@ -46,20 +192,65 @@ struct EventBuffer {
 
             // Write-back #events (and #events only) to the old event buffer.
             logBuf->events = events;
-            logBuf->closed = true;
+            logBuf->close();
 
             // Attach ourselves to the new event buffer.
             logBuf = curBuf;
-            buf = curBuf->buf;
+            buf = curBuf->base;
             events = 0;
             nextRdtscTime = EventBuffer::BATCH_SIZE;
+            addrBase = ADDR_BASE_NONE;
+        }
+
+        /**
+         * Invoked on the slow path to move on to a new segment once the
+         * current one is full. The fast path is oblivious to segments.
+         */
+        void
+        switchSegmentIfFull()
+        {
+            if (UNLIKELY(events >= logBuf->segmentEnd)) {
+                buf = logBuf->addSegment(events);
+            }
         }
 
     };
 
-    explicit EventBuffer()
+    /**
+     * Allocate an event buffer with contiguous storage for (at least)
+     * \p capacity events. The storage is reserved via mmap but only backed by
+     * physical memory once written, so a large buffer costs next to nothing
+     * until it's used. Intended for micro-benchmarks that wrap around.
+     */
+    static EventBuffer*
+    create(int capacity = MAX_EVENTS)
     {
-        reset();
+        return allocate(capacity, false);
+    }
+
+    /**
+     * Allocate an event buffer that can hold up to \p capacity events in a
+     * chain of segments obtained from the segment pool as events are logged.
+     * The buffer starts with one (possibly not faulted-in) segment.
+     */
+    static EventBuffer*
+    createSegmented(int capacity)
+    {
+        EventBuffer* logBuf = allocate(capacity, true);
+        logBuf->addSegment(0);
+        return logBuf;
+    }
+
+    /**
+     * Free an event buffer allocated by create() or createSegmented().
+     */
+    static void
+    destroy(EventBuffer* logBuf)
+    {
+        size_t size = allocSize(logBuf->capacity, logBuf->segmented);
+        logBuf->reset();
+        logBuf->~EventBuffer();
+        munmap(logBuf, size);
     }
 
     Ref
@@ -67,24 +258,137 @@ struct EventBuffer {
        return Ref(this);
     }
 
+    /**
+     * Prepare the buffer for reuse. The segments of a segmented buffer are
+     * returned to the segment pool; call addSegment(0) before logging again.
+     */
     void
     reset()
     {
+        if (segmented) {
+            if (firstSegment) {
+                __segment_pool.free(firstSegment, lastSegment);
+            }
+            firstSegment = lastSegment = NULL;
+            base = NULL;
+            segmentEnd = 0;
+        } else {
+            base = buf;
+            segmentEnd = INT_MAX;
+        }
         events = 0;
         nextRdtscTime = BATCH_SIZE;
+        addrBase = ADDR_BASE_NONE;
         threadId = -1;
         epoch = -1;
+        closeQueue = NULL;
+        layout = EVENT_LAYOUT_64;
+        nextClosed = NULL;
+        openTime = 0;
+        closeTime = 0;
         closed = false;
     }
 
+    /**
+     * Touch every page of the buffer storage so that the application thread
+     * this buffer is assigned to won't take page faults on its fast path.
+     * Segments that have been prefaulted before are skipped.
+     */
+    void
+    prefault()
+    {
+        const int eventsPerPage = 4096 / EVENT_SIZE;
+        if (segmented) {
+            // Later segments are faulted in as they are added on the slow
+            // path; they are usually recycled and mapped already anyway.
+            if (!lastSegment->faultedIn) {
+                for (int i = 0; i < EventSegment::SLOTS; i += eventsPerPage) {
+                    lastSegment->events[i] = 0;
+                }
+                lastSegment->faultedIn = true;
+            }
+            return;
+        }
+        for (int i = 0; i < capacity + BATCH_SIZE + 1; i += eventsPerPage) {
+            buf[i] = 0;
+        }
+    }
+
+    /**
+     * Append a new segment to a segmented buffer.
+     *
+     * \param begin
+     *      Index of the first event to store in the new segment.
+     * \return
+     *      The new #base.
+     */
+    uint64_t*
+    addSegment(int begin)
+    {
+        assert(segmented);
+        EventSegment* segment = __segment_pool.alloc();
+        segment->begin = begin;
+        if (lastSegment) {
+            lastSegment->next = segment;
+        } else {
+            firstSegment = segment;
+        }
+        lastSegment = segment;
+
+        // The fast path may overshoot the end of the segment by up to a batch
+        // before the slow path switches to the next one.
+        segmentEnd = begin + EventSegment::SLOTS - (BATCH_SIZE + 1);
+        // Note: points outside the segment unless begin is 0; only ever used
+        // to index events within the segment though. Pointer arithmetic out
+        // of the bounds of an array is undefined, so go through uintptr_t:
+        // the compiler can't assume anything about where the result points.
+        base = reinterpret_cast<uint64_t*>(
+                reinterpret_cast<uintptr_t>(segment->events) -
+                uintptr_t(begin) * EVENT_SIZE);
+        return base;
+    }
+
+    /**
+     * Invoke \p func(events, n) on each contiguous chunk of events stored in
+     * this buffer, in order.
+     */
+    template <typename Func>
+    void
+    forEachChunk(Func func) const
+    {
+        if (!segmented) {
+            func(static_cast<const uint64_t*>(buf), events);
+            return;
+        }
+        for (EventSegment* seg = firstSegment; seg; seg = seg->next) {
+            int end = seg->next ? seg->next->begin : events;
+            func(static_cast<const uint64_t*>(seg->events), end - seg->begin);
+        }
+    }
+
+    /**
+     * Invoked by the owner of this buffer (or on its behalf) to indicate that
+     * no more events will be written into it. The buffer is then handed to the
+     * worker thread of its epoch. Closing a buffer more than once is harmless.
+     */
+    void
+    close()
+    {
+        if (!closed.exchange(true) && closeQueue) {
+            closeTime = steadyClockNs();
+            closeQueue->push(this);
+        }
+    }
+
     // FIXME: looks like the size of the log can affect quite a lot on the performance.
     // However, since the slow path at the end of each epoch, we can't use buffer
     // too small. Need to understand why. I don't think the size of buffer should
     // affect that much...
 
-    // Each buffer can hold up to 10M events. Each event is 8-byte, so each buffer
-    // is 80 MB. Suppose we can log events at the rate of ~1ns/event, we need 10ms
-    // to fill up the buffer.
+    // By default, each buffer can hold up to 10M events. Each event is 8-byte,
+    // so each buffer is 80 MB. Suppose we can log events at the rate of
+    // ~1ns/event, we need 10ms to fill up the buffer. The buffer manager can
+    // be configured to use other capacities at runtime (see BufferManager).
     static const int MAX_EVENTS = 10000000;
 
     /// # events a small buffer can hold. Chosen to fit the small buffer in the
@@ -99,16 +403,53 @@ struct EventBuffer {
     /// # bytes used to record an event.
     static const int EVENT_SIZE = 8;
 
+    /// Value of #addrBase that no address has, so that the first memory
+    /// access logged into a buffer always comes with an address base marker.
+    static const uint64_t ADDR_BASE_NONE = ~uint64_t(0);
+
+    // Fields are grouped by who writes them, one cache line per group, so
+    // that the owner's fast and slow paths don't contend with the buffer
+    // manager and worker threads touching the same buffer.
+
+    // Written by the owner thread while logging.
+
     /// # events stored in the buffer.
     int events;
 
     /// Time to generate a timestamp for the current batch of events.
     int nextRdtscTime;
 
-    /// Buffer storage used to hold events.
-    uint64_t buf[MAX_EVENTS + BATCH_SIZE + 1];
-    // TODO: any benefit aligned to 64-byte cache line boundary?
-//    alignas(64) uint64_t buf[MAX_EVENTS + BATCH_SIZE + 1];
+    /// Upper address bits carried by the last address base marker logged into
+    /// this buffer (see TSAN_ADDR_BASE), or ADDR_BASE_NONE.
+    uint64_t addrBase;
+
+    /// Pointer such that `base[i]` is where the i-th event goes as long as
+    /// i < segmentEnd. Same as `buf` for contiguous buffers.
+    uint64_t* base;
+
+    /// # events after which the current segment is considered full. INT_MAX
+    /// for contiguous buffers.
+    int segmentEnd;
+
+    /// Segments of a segmented buffer, in the order they are filled.
+    EventSegment* firstSegment;
+    EventSegment* lastSegment;
+
+    /// Time (in steadyClockNs()) when the application thread started writing
+    /// to this buffer. Used to estimate its logging rate.
+    int64_t openTime;
+
+    // Written by the buffer manager when the buffer is assigned; read-only
+    // while the buffer is in use.
+
+    /// # events the buffer can hold. Contiguous storage has room for
+    /// BATCH_SIZE + 1 more events because the fast path only checks the
+    /// capacity on the slow path (i.e., at the end of each batch). Can be
+    /// changed between uses of segmented buffers.
+    CACHE_ALIGNED int capacity;
+
+    /// True if events are stored in a chain of segments rather than `buf`.
+    const bool segmented;
 
     /// Identifier for the application thread this buffer is assigned to.
     int threadId;
@@ -117,8 +458,137 @@ struct EventBuffer {
     /// thread.
     int epoch;
 
+    /// Queue to push this buffer onto once it's closed. NULL if the buffer
+    /// doesn't belong to any epoch (e.g., used in micro-benchmarks).
+    ClosedBufferQueue* closeQueue;
+
+    /// Layout of the events in this buffer; tells workers how to decode them.
+    EventLayoutId layout;
+
+    // Written once the buffer is closed, by the owner or on its behalf.
+
     /// True if the application thread will not write to this buffer anymore.
-    std::atomic<bool> closed;
+    CACHE_ALIGNED std::atomic<bool> closed;
+
+    /// Time (in steadyClockNs()) when the buffer was closed.
+    int64_t closeTime;
+
+    /// Next buffer closed (before this one) in the same epoch.
+    EventBuffer* nextClosed;
+
+    /// Contiguous storage used to hold events; sized at runtime (see
+    /// create()). Empty for segmented buffers. Starts on a page boundary (the
+    /// header is allocated with mmap), so every batch of events covers whole
+    /// cache lines.
+    PAGE_ALIGNED uint64_t buf[];
+
+  private:
+    explicit EventBuffer(int capacity, bool segmented)
+        : firstSegment(NULL)
+        , lastSegment(NULL)
+        , capacity(capacity)
+        , segmented(segmented)
+    {
+        reset();
+    }
+
+    static EventBuffer*
+    allocate(int capacity, bool segmented)
+    {
+        void* mem = mmap(NULL, allocSize(capacity, segmented),
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        return new (mem) EventBuffer(capacity, segmented);
+    }
+
+    /// # bytes to allocate for an event buffer of the given capacity.
+    static size_t
+    allocSize(int capacity, bool segmented)
+    {
+        return sizeof(EventBuffer) +
+                (segmented ? 0 : EVENT_SIZE * (capacity + BATCH_SIZE + 1));
+    }
 };
 
+/**
+ * Append a closed event buffer to the queue and wake up the worker thread if
+ * it's waiting for one.
+ */
+inline void
+ClosedBufferQueue::push(EventBuffer* buf)
+{
+    enteredPushes.fetch_add(1);
+    EventBuffer* oldHead = head.load(std::memory_order_relaxed);
+    do {
+        buf->nextClosed = oldHead;
+    } while (!head.compare_exchange_weak(oldHead, buf));
+
+#ifdef FASTLOG_STRESS_PUSH
+    // Widen the window in which the worker thread may already have popped
+    // our buffer (see scripts/runPushStress.sh).
+    sched_yield();
+#endif
+    closedBufs.fetch_add(1);
+    if (sleeping.load()) {
+        futexWake(&closedBufs);
+    }
+
+    // Last access to the queue; it may be reused as soon as the worker thread
+    // is done with the epoch.
+    finishedPushes.fetch_add(1, std::memory_order_release);
+}
+
+/**
+ * Remove all buffers from the queue.
+ *
+ * \param[out] count
+ *      # buffers removed.
+ * \return
+ *      Buffers in the order they were closed, linked via
+ *      EventBuffer::nextClosed. NULL if the queue is empty.
+ */
+inline EventBuffer*
+ClosedBufferQueue::popAll(size_t* count)
+{
+    // Buffers are pushed in LIFO order; reverse the list to get back the
+    // order they were closed.
+    EventBuffer* buf = head.exchange(NULL);
+    EventBuffer* ordered = NULL;
+    *count = 0;
+    while (buf) {
+        EventBuffer* next = buf->nextClosed;
+        buf->nextClosed = ordered;
+        ordered = buf;
+        buf = next;
+        (*count)++;
+    }
+    return ordered;
+}
+
+/**
+ * Block the worker thread until more buffers are pushed to the queue.
+ *
+ * \param closed
+ *      Value of #closedBufs observed by the caller before it found the queue
+ *      empty. Returns immediately if more buffers have been pushed since.
+ * \param timeoutNs
+ *      Give up after this many nanoseconds. Negative means wait forever.
+ * \return
+ *      True if more buffers have been pushed; false on timeout.
+ */
+inline bool
+ClosedBufferQueue::waitForMore(int closed, int64_t timeoutNs)
+{
+    sleeping = true;
+    bool timedOut = false;
+    while ((closedBufs.load() == closed) && !timedOut) {
+        timedOut = !futexWait(&closedBufs, closed, timeoutNs);
+    }
+    sleeping = false;
+    return closedBufs.load() != closed;
+}
+
 #endif //FASTLOG_EVENTBUFFER_H
@@ -0,0 +1,371 @@
+#include <cstring>
+
+#include "EventCodec.h"
+#include "LoggerConsts.h"
+
+typedef EventLayout64 L;
+
+/// # bits needed to represent \p x.
+static inline int
+bitsFor(uint32_t x)
+{
+    return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline uint32_t
+zigzag(int32_t x)
+{
+    return (uint32_t(x) << 1) ^ uint32_t(x >> 31);
+}
+
+static inline int32_t
+unzigzag(uint32_t x)
+{
+    return int32_t(x >> 1) ^ -int32_t(x & 1);
+}
+
+static inline void
+putBytes(const void* src, size_t n, std::vector<uint8_t>* out)
+{
+    size_t pos = out->size();
+    out->resize(pos + n);
+    std::memcpy(&(*out)[pos], src, n);
+}
+
+static inline uint8_t*
+putBytes(const void* src, size_t n, uint8_t* dst)
+{
+    std::memcpy(dst, src, n);
+    return dst + n;
+}
+
+/**
+ * Write the lower \p width bits of each of the \p n values to \p dst. May
+ * write (garbage) up to 8 bytes past the packed values.
+ *
+ * \return
+ *      Position right after the packed values.
+ */
+static uint8_t*
+packBits(const uint32_t* values, int n, int width, uint8_t* dst)
+{
+    if ((width == 0) || (n == 0)) {
+        return dst;
+    }
+    uint8_t* end = dst + (size_t(n) * width + 7) / 8;
+    // Flush whole bytes after each value; at most 7 + 32 bits are pending.
+    uint64_t acc = 0;
+    int bits = 0;
+    for (int i = 0; i < n; i++) {
+        acc |= uint64_t(values[i]) << bits;
+        bits += width;
+        std::memcpy(dst, &acc, sizeof(acc));
+        dst += bits / 8;
+        acc >>= bits & ~7;
+        bits %= 8;
+    }
+    std::memcpy(dst, &acc, sizeof(acc));
+    return end;
+}
+
+/**
+ * Inverse of packBits(). Reads whole words, i.e., up to 8 bytes past the
+ * packed values (see EventCodec::PADDING).
+ *
+ * \return
+ *      Position right after the packed values.
+ */
+static const uint8_t*
+unpackBits(const uint8_t* in, int n, int width, uint32_t* values)
+{
+    if (width == 0) {
+        std::memset(values, 0, sizeof(uint32_t) * n);
+        return in;
+    }
+    uint64_t mask = (uint64_t(1) << width) - 1;
+    size_t bit = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t word;
+        std::memcpy(&word, in + bit / 8, sizeof(word));
+        values[i] = uint32_t((word >> (bit % 8)) & mask);
+        bit += width;
+    }
+    return in + (size_t(n) * width + 7) / 8;
+}
+
+EventCodec::EventCodec()
+    : decoder(EventDecoder::ALL_HEADERS)
+    , streams()
+    , blockBuf()
+{
+    resetStreams();
+}
+
+void
+EventCodec::resetStreams()
+{
+    for (Stream& s : streams) {
+        s = Stream{~uint32_t(0), 0, 0};
+    }
+}
+
+/**
+ * Get the stream of the given location, taking over its slot if it belongs to
+ * another location. The decoder makes the same decisions.
+ */
+EventCodec::Stream*
+EventCodec::stream(uint32_t loc)
+{
+    Stream* s = &streams[loc % SLOTS];
+    if (s->loc != loc) {
+        *s = Stream{loc, 0, 0};
+    }
+    return s;
+}
+
+/**
+ * Compress the events of an event buffer (in the 64-bit layout) and append
+ * them to \p out.
+ */
+void
+EventCodec::compress(const EventBuffer* logBuf, std::vector<uint8_t>* out)
+{
+    resetStreams();
+    logBuf->forEachChunk([this, out](const uint64_t* events, int n) {
+        for (int i = 0; i < n; i += EventColumns::CHUNK_EVENTS) {
+            compressChunk(events + i,
+                    std::min(n - i, int(EventColumns::CHUNK_EVENTS)), out);
+        }
+    });
+    uint8_t end[sizeof(uint32_t) + PADDING] = {};
+    putBytes(end, sizeof(end), out);
+}
+
+/**
+ * Compress \p n events (in the 64-bit layout) and append them to \p out.
+ */
+void
+EventCodec::compress(const uint64_t* events, int n, std::vector<uint8_t>* out)
+{
+    resetStreams();
+    for (int i = 0; i < n; i += EventColumns::CHUNK_EVENTS) {
+        compressChunk(events + i,
+                std::min(n - i, int(EventColumns::CHUNK_EVENTS)), out);
+    }
+    uint8_t end[sizeof(uint32_t) + PADDING] = {};
+    putBytes(end, sizeof(end), out);
+}
+
+void
+EventCodec::compressChunk(const uint64_t* events, int n,
+        std::vector<uint8_t>* out)
+{
+    uint32_t count = n;
+    putBytes(&count, sizeof(count), out);
+    const EventColumns& columns = decoder.decodeChunk(events, n);
+    for (int i = 0; i < n; i += BLOCK_EVENTS) {
+        compressBlock(columns, i, std::min(n - i, int(BLOCK_EVENTS)), out);
+    }
+}
+
+/**
+ * Block layout:
+ *  - # dictionary entries (2 bytes), then the entries: the header (4 bits)
+ *    and location (20 bits) of memory accesses, 3 bytes each;
+ *  - per entry, the widths of its value and address deltas (1 byte each);
+ *  - per event, its index in the dictionary, or the number of entries for
+ *    other events, bit-packed;
+ *  - per memory access, its value and address deltas with the widths of its
+ *    entry, bit-packed;
+ *  - other events, 8 bytes each.
+ */
+void
+EventCodec::compressBlock(const EventColumns& columns, int begin, int n,
+        std::vector<uint8_t>* out)
+{
+    // Dictionary of the (header, location) pairs in this block, indexed by a
+    // small hash table. Each entry has its own location stream.
+    uint32_t dict[BLOCK_EVENTS];
+    Stream* dictStream[BLOCK_EVENTS];
+    uint32_t valueBits[BLOCK_EVENTS];
+    uint32_t addrBits[BLOCK_EVENTS];
+    int dictSize = 0;
+    int16_t dictTable[2 * BLOCK_EVENTS];
+    std::memset(dictTable, -1, sizeof(dictTable));
+
+    uint32_t codes[BLOCK_EVENTS];
+    uint32_t values[BLOCK_EVENTS];
+    uint32_t addrs[BLOCK_EVENTS];
+    uint64_t others[BLOCK_EVENTS];
+    int otherIndices[BLOCK_EVENTS];
+    int numOthers = 0;
+    for (int i = 0; i < n; i++) {
+        int e = begin + i;
+        uint32_t header = columns.header[e];
+        uint32_t loc = columns.loc[e];
+        uint32_t value = columns.value[e];
+        uint32_t addr = uint32_t(columns.addr[e]);
+        if (!(header & TSAN_HDR_MEM_ACCESS)) {
+            others[numOthers] = encodeWord<L>(0, header, loc, value, addr);
+            otherIndices[numOthers++] = i;
+            // Packed with widths of 0 below, but OR'ed in all the same.
+            values[i] = 0;
+            addrs[i] = 0;
+            continue;
+        }
+
+        uint32_t key = (header << L::loc().width) | loc;
+        uint32_t h = (key * 2654435761u) >> (32 - DICT_BITS);
+        while ((dictTable[h] >= 0) && (dict[dictTable[h]] != key)) {
+            h = (h + 1) & (2 * BLOCK_EVENTS - 1);
+        }
+        if (dictTable[h] < 0) {
+            dictTable[h] = int16_t(dictSize);
+            dict[dictSize] = key;
+            dictStream[dictSize] = stream(loc);
+            valueBits[dictSize] = 0;
+            addrBits[dictSize] = 0;
+            dictSize++;
+        }
+        int code = dictTable[h];
+        codes[i] = uint32_t(code);
+
+        Stream* s = dictStream[code];
+        values[i] = zigzag(int8_t(value - s->value)) & 0xFF;
+        addrs[i] = zigzag(int32_t(addr - s->addr));
+        valueBits[code] |= values[i];
+        addrBits[code] |= addrs[i];
+        s->value = value;
+        s->addr = addr;
+    }
+    for (int i = 0; i < numOthers; i++) {
+        codes[otherIndices[i]] = uint32_t(dictSize);
+    }
+
+    uint8_t* dst = blockBuf;
+    uint16_t count = uint16_t(dictSize);
+    dst = putBytes(&count, sizeof(count), dst);
+    for (int i = 0; i < dictSize; i++) {
+        dst = putBytes(&dict[i], 3, dst);
+    }
+    uint8_t valueWidths[BLOCK_EVENTS + 1];
+    uint8_t addrWidths[BLOCK_EVENTS + 1];
+    for (int i = 0; i < dictSize; i++) {
+        valueWidths[i] = uint8_t(bitsFor(valueBits[i]));
+        addrWidths[i] = uint8_t(bitsFor(addrBits[i]));
+        *dst++ = valueWidths[i];
+        *dst++ = addrWidths[i];
+    }
+    valueWidths[dictSize] = 0;
+    addrWidths[dictSize] = 0;
+    dst = packBits(codes, n, bitsFor(uint32_t(dictSize)), dst);
+
+    // The value delta (at most 8 bits) and the address delta of each access
+    // are packed together, so at most 7 + 40 bits are pending.
+    uint64_t acc = 0;
+    int bits = 0;
+    for (int i = 0; i < n; i++) {
+        uint32_t code = codes[i];
+        acc |= (uint64_t(values[i]) | (uint64_t(addrs[i]) <<
+                valueWidths[code])) << bits;
+        bits += valueWidths[code] + addrWidths[code];
+        std::memcpy(dst, &acc, sizeof(acc));
+        dst += bits / 8;
+        acc >>= bits & ~7;
+        bits %= 8;
+    }
+    std::memcpy(dst, &acc, sizeof(acc));
+    dst += (bits + 7) / 8;
+    dst = putBytes(others, sizeof(uint64_t) * numOthers, dst);
+    out->insert(out->end(), blockBuf, dst);
+}
+
+/**
+ * Decompress the output of one compress() call and append the events to
+ * \p events.
+ *
+ * \return
+ *      # bytes consumed, excluding the padding.
+ */
+size_t
+EventCodec::decompress(const uint8_t* in, std::vector<uint64_t>* events)
+{
+    resetStreams();
+    const uint8_t* start = in;
+    while (true) {
+        uint32_t n;
+        std::memcpy(&n, in, sizeof(n));
+        in += sizeof(n);
+        if (n == 0) {
+            break;
+        }
+        size_t pos = events->size();
+        events->resize(pos + n);
+        for (uint32_t i = 0; i < n; i += BLOCK_EVENTS) {
+            in = decompressBlock(in, std::min(int(n - i), int(BLOCK_EVENTS)),
+                    &(*events)[pos + i]);
+        }
+    }
+    return size_t(in - start);
+}
+
+const uint8_t*
+EventCodec::decompressBlock(const uint8_t* in, int n, uint64_t* events)
+{
+    uint16_t dictSize;
+    std::memcpy(&dictSize, in, sizeof(dictSize));
+    in += sizeof(dictSize);
+    uint32_t dict[BLOCK_EVENTS];
+    for (int i = 0; i < dictSize; i++) {
+        dict[i] = 0;
+        std::memcpy(&dict[i], in, 3);
+        in += 3;
+    }
+    uint8_t valueWidths[BLOCK_EVENTS];
+    uint8_t addrWidths[BLOCK_EVENTS];
+    for (int i = 0; i < dictSize; i++) {
+        valueWidths[i] = *in++;
+        addrWidths[i] = *in++;
+    }
+    uint32_t codes[BLOCK_EVENTS];
+    in = unpackBits(in, n, bitsFor(dictSize), codes);
+
+    // Streams are taken over in the same order as by the encoder, i.e., at
+    // the first access of each entry. Other events come after the deltas, so
+    // they are filled in at the end.
+    Stream* dictStream[BLOCK_EVENTS] = {};
+    int otherIndices[BLOCK_EVENTS];
+    int numOthers = 0;
+    size_t bit = 0;
+    for (int i = 0; i < n; i++) {
+        uint32_t code = codes[i];
+        if (code == dictSize) {
+            otherIndices[numOthers++] = i;
+            continue;
+        }
+        uint32_t header = dict[code] >> L::loc().width;
+        uint32_t loc = dict[code] & uint32_t(L::loc().mask());
+        if (!dictStream[code]) {
+            dictStream[code] = stream(loc);
+        }
+        Stream* s = dictStream[code];
+        uint64_t word;
+        std::memcpy(&word, in + bit / 8, sizeof(word));
+        word >>= bit % 8;
+        int valueWidth = valueWidths[code];
+        int addrWidth = addrWidths[code];
+        uint32_t value = uint32_t(word & ((uint64_t(1) << valueWidth) - 1));
+        uint32_t addr = uint32_t((word >> valueWidth) &
+                ((uint64_t(1) << addrWidth) - 1));
+        bit += valueWidth + addrWidth;
+        s->value = (s->value + uint32_t(unzigzag(value))) & 0xFF;
+        s->addr += uint32_t(unzigzag(addr));
+        events[i] = encodeWord<L>(0, header, loc, s->value, s->addr);
+    }
+    in += (bit + 7) / 8;
+    for (int i = 0; i < numOthers; i++) {
+        std::memcpy(&events[otherIndices[i]], in, sizeof(uint64_t));
+        in += sizeof(uint64_t);
+    }
+    return in;
+}
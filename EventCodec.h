@@ -0,0 +1,78 @@
+#ifndef FASTLOG_EVENTCODEC_H
+#define FASTLOG_EVENTCODEC_H
+
+#include <cstdint>
+#include <vector>
+
+#include "EventDecoder.h"
+
+/**
+ * Lossless codec for events in the 64-bit layout, specialized for the
+ * regularity of memory access streams.
+ *
+ * Events are split into columns (see EventDecoder) and encoded in blocks of
+ * BLOCK_EVENTS events:
+ *  - the headers and locations of memory accesses are replaced by indices
+ *    into a per-block dictionary, bit-packed;
+ *  - addresses and values are delta-encoded against the previous access with
+ *    the same location (tracked in a direct-mapped table of SLOTS streams),
+ *    zigzag-encoded and bit-packed with the smallest widths that fit all the
+ *    accesses of their location in the block;
+ *  - other events (timestamps, markers) are stored as is.
+ *
+ * Each call to compress() starts from scratch, so its output can be
+ * decompressed on its own.
+ */
+class EventCodec {
+  public:
+    EventCodec();
+
+    /// # events per block, i.e., unit of bit-packing widths and dictionaries.
+    static const int BLOCK_EVENTS = 512;
+
+    /// # location streams tracked at a time.
+    static const int SLOTS = 4096;
+
+    /// # zero bytes at the end of the output of compress(), so that the
+    /// decoder can read whole words.
+    static const int PADDING = 8;
+
+    void compress(const EventBuffer* logBuf, std::vector<uint8_t>* out);
+    void compress(const uint64_t* events, int n, std::vector<uint8_t>* out);
+    size_t decompress(const uint8_t* in, std::vector<uint64_t>* events);
+
+  private:
+    /// log2 of the size of the hash table of block dictionaries.
+    static const int DICT_BITS = 10;
+    static_assert((1 << DICT_BITS) == 2 * BLOCK_EVENTS,
+            "the dictionary hash table must be twice as large as a block");
+
+    /// Upper bound on the size of a compressed block (plus the slack of
+    /// packBits()): the dictionary, the codes and the widths, and 40 bits of
+    /// deltas or 64 bits of raw event per event.
+    static const int MAX_BLOCK_BYTES = 2 + 3 * BLOCK_EVENTS +
+            2 * BLOCK_EVENTS + 2 * BLOCK_EVENTS + 8 * BLOCK_EVENTS + 64;
+
+    /// Last access of one location stream.
+    struct Stream {
+        uint32_t loc;
+        uint32_t addr;
+        uint32_t value;
+    };
+
+    void resetStreams();
+    Stream* stream(uint32_t loc);
+    void compressChunk(const uint64_t* events, int n,
+            std::vector<uint8_t>* out);
+    void compressBlock(const EventColumns& columns, int begin, int n,
+            std::vector<uint8_t>* out);
+    const uint8_t* decompressBlock(const uint8_t* in, int n, uint64_t* events);
+
+    EventDecoder decoder;
+    Stream streams[SLOTS];
+
+    /// Scratch space for the block being compressed.
+    uint8_t blockBuf[MAX_BLOCK_BYTES];
+};
+
+#endif //FASTLOG_EVENTCODEC_H
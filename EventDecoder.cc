@@ -0,0 +1,224 @@
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+
+#include "EventDecoder.h"
+
+typedef EventLayout64 L;
+
+static_assert((L::header().word == 0) && (L::loc().word == 0) &&
+        (L::value().word == 0) && (L::addr().word == 0),
+        "decode kernels assume single-word events");
+
+/**
+ * Decode events one at a time into the columns, starting at index \p k.
+ * Events are written unconditionally and only counted if they pass the
+ * filter, so there is no branch to mispredict.
+ *
+ * \return
+ *      # events in the columns.
+ */
+static int
+decodeScalarAt(const uint64_t* events, int n, uint32_t headers,
+        EventColumns* out, int k)
+{
+    for (int i = 0; i < n; i++) {
+        uint64_t event = events[i];
+        uint64_t header = L::header().unpackWord(event);
+        out->header[k] = uint8_t(header);
+        out->loc[k] = uint32_t(L::loc().unpackWord(event));
+        out->value[k] = uint32_t(L::value().unpackWord(event));
+        out->addr[k] = L::addr().unpackWord(event);
+        k += (headers >> header) & 1;
+    }
+    return k;
+}
+
+static int
+decodeScalar(const uint64_t* events, int n, uint32_t headers,
+        EventColumns* out)
+{
+    return decodeScalarAt(events, n, headers, out, 0);
+}
+
+/// permutevar8x32 indices that move the 64-bit lanes selected by a 4-bit mask
+/// to the front.
+alignas(32) static const int AVX2_COMPRESS[16][8] = {
+        {0, 0, 0, 0, 0, 0, 0, 0},
+        {0, 1, 0, 0, 0, 0, 0, 0},
+        {2, 3, 0, 0, 0, 0, 0, 0},
+        {0, 1, 2, 3, 0, 0, 0, 0},
+        {4, 5, 0, 0, 0, 0, 0, 0},
+        {0, 1, 4, 5, 0, 0, 0, 0},
+        {2, 3, 4, 5, 0, 0, 0, 0},
+        {0, 1, 2, 3, 4, 5, 0, 0},
+        {6, 7, 0, 0, 0, 0, 0, 0},
+        {0, 1, 6, 7, 0, 0, 0, 0},
+        {2, 3, 6, 7, 0, 0, 0, 0},
+        {0, 1, 2, 3, 6, 7, 0, 0},
+        {4, 5, 6, 7, 0, 0, 0, 0},
+        {0, 1, 4, 5, 6, 7, 0, 0},
+        {2, 3, 4, 5, 6, 7, 0, 0},
+        {0, 1, 2, 3, 4, 5, 6, 7},
+};
+
+/**
+ * Decode 4 events at a time: filter them by looking up their header codes in
+ * the header set with variable shifts, move the survivors to the front of the
+ * vector with a permutation from AVX2_COMPRESS, then split the fields.
+ */
+__attribute__((target("avx2")))
+static int
+decodeAvx2(const uint64_t* events, int n, uint32_t headers,
+        EventColumns* out)
+{
+    const __m256i headerSet = _mm256_set1_epi64x(headers);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i locMask = _mm256_set1_epi64x(L::loc().mask());
+    const __m256i valueMask = _mm256_set1_epi64x(L::value().mask());
+    const __m256i addrMask = _mm256_set1_epi64x(L::addr().mask());
+    // Low 32 bits of each 64-bit lane, in the lower half.
+    const __m256i narrow = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+    // Low byte of each 32-bit lane, in the lowest 32 bits.
+    const __m128i narrowBytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1);
+
+    int k = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(events + i));
+        __m256i header = _mm256_srli_epi64(v, L::header().offset);
+        __m256i keep = _mm256_cmpeq_epi64(_mm256_and_si256(
+                _mm256_srlv_epi64(headerSet, header), one), one);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(keep));
+        v = _mm256_permutevar8x32_epi32(v, _mm256_load_si256(
+                reinterpret_cast<const __m256i*>(AVX2_COMPRESS[mask])));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out->addr + k),
+                _mm256_and_si256(v, addrMask));
+        __m256i loc = _mm256_and_si256(
+                _mm256_srli_epi64(v, L::loc().offset), locMask);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out->loc + k),
+                _mm256_castsi256_si128(
+                        _mm256_permutevar8x32_epi32(loc, narrow)));
+        __m256i value = _mm256_and_si256(
+                _mm256_srli_epi64(v, L::value().offset), valueMask);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out->value + k),
+                _mm256_castsi256_si128(
+                        _mm256_permutevar8x32_epi32(value, narrow)));
+        __m128i header32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+                _mm256_srli_epi64(v, L::header().offset), narrow));
+        int headerBytes = _mm_cvtsi128_si32(
+                _mm_shuffle_epi8(header32, narrowBytes));
+        std::memcpy(out->header + k, &headerBytes, sizeof(headerBytes));
+
+        k += __builtin_popcount(mask);
+    }
+    return decodeScalarAt(events + i, n - i, headers, out, k);
+}
+
+/**
+ * Same as decodeAvx2(), 8 events at a time, using the compress and narrowing
+ * instructions of AVX-512F.
+ */
+__attribute__((target("avx512f")))
+static int
+decodeAvx512(const uint64_t* events, int n, uint32_t headers,
+        EventColumns* out)
+{
+    const __m512i headerSet = _mm512_set1_epi64(headers);
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i locMask = _mm512_set1_epi64(L::loc().mask());
+    const __m512i valueMask = _mm512_set1_epi64(L::value().mask());
+    const __m512i addrMask = _mm512_set1_epi64(L::addr().mask());
+
+    int k = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i v = _mm512_loadu_si512(events + i);
+        __m512i header = _mm512_srli_epi64(v, L::header().offset);
+        __mmask8 keep = _mm512_test_epi64_mask(
+                _mm512_srlv_epi64(headerSet, header), one);
+        v = _mm512_maskz_compress_epi64(keep, v);
+
+        _mm512_storeu_si512(out->addr + k, _mm512_and_si512(v, addrMask));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out->loc + k),
+                _mm512_cvtepi64_epi32(_mm512_and_si512(
+                        _mm512_srli_epi64(v, L::loc().offset), locMask)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out->value + k),
+                _mm512_cvtepi64_epi32(_mm512_and_si512(
+                        _mm512_srli_epi64(v, L::value().offset), valueMask)));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out->header + k),
+                _mm512_cvtepi64_epi8(
+                        _mm512_srli_epi64(v, L::header().offset)));
+
+        k += __builtin_popcount(keep);
+    }
+    return decodeScalarAt(events + i, n - i, headers, out, k);
+}
+
+EventDecoder::EventDecoder(uint32_t headers, DecodeKernel kernel)
+    : headers(headers)
+    , kernel(NULL)
+    , columns(NULL)
+{
+    switch (kernel) {
+    case DECODE_AVX512:
+        this->kernel = decodeAvx512;
+        break;
+    case DECODE_AVX2:
+        this->kernel = decodeAvx2;
+        break;
+    default:
+        this->kernel = decodeScalar;
+        break;
+    }
+
+    columns = static_cast<EventColumns*>(alignedAlloc(sizeof(EventColumns)));
+    columns->size = 0;
+}
+
+EventDecoder::~EventDecoder()
+{
+    alignedFree(columns);
+}
+
+DecodeKernel
+EventDecoder::bestKernel()
+{
+    if (supported(DECODE_AVX512)) {
+        return DECODE_AVX512;
+    }
+    return supported(DECODE_AVX2) ? DECODE_AVX2 : DECODE_SCALAR;
+}
+
+bool
+EventDecoder::supported(DecodeKernel kernel)
+{
+    switch (kernel) {
+    case DECODE_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    case DECODE_AVX2:
+        return __builtin_cpu_supports("avx2");
+    default:
+        return true;
+    }
+}
+
+const char*
+EventDecoder::kernelName(DecodeKernel kernel)
+{
+    switch (kernel) {
+    case DECODE_AVX512: return "AVX512";
+    case DECODE_AVX2:   return "AVX2";
+    default:            return "SCALAR";
+    }
+}
+
+const EventColumns&
+EventDecoder::decodeChunk(const uint64_t* events, int n)
+{
+    columns->size = kernel(events, n, headers, columns);
+    return *columns;
+}
@@ -0,0 +1,137 @@
+#ifndef FASTLOG_EVENTDECODER_H
+#define FASTLOG_EVENTDECODER_H
+
+#include <algorithm>
+#include <cstdint>
+
+#include "EventBuffer.h"
+#include "EventLayout.h"
+#include "Utils.h"
+
+/**
+ * A chunk of decoded events in columnar (structure-of-arrays) form, so that
+ * analyses can scan just the fields they need.
+ */
+struct EventColumns {
+    /// Max. # events per chunk; 2K events take ~34 KB, so a chunk stays in
+    /// L1/L2 while it's consumed.
+    static const int CHUNK_EVENTS = 2048;
+
+    /// Vector kernels store whole vectors past the last event.
+    static const int SLACK = 16;
+
+    CACHE_ALIGNED uint64_t addr[CHUNK_EVENTS + SLACK];
+    CACHE_ALIGNED uint32_t loc[CHUNK_EVENTS + SLACK];
+    CACHE_ALIGNED uint32_t value[CHUNK_EVENTS + SLACK];
+    CACHE_ALIGNED uint8_t header[CHUNK_EVENTS + SLACK];
+
+    /// # events in this chunk.
+    int size;
+};
+
+/// Implementations of EventDecoder::decodeChunk() for the 64-bit layout.
+enum DecodeKernel {
+    DECODE_SCALAR,
+    DECODE_AVX2,
+    DECODE_AVX512,
+};
+
+/**
+ * Splits the events of event buffers into columns, keeping only the events
+ * whose header code is in a given set. Events in the 64-bit layout are
+ * decoded with SIMD kernels when the CPU supports them; other layouts fall
+ * back to decodeEvent().
+ */
+class EventDecoder {
+  public:
+    /// Header sets for the constructor.
+    static const uint32_t ALL_HEADERS = 0xFFFF;
+    static const uint32_t MEM_ACCESS_HEADERS = 0xFF00;
+
+    explicit EventDecoder(uint32_t headers = ALL_HEADERS,
+            DecodeKernel kernel = bestKernel());
+    ~EventDecoder();
+
+    EventDecoder(const EventDecoder&) = delete;
+    EventDecoder& operator=(const EventDecoder&) = delete;
+
+    /// Bit of header \p code in header sets.
+    static constexpr uint32_t
+    headerBit(uint64_t code)
+    {
+        return uint32_t(1) << code;
+    }
+
+    /// Fastest kernel the CPU supports.
+    static DecodeKernel bestKernel();
+    static bool supported(DecodeKernel kernel);
+    static const char* kernelName(DecodeKernel kernel);
+
+    /**
+     * Decode up to EventColumns::CHUNK_EVENTS events in the 64-bit layout.
+     *
+     * \return
+     *      The columns of the events that passed the header filter; valid
+     *      until the next call.
+     */
+    const EventColumns& decodeChunk(const uint64_t* events, int n);
+
+    /**
+     * Invoke \p func(const EventColumns&) on the events of \p logBuf, one
+     * chunk at a time, in order.
+     */
+    template <typename Func>
+    void
+    decode(const EventBuffer* logBuf, Func func)
+    {
+        if (logBuf->layout != EVENT_LAYOUT_64) {
+            decodeSlow(logBuf, func);
+            return;
+        }
+        logBuf->forEachChunk([&](const uint64_t* events, int n) {
+            for (int i = 0; i < n; i += EventColumns::CHUNK_EVENTS) {
+                int count = std::min(n - i, int(EventColumns::CHUNK_EVENTS));
+                func(decodeChunk(events + i, count));
+            }
+        });
+    }
+
+  private:
+    template <typename Func>
+    void
+    decodeSlow(const EventBuffer* logBuf, Func func)
+    {
+        TraceLayoutRecord layout = describeLayout(logBuf->layout);
+        columns->size = 0;
+        logBuf->forEachChunk([&](const uint64_t* events, int n) {
+            forEachEvent(layout, events, n, [&](const DecodedEvent& e) {
+                if (!(headers & headerBit(e.header))) {
+                    return;
+                }
+                int k = columns->size++;
+                columns->header[k] = uint8_t(e.header);
+                columns->loc[k] = uint32_t(e.loc);
+                columns->value[k] = uint32_t(e.value);
+                columns->addr[k] = e.addr;
+                if (columns->size == EventColumns::CHUNK_EVENTS) {
+                    func(*columns);
+                    columns->size = 0;
+                }
+            });
+        });
+        if (columns->size > 0) {
+            func(*columns);
+        }
+    }
+
+    /// Header codes of the events to keep.
+    const uint32_t headers;
+
+    /// Decodes one chunk of 64-bit events; returns # events kept.
+    int (*kernel)(const uint64_t* events, int n, uint32_t headers,
+            EventColumns* out);
+
+    EventColumns* columns;
+};
+
+#endif //FASTLOG_EVENTDECODER_H
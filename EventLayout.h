@@ -0,0 +1,354 @@
+#ifndef FASTLOG_EVENTLAYOUT_H
+#define FASTLOG_EVENTLAYOUT_H
+
+#include <cstdint>
+
+/// Where a field of an event lives: bits [offset, offset + width) of the
+/// given 64-bit word of the event.
+struct EventField {
+    int word;
+    int offset;
+    int width;
+
+    /// The field's bits, right-aligned.
+    constexpr uint64_t
+    mask() const
+    {
+        return (width == 64) ? ~uint64_t(0) : ((uint64_t(1) << width) - 1);
+    }
+
+    /// The field's bits in its word.
+    constexpr uint64_t
+    fieldMask() const
+    {
+        return mask() << offset;
+    }
+
+    /// Put \p value (truncated to the width of the field) in place.
+    constexpr uint64_t
+    pack(uint64_t value) const
+    {
+        return (value & mask()) << offset;
+    }
+
+    /// Extract the field from its word.
+    constexpr uint64_t
+    unpackWord(uint64_t w) const
+    {
+        return (w >> offset) & mask();
+    }
+
+    /// Extract the field from an encoded event.
+    uint64_t
+    unpack(const uint64_t* words) const
+    {
+        return unpackWord(words[word]);
+    }
+};
+
+/// Identifies an event layout in traces.
+enum EventLayoutId : uint8_t {
+    EVENT_LAYOUT_64 = 1,
+    EVENT_LAYOUT_128 = 2,
+    EVENT_LAYOUT_COMPACT32 = 3,
+};
+
+/**
+ * The 64-bit event layout.
+ *
+ * Header: 4 bit
+ * SrcLoc: 20 bit (~1M)
+ * Value: 8 bit (last byte of actual value)
+ * Address: 32 bit (address space is 48-bit)
+ */
+struct EventLayout64 {
+    static const EventLayoutId ID = EVENT_LAYOUT_64;
+    static const int WORDS = 1;
+    static constexpr EventField header() { return EventField{0, 60, 4}; }
+    static constexpr EventField loc() { return EventField{0, 40, 20}; }
+    static constexpr EventField value() { return EventField{0, 32, 8}; }
+    static constexpr EventField addr() { return EventField{0, 0, 32}; }
+};
+
+/**
+ * The 128-bit fallback in case truncating addresses to 32 bits causes false
+ * races.
+ *
+ * Word 0: Header (4 bit), SrcLoc (20 bit), 8 unused bits, Value (32 bit)
+ * Word 1: Address (48 bit)
+ */
+struct EventLayout128 {
+    static const EventLayoutId ID = EVENT_LAYOUT_128;
+    static const int WORDS = 2;
+    static constexpr EventField header() { return EventField{0, 60, 4}; }
+    static constexpr EventField loc() { return EventField{0, 40, 20}; }
+    static constexpr EventField value() { return EventField{0, 0, 32}; }
+    static constexpr EventField addr() { return EventField{1, 0, 48}; }
+};
+
+/**
+ * The experimental compact layout: a stream of 32-bit words in which a memory
+ * access is encoded as the address delta from the previous access logged with
+ * the same location, or escapes to a full EventLayout64 event when the delta
+ * doesn't fit. Locations are tracked in a small direct-mapped table of SLOTS
+ * entries that the decoder rebuilds from the escapes.
+ *
+ * Compact event: Tag (1 bit, 0), Slot (7 bit), Value (8 bit), Delta (16 bit)
+ * Escape: an EventLayout64 event, upper half first. Its header is that of a
+ *      memory access so the upper half starts with tag 1.
+ *
+ * Only the lower 32 bits of addresses are tracked, like in EventLayout64.
+ */
+struct EventLayoutCompact32 : EventLayout64 {
+    static const EventLayoutId ID = EVENT_LAYOUT_COMPACT32;
+    static const int SLOTS = 128;
+
+    /// Header of the accesses in compact events: 8-byte writes, the only
+    /// accesses the experiment logs so far.
+    static const uint64_t COMPACT_HEADER = 0b1111;
+    static constexpr EventField tag() { return EventField{0, 31, 1}; }
+    static constexpr EventField slot() { return EventField{0, 24, 7}; }
+    static constexpr EventField compactValue() { return EventField{0, 16, 8}; }
+    static constexpr EventField delta() { return EventField{0, 0, 16}; }
+
+    /// Slot of the location table tracking the last address of \p loc.
+    static constexpr int
+    slotOf(uint64_t loc)
+    {
+        return int(loc % SLOTS);
+    }
+
+    /// Whether an address delta can be encoded in a compact event.
+    static constexpr bool
+    fits(int64_t d)
+    {
+        return (d >= -(int64_t(1) << (delta().width - 1))) &&
+                (d < (int64_t(1) << (delta().width - 1)));
+    }
+
+    static constexpr uint32_t
+    encodeCompact(int s, uint64_t value, int64_t d)
+    {
+        return uint32_t(slot().pack(s) | compactValue().pack(value) |
+                delta().pack(uint64_t(d)));
+    }
+};
+
+/// An event decoded into its fields.
+struct DecodedEvent {
+    uint64_t header;
+    uint64_t loc;
+    uint64_t value;
+    uint64_t addr;
+};
+
+/**
+ * Compute the \p w-th word of an event. All fields are known at compile time,
+ * so this folds into the same shifts and masks one would write by hand.
+ */
+template <typename Layout>
+constexpr uint64_t
+encodeWord(int w, uint64_t header, uint64_t loc, uint64_t value, uint64_t addr)
+{
+    return (Layout::header().word == w ? Layout::header().pack(header) : 0) |
+            (Layout::loc().word == w ? Layout::loc().pack(loc) : 0) |
+            (Layout::value().word == w ? Layout::value().pack(value) : 0) |
+            (Layout::addr().word == w ? Layout::addr().pack(addr) : 0);
+}
+
+/**
+ * Encode an event into Layout::WORDS words starting at \p dst.
+ */
+template <typename Layout>
+__attribute__((always_inline, target("no-sse")))
+inline void
+encodeEvent(uint64_t* dst, uint64_t header, uint64_t loc, uint64_t value,
+        uint64_t addr)
+{
+    for (int w = 0; w < Layout::WORDS; w++) {
+        dst[w] = encodeWord<Layout>(w, header, loc, value, addr);
+    }
+}
+
+/**
+ * Decode the event that starts at \p src.
+ */
+template <typename Layout>
+inline DecodedEvent
+decodeEvent(const uint64_t* src)
+{
+    return DecodedEvent{Layout::header().unpack(src), Layout::loc().unpack(src),
+            Layout::value().unpack(src), Layout::addr().unpack(src)};
+}
+
+/**
+ * Layout record stored in traces (e.g., at the beginning of each epoch's
+ * events) so that readers can decode events without knowing how the logger
+ * was configured. Readers that don't recognize the layout ID can still decode
+ * events with the field table.
+ */
+struct TraceLayoutRecord {
+    /// "FLEL" in little-endian; identifies the record.
+    static const uint32_t MAGIC = 0x4c454c46;
+
+    /// Bumped on incompatible changes to this record.
+    static const uint16_t VERSION = 1;
+
+    uint32_t magic;
+    uint16_t version;
+    uint8_t layoutId;
+
+    /// # 64-bit words per event.
+    uint8_t words;
+
+    /// Header, location, value and address fields, in that order.
+    struct Field {
+        uint8_t word;
+        uint8_t offset;
+        uint8_t width;
+        uint8_t reserved;
+    } fields[4];
+
+    /**
+     * Describe the given layout.
+     */
+    template <typename Layout>
+    static constexpr TraceLayoutRecord
+    describe()
+    {
+        return TraceLayoutRecord{MAGIC, VERSION, Layout::ID, Layout::WORDS, {
+                field(Layout::header()), field(Layout::loc()),
+                field(Layout::value()), field(Layout::addr())}};
+    }
+
+    /**
+     * Decode the event that starts at \p src using the field table; slower
+     * than decodeEvent<Layout>() but works for any recorded layout.
+     */
+    DecodedEvent
+    decode(const uint64_t* src) const
+    {
+        return DecodedEvent{unpack(fields[0], src), unpack(fields[1], src),
+                unpack(fields[2], src), unpack(fields[3], src)};
+    }
+
+  private:
+    static constexpr Field
+    field(EventField f)
+    {
+        return Field{uint8_t(f.word), uint8_t(f.offset), uint8_t(f.width), 0};
+    }
+
+    static uint64_t
+    unpack(const Field& f, const uint64_t* src)
+    {
+        return EventField{f.word, f.offset, f.width}.unpack(src);
+    }
+};
+
+/**
+ * Get the layout record of one of the layouts above. The fields of the compact
+ * layout are those of its escape events.
+ */
+inline TraceLayoutRecord
+describeLayout(EventLayoutId id)
+{
+    switch (id) {
+    case EVENT_LAYOUT_128:
+        return TraceLayoutRecord::describe<EventLayout128>();
+    case EVENT_LAYOUT_COMPACT32:
+        return TraceLayoutRecord::describe<EventLayoutCompact32>();
+    default:
+        return TraceLayoutRecord::describe<EventLayout64>();
+    }
+}
+
+/**
+ * Decodes a stream of EventLayoutCompact32 events. Keeps the location table
+ * between calls, so the chunks of one stream must be decoded in order by the
+ * same decoder.
+ */
+class Compact32Decoder {
+  public:
+    typedef EventLayoutCompact32 L;
+
+    Compact32Decoder()
+        : slotLoc()
+        , slotAddr()
+    {}
+
+    /**
+     * Invoke \p func(const DecodedEvent&) on each event in the \p n 32-bit
+     * words starting at \p words. A trailing escape cut in half (i.e.,
+     * padding) is ignored.
+     */
+    template <typename Func>
+    void
+    decode(const uint32_t* words, int n, Func func)
+    {
+        for (int i = 0; i < n; i++) {
+            DecodedEvent e;
+            if (L::tag().unpackWord(words[i])) {
+                if (i + 1 >= n) {
+                    break;
+                }
+                uint64_t word = (uint64_t(words[i]) << 32) | words[i + 1];
+                e = decodeEvent<EventLayout64>(&word);
+                i++;
+                int slot = L::slotOf(e.loc);
+                slotLoc[slot] = e.loc;
+                slotAddr[slot] = e.addr;
+            } else {
+                int slot = int(L::slot().unpackWord(words[i]));
+                int64_t delta = int16_t(L::delta().unpackWord(words[i]));
+                slotAddr[slot] = L::addr().mask() &
+                        (slotAddr[slot] + uint64_t(delta));
+                e = DecodedEvent{L::COMPACT_HEADER, slotLoc[slot],
+                        L::compactValue().unpackWord(words[i]), slotAddr[slot]};
+            }
+            func(e);
+        }
+    }
+
+  private:
+    /// Location and (lower bits of the) last address logged in each slot.
+    uint64_t slotLoc[L::SLOTS];
+    uint64_t slotAddr[L::SLOTS];
+};
+
+/**
+ * Invoke \p func(const DecodedEvent&) on each of the events in a chunk of
+ * \p n words encoded with the layout described by \p layout.
+ */
+template <typename Func>
+void
+forEachEvent(const TraceLayoutRecord& layout, const uint64_t* chunk, int n,
+        Func func)
+{
+    switch (layout.layoutId) {
+    case EVENT_LAYOUT_64:
+        for (int i = 0; i + EventLayout64::WORDS <= n;
+                i += EventLayout64::WORDS) {
+            func(decodeEvent<EventLayout64>(chunk + i));
+        }
+        break;
+    case EVENT_LAYOUT_128:
+        for (int i = 0; i + EventLayout128::WORDS <= n;
+                i += EventLayout128::WORDS) {
+            func(decodeEvent<EventLayout128>(chunk + i));
+        }
+        break;
+    case EVENT_LAYOUT_COMPACT32:
+        // Note: assumes the stream isn't split across chunks.
+        Compact32Decoder().decode(reinterpret_cast<const uint32_t*>(chunk),
+                2 * n, func);
+        break;
+    default:
+        for (int i = 0; i + layout.words <= n; i += layout.words) {
+            func(layout.decode(chunk + i));
+        }
+        break;
+    }
+}
+
+#endif //FASTLOG_EVENTLAYOUT_H
@@ -0,0 +1,212 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+#include "RuntimeStats.h"
+
+/**
+ * Live view of the stats page of a FastLog process (see RuntimeStats):
+ * epoch rate, dropped epochs, event buffers in flight, worker queue depth,
+ * latency percentiles of epoch changes and buffer switches, recent epochs,
+ * and the activity of each thread. Refreshes every interval until the
+ * process exits; --once prints one report (rates over one interval) and
+ * exits.
+ *
+ * Usage: fastlog-top [--once] [--interval <ms>] <pid | stats page path>
+ */
+
+/// # recent epochs and # busiest threads to show.
+static const int SHOWN_EPOCHS = 8;
+static const int SHOWN_THREADS = 16;
+
+/// Snapshot of the counters needed to compute rates.
+struct Snapshot {
+    uint64_t epoch;
+    uint64_t threadEvents[StatsPage::MAX_THREADS];
+    int64_t timeNs;
+};
+
+static int64_t
+nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void
+takeSnapshot(const StatsPage* page, Snapshot* snapshot)
+{
+    snapshot->epoch = page->epoch.get();
+    for (int i = 0; i < StatsPage::MAX_THREADS; i++) {
+        snapshot->threadEvents[i] = page->threads[i].events.get();
+    }
+    snapshot->timeNs = nowNs();
+}
+
+/// Format a duration in ns with a suitable unit.
+static std::string
+formatNs(uint64_t ns)
+{
+    char buf[32];
+    if (ns < 10000) {
+        snprintf(buf, sizeof(buf), "%luns", ns);
+    } else if (ns < 10000000) {
+        snprintf(buf, sizeof(buf), "%luus", ns / 1000);
+    } else {
+        snprintf(buf, sizeof(buf), "%lums", ns / 1000000);
+    }
+    return buf;
+}
+
+static std::string
+formatPercentiles(const StatsHistogram& histogram)
+{
+    return "p50 <" + formatNs(histogram.percentile(50)) + " p99 <" +
+            formatNs(histogram.percentile(99)) + " max <" +
+            formatNs(histogram.percentile(100));
+}
+
+static void
+printReport(const StatsPage* page, const Snapshot& prev, const Snapshot& cur)
+{
+    double secs = double(cur.timeNs - prev.timeNs) * 1e-9;
+    printf("pid %d, epoch %lu (%.1f/s), handedOffEpochs %lu, "
+           "droppedEpochs %lu, workerQueueDepth %lu, buffersInFlight %lu\n",
+            page->appPid, cur.epoch, double(cur.epoch - prev.epoch) / secs,
+            page->handedOffEpochs.get(), page->droppedEpochs.get(),
+            page->workerQueueDepth.get(), page->buffersInFlight.get());
+
+    StatsHistogram allocBufferNs{};
+    for (const ThreadStats& thread : page->threads) {
+        for (int b = 0; b < StatsHistogram::BUCKETS; b++) {
+            allocBufferNs.counts[b].add(thread.allocBufferNs.counts[b].get());
+        }
+    }
+    printf("epochDuration %s\n",
+            formatPercentiles(page->epochDurationNs).c_str());
+    printf("tryIncEpoch   %s\n", formatPercentiles(page->tryIncEpochNs).c_str());
+    printf("allocBuffer   %s\n", formatPercentiles(allocBufferNs).c_str());
+
+    printf("\n%10s %12s %10s %14s\n", "epoch", "durationMs", "buffers",
+            "events");
+    for (int i = 1; i <= SHOWN_EPOCHS; i++) {
+        int epoch = int(cur.epoch) - i;
+        if (epoch < 0) {
+            break;
+        }
+        const EpochStats& recent =
+                page->recentEpochs[epoch % StatsPage::RECENT_EPOCHS];
+        if (recent.epoch.load(std::memory_order_acquire) != epoch) {
+            continue;
+        }
+        printf("%10d %12.2f %10lu %14lu\n", epoch,
+                double(recent.durationNs.get()) * 1e-6, recent.buffers.get(),
+                recent.events.get());
+    }
+
+    // Busiest threads first.
+    int order[StatsPage::MAX_THREADS];
+    int numThreads = 0;
+    for (int i = 0; i < StatsPage::MAX_THREADS; i++) {
+        if (page->threads[i].threadId.load(std::memory_order_relaxed) >= 0) {
+            order[numThreads++] = i;
+        }
+    }
+    auto rate = [&](int slot) {
+        return cur.threadEvents[slot] - prev.threadEvents[slot];
+    };
+    for (int i = 1; i < numThreads; i++) {
+        for (int j = i; (j > 0) && (rate(order[j]) > rate(order[j - 1]));
+                j--) {
+            std::swap(order[j], order[j - 1]);
+        }
+    }
+    printf("\n%8s %10s %10s %14s %12s %14s\n", "thread", "buffers",
+            "slowPath", "events", "eventsPerSec", "allocBuffer99");
+    for (int i = 0; (i < numThreads) && (i < SHOWN_THREADS); i++) {
+        const ThreadStats& thread = page->threads[order[i]];
+        printf("%8d %10lu %10lu %14lu %11.2fM %14s\n", thread.threadId.load(),
+                thread.buffers.get(), thread.slowPathHits.get(),
+                thread.events.get(), double(rate(order[i])) / secs * 1e-6,
+                formatNs(thread.allocBufferNs.percentile(99)).c_str());
+    }
+    fflush(stdout);
+}
+
+int
+main(int argc, char** argv)
+{
+    bool once = false;
+    int intervalMs = 1000;
+    const char* target = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--once") == 0) {
+            once = true;
+        } else if ((strcmp(argv[i], "--interval") == 0) && (i + 1 < argc)) {
+            intervalMs = atoi(argv[++i]);
+        } else if (target == NULL) {
+            target = argv[i];
+        } else {
+            target = NULL;
+            break;
+        }
+    }
+    if ((target == NULL) || (intervalMs <= 0)) {
+        fprintf(stderr, "usage: %s [--once] [--interval <ms>] "
+                "<pid | stats page path>\n", argv[0]);
+        return 1;
+    }
+
+    std::string path = (target[0] == '/') ? std::string(target) :
+            RuntimeStats::defaultPath(atoi(target));
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+        perror(path.c_str());
+        return 1;
+    }
+    if (size_t(st.st_size) < sizeof(StatsPage)) {
+        fprintf(stderr, "%s: not a FastLog stats page\n", path.c_str());
+        return 1;
+    }
+    void* mem = mmap(NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    const StatsPage* page = static_cast<const StatsPage*>(mem);
+    if ((page->magic != StatsPage::MAGIC) ||
+            (page->version != StatsPage::VERSION)) {
+        fprintf(stderr, "%s: not a FastLog stats page\n", path.c_str());
+        return 1;
+    }
+
+    Snapshot prev, cur;
+    takeSnapshot(page, &prev);
+    while (true) {
+        usleep(useconds_t(intervalMs) * 1000);
+        takeSnapshot(page, &cur);
+        bool alive = (kill(page->appPid, 0) == 0) || (errno != ESRCH);
+        if (!once) {
+            // Clear the screen.
+            printf("\033[H\033[2J");
+        }
+        printReport(page, prev, cur);
+        if (once || !alive) {
+            break;
+        }
+        prev = cur;
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+
+#include "FlightRecorder.h"
+
+/**
+ * Write all \p n bytes at \p src to \p fd. Async-signal-safe.
+ */
+static bool
+writeAll(int fd, const void* src, size_t n)
+{
+    const char* p = static_cast<const char*>(src);
+    while (n > 0) {
+        ssize_t written = ::write(fd, p, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += written;
+        n -= size_t(written);
+    }
+    return true;
+}
+
+FlightRecord
+FlightRecord::make(uint16_t flags, int epoch, int threadId,
+        EventLayoutId layout, int events, size_t bytes)
+{
+    FlightRecord record;
+    std::memset(&record, 0, sizeof(record));
+    record.magic = FlightRecord::MAGIC;
+    record.version = FlightRecord::VERSION;
+    record.flags = flags;
+    record.epoch = epoch;
+    record.threadId = threadId;
+    record.events = uint32_t(events);
+    record.bytes = bytes;
+    record.layout = describeLayout(layout);
+    return record;
+}
+
+/**
+ * Write the raw events of an event buffer to a dump. Doesn't allocate memory
+ * and only uses async-signal-safe system calls, so it can be used from
+ * signal handlers.
+ *
+ * \return
+ *      False if a write failed (with errno set).
+ */
+bool
+writeFlightRecord(int fd, const EventBuffer* logBuf)
+{
+    FlightRecord record = FlightRecord::make(0, logBuf->epoch,
+            logBuf->threadId, logBuf->layout, logBuf->events,
+            size_t(logBuf->events) * EventBuffer::EVENT_SIZE);
+    bool ok = writeAll(fd, &record, sizeof(record));
+    logBuf->forEachChunk([fd, &ok](const uint64_t* events, int n) {
+        ok = ok && writeAll(fd, events, size_t(n) * EventBuffer::EVENT_SIZE);
+    });
+    return ok;
+}
+
+/**
+ * Write an event buffer archived with EpochArchive::archive() to a dump.
+ *
+ * \return
+ *      False if a write failed (with errno set).
+ */
+bool
+writeFlightRecord(int fd, int epoch, const ArchivedBuffer& buf)
+{
+    uint16_t flags = (buf.layout == EVENT_LAYOUT_64) ?
+            FlightRecord::COMPRESSED : 0;
+    FlightRecord record = FlightRecord::make(flags, epoch, buf.threadId,
+            buf.layout, buf.events, buf.data.size());
+    return writeAll(fd, &record, sizeof(record)) &&
+            writeAll(fd, buf.data.data(), buf.data.size());
+}
+
+/**
+ * Read back the event buffers of a flight recorder dump, decompressing them
+ * as needed.
+ *
+ * \throw std::system_error
+ *      The dump can't be opened.
+ * \throw std::runtime_error
+ *      The dump is malformed or truncated.
+ */
+std::vector<FlightRecorderBuffer>
+loadFlightRecorder(const char* path)
+{
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> file(
+            std::fopen(path, "rb"), std::fclose);
+    if (!file) {
+        throw std::system_error(errno, std::system_category(), path);
+    }
+
+    std::vector<FlightRecorderBuffer> buffers;
+    FlightRecord record;
+    while (std::fread(&record, sizeof(record), 1, file.get()) == 1) {
+        if ((record.magic != FlightRecord::MAGIC) ||
+                (record.version != FlightRecord::VERSION)) {
+            throw std::runtime_error("bad flight recorder record");
+        }
+        ArchivedBuffer buf;
+        buf.threadId = record.threadId;
+        buf.layout = EventLayoutId(record.layout.layoutId);
+        buf.events = int(record.events);
+        buf.data.resize(record.bytes);
+        if (std::fread(buf.data.data(), 1, buf.data.size(), file.get()) !=
+                buf.data.size()) {
+            throw std::runtime_error("truncated flight recorder dump");
+        }
+
+        buffers.emplace_back();
+        buffers.back().record = record;
+        if (record.flags & FlightRecord::COMPRESSED) {
+            EpochArchive::restore(buf, &buffers.back().events);
+        } else {
+            buffers.back().events.resize(record.bytes / sizeof(uint64_t));
+            std::memcpy(buffers.back().events.data(), buf.data.data(),
+                    record.bytes);
+        }
+    }
+    return buffers;
+}
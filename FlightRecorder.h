@@ -0,0 +1,56 @@
+#ifndef FASTLOG_FLIGHTRECORDER_H
+#define FASTLOG_FLIGHTRECORDER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "EpochArchive.h"
+#include "EventBuffer.h"
+#include "EventLayout.h"
+
+/**
+ * Header of one event buffer in a flight recorder dump (see
+ * BufferManager::dumpFlightRecorder()). A dump is just a sequence of such
+ * records, each followed by #bytes of event data: the raw events, or the
+ * output of EventCodec::compress() if the COMPRESSED flag is set. Also used
+ * to ship event buffers to remote analyzers (see RemoteAnalyzers).
+ */
+struct FlightRecord {
+    /// "FLFR" in little-endian; identifies the record.
+    static const uint32_t MAGIC = 0x52464c46;
+
+    /// Bumped on incompatible changes to this record.
+    static const uint16_t VERSION = 1;
+
+    /// Flags.
+    static const uint16_t COMPRESSED = 1;
+    static const uint16_t END_OF_EPOCH = 2;
+
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    int32_t epoch;
+    int32_t threadId;
+    uint32_t events;
+    uint32_t reserved;
+    uint64_t bytes;
+
+    /// Layout of the events, so that dumps can be read without knowing the
+    /// logging configuration.
+    TraceLayoutRecord layout;
+
+    static FlightRecord make(uint16_t flags, int epoch, int threadId,
+            EventLayoutId layout, int events, size_t bytes);
+};
+
+/// Event buffer loaded from a flight recorder dump.
+struct FlightRecorderBuffer {
+    FlightRecord record;
+    std::vector<uint64_t> events;
+};
+
+bool writeFlightRecord(int fd, const EventBuffer* logBuf);
+bool writeFlightRecord(int fd, int epoch, const ArchivedBuffer& buf);
+std::vector<FlightRecorderBuffer> loadFlightRecorder(const char* path);
+
+#endif //FASTLOG_FLIGHTRECORDER_H
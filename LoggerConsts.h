@@ -3,27 +3,73 @@
 
 #include <cstdint>
 
+#include "EventLayout.h"
+
 // FIXME: what does static global mean in header again?
 
-/// Layout of a 64-bit event
-/// Header: 4 bit
-/// SrcLoc: 20 bit (~1M)
-/// Value: 8 bit (last byte of actual value)
-/// Address: 32 bit (address space is 48-bit)
+// Header codes and masks of the 64-bit event layout (see EventLayout64),
+// derived from its field descriptors.
 
-static const uint64_t TSAN_HDR_ZERO_MASK = ~(((uint64_t) 0b1111) << 60);
+static const uint64_t TSAN_HDR_ZERO_MASK =
+        ~EventLayout64::header().fieldMask();
+/// Layout of the LOG_VALUE experiment only: the value byte goes right below
+/// the header.
 static const uint64_t TSAN_VAL_ZERO_MASK = ~(((uint64_t) 0b111111111111) << 52);
-static const uint64_t TSAN_LOC_ZERO_MASK = ~(((uint64_t) 0xFFFFFFFF) << 32);
+/// Keeps the address field (i.e., zeroes the header, location and value).
+static const uint64_t TSAN_LOC_ZERO_MASK = EventLayout64::addr().fieldMask();
+
+/// Bit of the header code set for memory access events.
+static const uint64_t TSAN_HDR_MEM_ACCESS = 0b1000;
 
 // isMemAcc = 0, eventType = 001
-static const uint64_t TSAN_RDTSC = ((uint64_t) 0b0001) << 60;
+static const uint64_t TSAN_RDTSC = EventLayout64::header().pack(0b0001);
+// isMemAcc = 0, eventType = 010; ID of the thread that logs the following
+// events in the lower 32 bits (only used by per-CPU event buffers)
+static const uint64_t TSAN_THREAD_SWITCH = EventLayout64::header().pack(0b0010);
+// isMemAcc = 0, eventType = 011; upper 32 bits of the addresses of the
+// following memory accesses in the address field, logged whenever they change
+// so that 48-bit addresses can be rebuilt from the lower 32 bits kept in each
+// event (see addrBaseOf())
+static const uint64_t TSAN_ADDR_BASE = EventLayout64::header().pack(0b0011);
+// isMemAcc = 0, eventType = 100/101; acquire/release of the lock whose
+// address is in the address field (only generated by SyntheticTrace so far)
+static const uint64_t TSAN_ACQUIRE = EventLayout64::header().pack(0b0100);
+static const uint64_t TSAN_RELEASE = EventLayout64::header().pack(0b0101);
+// isMemAcc = 1, isWrite = 0, accessSizeLog = 3
+static const uint64_t TSAN_READ8 = EventLayout64::header().pack(0b1011);
 // isMemAcc = 1, isWrite = 1, accessSizeLog = 0
-static const uint64_t TSAN_WRITE1 = ((uint64_t) 0b1100) << 60;
+static const uint64_t TSAN_WRITE1 = EventLayout64::header().pack(0b1100);
 // isMemAcc = 1, isWrite = 1, accessSizeLog = 1
-static const uint64_t TSAN_WRITE2 = ((uint64_t) 0b1101) << 60;
+static const uint64_t TSAN_WRITE2 = EventLayout64::header().pack(0b1101);
 // isMemAcc = 1, isWrite = 1, accessSizeLog = 2
-static const uint64_t TSAN_WRITE4 = ((uint64_t) 0b1110) << 60;
+static const uint64_t TSAN_WRITE4 = EventLayout64::header().pack(0b1110);
 // isMemAcc = 1, isWrite = 1, accessSizeLog = 3
-static const uint64_t TSAN_WRITE8 = ((uint64_t) 0b1111) << 60;
+static const uint64_t TSAN_WRITE8 = EventLayout64::header().pack(0b1111);
+
+/// Header codes (i.e., unshifted) of the events above, for encoders that take
+/// the layout as a parameter (see encodeEvent()).
+static const uint64_t TSAN_HDR_RDTSC = 0b0001;
+static const uint64_t TSAN_HDR_THREAD_SWITCH = 0b0010;
+static const uint64_t TSAN_HDR_ADDR_BASE = 0b0011;
+static const uint64_t TSAN_HDR_ACQUIRE = 0b0100;
+static const uint64_t TSAN_HDR_RELEASE = 0b0101;
+static const uint64_t TSAN_HDR_READ8 = 0b1011;
+static const uint64_t TSAN_HDR_WRITE8 = 0b1111;
+
+/// Upper address bits dropped by the 64-bit layout, i.e., what address base
+/// markers carry.
+inline uint64_t
+addrBaseOf(uint64_t addr)
+{
+    return addr >> EventLayout64::addr().width;
+}
+
+/// Rebuild an address from the latest address base marker and the lower bits
+/// kept in a memory access event.
+inline uint64_t
+rebuildAddr(uint64_t addrBase, uint64_t addrLow)
+{
+    return (addrBase << EventLayout64::addr().width) | addrLow;
+}
 
 #endif //FASTLOG_LOGGER_H
@@ -0,0 +1,460 @@
+#ifndef FASTLOG_LOGGERPOLICIES_H
+#define FASTLOG_LOGGERPOLICIES_H
+
+#include <cstdint>
+#include <string>
+
+#include "Context.h"
+#include "LoggerConsts.h"
+#include "Prefetch.h"
+#include "Utils.h"
+
+// Building blocks of the logging fast path. Each experiment used to be a
+// hand-written __tsan_write8_* function hard-coding one combination of event
+// layout, event buffer pointer access, prefetch, and timestamps; Logger
+// composes them at compile time instead. Every policy member is always
+// inlined, so each combination compiles down to the same code as its
+// hand-written counterpart. Like the instrumented functions of Main.cc, they
+// are compiled with target("no-sse"): GCC refuses to inline an always_inline
+// function into a caller with fewer target features.
+
+/////////////////////////////////////////////////////////////////////////////
+// Layout policies: how an event is encoded.
+/////////////////////////////////////////////////////////////////////////////
+
+/// Log just the memory access address.
+struct AddrLayout {
+    static const int WORDS = 1;
+    static const char* name() { return "ADDR"; }
+
+    __attribute__((always_inline, target("no-sse")))
+    static void
+    encode(uint64_t* dst, uint64_t /* pc */, void* addr, uint64_t /* val */)
+    {
+        dst[0] = (uint64_t) addr;
+    }
+};
+
+/// (Ab)use the highest 4 bits of the address as the event header.
+struct HeaderLayout {
+    static const int WORDS = 1;
+    static const char* name() { return "HEADER"; }
+
+    __attribute__((always_inline, target("no-sse")))
+    static void
+    encode(uint64_t* dst, uint64_t /* pc */, void* addr, uint64_t /* val */)
+    {
+        // Note: assigning the header as a byte by overwriting the highest byte
+        // seems to be much slower than bit manipulation.
+        dst[0] = TSAN_WRITE8 | (TSAN_HDR_ZERO_MASK & (uint64_t) addr);
+    }
+};
+
+/// (Ab)use the next 8 bits of the address to store the last byte of the value.
+struct ValueLayout {
+    static const int WORDS = 1;
+    static const char* name() { return "VALUE"; }
+
+    __attribute__((always_inline, target("no-sse")))
+    static void
+    encode(uint64_t* dst, uint64_t /* pc */, void* addr, uint64_t val)
+    {
+        val = uint64_t((char) val) << 52;
+        dst[0] = TSAN_WRITE8 | val | (TSAN_VAL_ZERO_MASK & (uint64_t) addr);
+    }
+};
+
+/// The full 64-bit event: header, a unique location ID (just the last 20 bits
+/// of CALLERPC for now), the last byte of the value and the lower 32 bits of
+/// the address (see EventLayout64).
+struct Full64Layout {
+    typedef EventLayout64 Format;
+    static const int WORDS = Format::WORDS;
+    static const char* name() { return "FULL64"; }
+
+    // TODO: would it be faster to use uint32_t pc? maybe, but pc is known at
+    // compile-time so it probably doesn't matter if the write function is
+    // inlined.
+    __attribute__((always_inline, target("no-sse")))
+    static void
+    encode(uint64_t* dst, uint64_t pc, void* addr, uint64_t val)
+    {
+        encodeEvent<Format>(dst, TSAN_HDR_WRITE8, pc, val, (uint64_t) addr);
+    }
+};
+
+/// The 128-bit fallback in case 32-bit addresses cause false races (see
+/// EventLayout128).
+struct Full128Layout {
+    typedef EventLayout128 Format;
+    static const int WORDS = Format::WORDS;
+    static const char* name() { return "FULL128"; }
+
+    __attribute__((always_inline, target("no-sse")))
+    static void
+    encode(uint64_t* dst, uint64_t pc, void* addr, uint64_t val)
+    {
+        encodeEvent<Format>(dst, TSAN_HDR_WRITE8, pc, val, (uint64_t) addr);
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Buffer pointer policies: how the fast path gets at the event buffer.
+//
+// Each policy provides a View of the buffer (buf, events, nextRdtscTime)
+// that is obtained once per event, and may ask the buffer manager for a new
+// buffer if the current one has been reclaimed.
+/////////////////////////////////////////////////////////////////////////////
+
+/// View of an event buffer accessed through its EventBuffer object.
+struct EventBufferView {
+    EventBuffer* logBuf;
+
+    __attribute__((always_inline, target("no-sse")))
+    uint64_t* buf() { return logBuf->buf; }
+    __attribute__((always_inline, target("no-sse")))
+    int& events() { return logBuf->events; }
+    __attribute__((always_inline, target("no-sse")))
+    int&
+    nextRdtscTime()
+    {
+        return logBuf->nextRdtscTime;
+    }
+};
+
+/// View of an event buffer through a local copy of its fields (i.e., a Ref).
+struct RefView {
+    EventBuffer::Ref* ref;
+
+    __attribute__((always_inline, target("no-sse")))
+    uint64_t* buf() { return ref->buf; }
+    __attribute__((always_inline, target("no-sse")))
+    int& events() { return ref->events; }
+    __attribute__((always_inline, target("no-sse")))
+    int&
+    nextRdtscTime()
+    {
+        return ref->nextRdtscTime;
+    }
+};
+
+/// Read `__log_buffer` non-atomically. Since the pointer never changes as far
+/// as the compiler knows, it's loaded once into a temporary local variable.
+struct GlobalBufPtr {
+    typedef EventBufferView View;
+    static const bool CHECKS_RECLAIM = false;
+    static const char* name() { return "GLOBAL"; }
+
+    __attribute__((always_inline, target("no-sse")))
+    EventBuffer* current() { return NULL; }
+    __attribute__((always_inline, target("no-sse")))
+    View
+    view()
+    {
+        return View{getLogBufferUnsafe()};
+    }
+    void reattach(EventBuffer* /* curBuf */) {}
+    template <typename Func> void block(Func func) { func(); }
+};
+
+/// Use an atomic operation to load the event buffer pointer on each event so
+/// that the compiler cannot hoist it into a temporary local variable.
+struct VolatileBufPtr {
+    typedef EventBufferView View;
+    static const bool CHECKS_RECLAIM = false;
+    static const char* name() { return "VOLATILE"; }
+
+    __attribute__((always_inline, target("no-sse")))
+    EventBuffer* current() { return NULL; }
+    __attribute__((always_inline, target("no-sse")))
+    View
+    view()
+    {
+        return View{getLogBuffer()};
+    }
+    void reattach(EventBuffer* /* curBuf */) {}
+    template <typename Func> void block(Func func) { func(); }
+};
+
+/// Remove indirect access to EventBuffer::{events, buf} at the source level by
+/// copying them into local variables. The generated code should be the same
+/// as GlobalBufPtr.
+struct LocalBufPtr {
+    typedef RefView View;
+    static const bool CHECKS_RECLAIM = false;
+    static const char* name() { return "LOCAL"; }
+
+    LocalBufPtr()
+        : ref(getLogBuffer())
+    {}
+
+    __attribute__((always_inline, target("no-sse")))
+    EventBuffer* current() { return NULL; }
+    __attribute__((always_inline, target("no-sse")))
+    View
+    view()
+    {
+        return View{&ref};
+    }
+    void reattach(EventBuffer* /* curBuf */) {}
+    template <typename Func> void block(Func func) { func(); }
+
+    EventBuffer::Ref ref;
+};
+
+/// Cache the event buffer pointer (and fields) in a Ref, but check on each
+/// event whether the buffer manager has reclaimed `__log_buffer`.
+struct CachedBufPtr {
+    typedef RefView View;
+    static const bool CHECKS_RECLAIM = true;
+    static const char* name() { return "CACHED"; }
+
+    CachedBufPtr()
+        : ref(getLogBufferRef())
+    {}
+
+    __attribute__((always_inline, target("no-sse")))
+    EventBuffer*
+    current()
+    {
+        return getLogBuffer();
+    }
+    __attribute__((always_inline, target("no-sse")))
+    View
+    view()
+    {
+        return View{&ref};
+    }
+
+    void
+    reattach(EventBuffer* /* curBuf */)
+    {
+        // Note: a real implementation will have to deal with the last event
+        // properly, block at a barrier, etc.
+        ref.updateLogBuffer(__buf_manager.allocBuffer());
+    }
+
+    template <typename Func>
+    void
+    block(Func func)
+    {
+        blockOutsideFastPath(&ref, func);
+    }
+
+    EventBuffer::Ref ref;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Prefetch policies: run once per batch of events.
+/////////////////////////////////////////////////////////////////////////////
+
+struct NoPrefetch {
+    static const bool ENABLED = false;
+    static const char* name() { return "NO_PREFETCH"; }
+    static void prefetch(uint64_t* /* curPos */) {}
+};
+
+/// Prefetch the entries to write a calibrated distance ahead (see
+/// prefetchLogEntries()).
+struct BatchPrefetch {
+    static const bool ENABLED = true;
+    static const char* name() { return "PREFETCH"; }
+
+    static void
+    prefetch(uint64_t* curPos)
+    {
+        // TODO: shall we move prefetch before if?
+        prefetchLogEntries(curPos);
+    }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Timestamp policies: run once per batch of events.
+/////////////////////////////////////////////////////////////////////////////
+
+struct NoTimestamp {
+    static const bool ENABLED = false;
+    static const char* name() { return "NO_RDTSC"; }
+    static void log(uint64_t* /* buf */, int& /* events */) {}
+};
+
+/// Log an RDTSC event at the end of each batch.
+struct RdtscTimestamp {
+    static const bool ENABLED = true;
+    static const char* name() { return "RDTSC"; }
+
+    static void
+    log(uint64_t* buf, int& events)
+    {
+        buf[events++] = TSAN_RDTSC | (TSAN_HDR_ZERO_MASK & rdtsc());
+    }
+};
+
+/**
+ * Event logger assembled from compile-time policies (see above). Wraps around
+ * at the end of its event buffer like the other micro-benchmarks.
+ *
+ * \tparam Layout
+ *      How to encode an event.
+ * \tparam BufPtr
+ *      How to access the event buffer.
+ * \tparam Prefetch
+ *      Whether to prefetch the event buffer once per batch.
+ * \tparam Timestamp
+ *      Whether to log a timestamp once per batch.
+ */
+template <typename Layout, typename BufPtr, typename Prefetch,
+        typename Timestamp>
+class Logger {
+  public:
+    /// # 64-bit words per event (not counting timestamps).
+    static const int WORDS = Layout::WORDS;
+
+    explicit Logger(int capacity)
+        : bufPtr()
+        , capacity(capacity)
+    {}
+
+    static std::string
+    name()
+    {
+        return std::string(Layout::name()) + "/" + BufPtr::name() + "/" +
+                Prefetch::name() + "/" + Timestamp::name();
+    }
+
+    __attribute__((always_inline, target("no-sse")))
+    void
+    write8(uint64_t pc, void* addr, uint64_t val)
+    {
+        EventBuffer* curBuf = bufPtr.current();
+        typename BufPtr::View view = bufPtr.view();
+        Layout::encode(&view.buf()[view.events()], pc, addr, val);
+        // Note: two small details that lead to noticeably better performance
+        // are 1) pre-increment and 2) evaluate `curBuf == NULL` later.
+        view.events() += Layout::WORDS;
+        int limit = BATCHED ? view.nextRdtscTime() : capacity;
+        if (UNLIKELY((view.events() >= limit) || reclaimed(curBuf))) {
+            slowPath(view, curBuf);
+        }
+    }
+
+    /// The layouts only encode writes, so reads are logged the same way.
+    __attribute__((always_inline, target("no-sse")))
+    void
+    read8(uint64_t pc, void* addr, uint64_t val)
+    {
+        write8(pc, addr, val);
+    }
+
+    /// Run \p func, which may block, outside of the fast path.
+    template <typename Func>
+    void
+    block(Func func)
+    {
+        bufPtr.block(func);
+    }
+
+  private:
+    /// Whether there is per-batch work to do on the slow path.
+    static const bool BATCHED = Prefetch::ENABLED || Timestamp::ENABLED;
+
+    __attribute__((always_inline, target("no-sse")))
+    static bool
+    reclaimed(EventBuffer* curBuf)
+    {
+        return BufPtr::CHECKS_RECLAIM && (curBuf == NULL);
+    }
+
+    // TODO: investigate why forcing noinline on the slow path could lead to
+    // significantly worse performance.
+    void
+    slowPath(typename BufPtr::View view, EventBuffer* curBuf)
+    {
+        // Get a new event buffer if our current one has been reclaimed.
+        if (reclaimed(curBuf)) {
+            bufPtr.reattach(curBuf);
+            return;
+        }
+
+        // But, most likely, the event buffer pointer will remain intact.
+        if (BATCHED) {
+            view.nextRdtscTime() += EventBuffer::BATCH_SIZE;
+            Timestamp::log(view.buf(), view.events());
+            Prefetch::prefetch(&view.buf()[view.events()]);
+        }
+        if (UNLIKELY(view.events() >= capacity)) {
+            // Note: the real implementation will not wrap around; instead, it
+            // will contact the buffer manager to advance the epoch.
+            view.events() = 0;
+            view.nextRdtscTime() = EventBuffer::BATCH_SIZE;
+        }
+    }
+
+    BufPtr bufPtr;
+
+    /// # events after which to wrap around.
+    const int capacity;
+};
+
+/// A compile-time list of policies.
+template <typename... Policies>
+struct PolicyList {};
+
+typedef PolicyList<AddrLayout, HeaderLayout, ValueLayout, Full64Layout,
+        Full128Layout> AllLayouts;
+typedef PolicyList<GlobalBufPtr, VolatileBufPtr, LocalBufPtr, CachedBufPtr>
+        AllBufPtrs;
+typedef PolicyList<NoPrefetch, BatchPrefetch> AllPrefetches;
+typedef PolicyList<NoTimestamp, RdtscTimestamp> AllTimestamps;
+
+/// Enumerates the cartesian product of policy lists; `Chosen` holds the
+/// policies picked so far.
+template <typename Chosen, typename... Lists>
+struct LoggerEnumerator;
+
+template <typename... Chosen>
+struct LoggerEnumerator<PolicyList<Chosen...>> {
+    template <typename Visitor>
+    static void
+    visit(Visitor* visitor)
+    {
+        visitor->template visit<Logger<Chosen...>>();
+    }
+};
+
+template <typename... Chosen, typename... Lists>
+struct LoggerEnumerator<PolicyList<Chosen...>, PolicyList<>, Lists...> {
+    template <typename Visitor>
+    static void
+    visit(Visitor* /* visitor */)
+    {}
+};
+
+template <typename... Chosen, typename First, typename... Others,
+        typename... Lists>
+struct LoggerEnumerator<PolicyList<Chosen...>, PolicyList<First, Others...>,
+        Lists...> {
+    template <typename Visitor>
+    static void
+    visit(Visitor* visitor)
+    {
+        LoggerEnumerator<PolicyList<Chosen..., First>, Lists...>::visit(
+                visitor);
+        LoggerEnumerator<PolicyList<Chosen...>, PolicyList<Others...>,
+                Lists...>::visit(visitor);
+    }
+};
+
+/**
+ * Invoke `visitor->visit<L>()` for every Logger type L that can be assembled
+ * from the policies above.
+ */
+template <typename Visitor>
+void
+forEachLogger(Visitor* visitor)
+{
+    LoggerEnumerator<PolicyList<>, AllLayouts, AllBufPtrs, AllPrefetches,
+            AllTimestamps>::visit(visitor);
+}
+
+#endif //FASTLOG_LOGGERPOLICIES_H
@@ -1,14 +1,81 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <sstream>
 #include <thread>
+#include <vector>
 
+#include "BenchResults.h"
 #include "BufferManager.h"
 #include "Context.h"
+#include "EpochArchive.h"
+#include "EventCodec.h"
+#include "EventDecoder.h"
+#include "FlightRecorder.h"
 #include "LoggerConsts.h"
+#include "LoggerPolicies.h"
+#include "PerCpuBuffers.h"
+#include "PerfCounters.h"
+#include "PointerChase.h"
+#include "Prefetch.h"
+#include "RemoteAnalyzers.h"
+#include "RuntimeStats.h"
+#include "SharedRegion.h"
+#include "SyntheticTrace.h"
 #include "Utils.h"
+#include "Workloads.h"
 
 /// # times to (over)write the array.
 static int numIterations = 1000;
 
+/// Order in which the experiments that support it (LOG_FULL and COMPACT_32)
+/// write the array; set via the environment variable FASTLOG_ACCESS_PATTERN
+/// ("sequential", "strided" or "random").
+enum AccessPattern {
+    SEQUENTIAL,
+    STRIDED,
+    RANDOM,
+};
+static AccessPattern accessPattern = SEQUENTIAL;
+
+/// Random permutation of array indices used by the RANDOM access pattern.
+static std::vector<int> randomOrder;
+
+/// # bytes of events logged by this thread, in the experiments that keep
+/// track of it.
+static __thread uint64_t loggedBytes;
+
+/// Event mix of the SYNTHETIC_TRACE experiment.
+static TraceProfile traceProfile;
+
+/// How the STACK_FILTER experiment treats stores to the stack; set via the
+/// environment variable FASTLOG_STACK_FILTER ("none", "runtime" or
+/// "static").
+enum StackFilter {
+    /// Log every store.
+    NO_STACK_FILTER,
+
+    /// Check the address of each store against the bounds of the thread's
+    /// stack and drop the event if it's on the stack (see isThreadPrivate()).
+    RUNTIME_STACK_FILTER,
+
+    /// Don't instrument the stores to locals at all, as an instrumentation
+    /// pass would for the allocas that escape analysis proves thread-private.
+    STATIC_STACK_FILTER,
+};
+static StackFilter stackFilter = RUNTIME_STACK_FILTER;
+
+/// # stores to locals per store to the array in the STACK_FILTER
+/// experiment; set via the environment variable FASTLOG_STACK_STORES.
+static int stackStores = 2;
+
+/// Workload the logging experiments run (see Workloads.h).
+static WorkloadState workloadState;
+
 enum LogOp {
     /// Do nothing. This is the baseline.
     NO_OP               = 0,
@@ -68,10 +135,56 @@ enum LogOp {
     /// Generate RDTSC events periodically.
     LOG_TIMESTAMP,
 
+    /// Based on BUFFER_MANAGER, but the coordinator only bumps a global epoch
+    /// generation number instead of reclaiming the buffer pointers of other
+    /// threads; threads poll the generation on the periodic slow path.
+    BUFFER_MANAGER_EPOCH_GEN,
+
+    /// Based on BUFFER_MANAGER, but log into per-CPU event buffers shared by
+    /// all threads on the same CPU, using restartable sequences.
+    PER_CPU_BUFFER,
+
+    /// Based on LOG_FULL, stage each batch of events in a small L1-resident
+    /// buffer and flush it to the event buffer with non-temporal stores.
+    STAGED_NT_FLUSH,
+
+    /// Run every combination of the logging policies in LoggerPolicies.h, one
+    /// after another.
+    ALL_LOGGERS,
+
+    /// Based on BUFFER_MANAGER, but log an address base marker whenever the
+    /// upper bits of the address change so that the full address can be
+    /// rebuilt from 64-bit events.
+    ADDR_BASE_MARKER,
+
+    /// Based on LOG_FULL, but log 32-bit address deltas from the previous
+    /// access with the same location when possible (see EventLayoutCompact32).
+    COMPACT_32,
+
+    /// Measure the throughput of the event decode kernels (see EventDecoder)
+    /// on synthetic events instead of logging.
+    DECODE_EVENTS,
+
+    /// Measure the compression ratio and throughput of the epoch archive codec
+    /// (see EventCodec) on synthetic events instead of logging.
+    ARCHIVE_EVENTS,
+
+    /// Fill event buffers from the buffer manager with synthetic events (see
+    /// SyntheticTrace) as fast as possible, to measure the throughput of the
+    /// worker threads and the epoch latency rather than logging.
+    SYNTHETIC_TRACE,
+
+    /// Based on BUFFER_MANAGER, but precede each store to the array with
+    /// stackStores stores to locals, and filter the stores to the stack as
+    /// set by FASTLOG_STACK_FILTER (see StackFilter).
+    STACK_FILTER,
+
     INVALID_OP,
 };
 
-/// Size of the event buffer used in each experiment.
+/// Size of the event buffer used in each experiment. In the buffer manager
+/// experiments, this is only the default, which can be overridden via the
+/// environment variable FASTLOG_BUFFER_EVENTS.
 constexpr int BUFFER_SIZE[LogOp::INVALID_OP] = {
         EventBuffer::MAX_EVENTS_SMALL,  // NO_OP
         EventBuffer::MAX_EVENTS_SMALL,  // NO_SSE
@@ -90,6 +203,16 @@ constexpr int BUFFER_SIZE[LogOp::INVALID_OP] = {
         EventBuffer::MAX_EVENTS_SMALL,  // GLOBAL_COUNTER
         EventBuffer::MAX_EVENTS,        // BUFFER_MANAGER
         EventBuffer::MAX_EVENTS_SMALL,  // LOG_TIMESTAMP
+        EventBuffer::MAX_EVENTS,        // BUFFER_MANAGER_EPOCH_GEN
+        EventBuffer::MAX_EVENTS,        // PER_CPU_BUFFER
+        EventBuffer::MAX_EVENTS,        // STAGED_NT_FLUSH
+        EventBuffer::MAX_EVENTS,        // ALL_LOGGERS
+        EventBuffer::MAX_EVENTS,        // ADDR_BASE_MARKER
+        EventBuffer::MAX_EVENTS,        // COMPACT_32
+        EventBuffer::MAX_EVENTS,        // DECODE_EVENTS
+        EventBuffer::MAX_EVENTS,        // ARCHIVE_EVENTS
+        EventBuffer::MAX_EVENTS,        // SYNTHETIC_TRACE
+        EventBuffer::MAX_EVENTS,        // STACK_FILTER
 };
 
 std::string
@@ -113,6 +236,16 @@ opcodeToString(LogOp op)
     case GLOBAL_COUNTER:        return "GLOBAL_COUNTER";
     case BUFFER_MANAGER:        return "BUFFER_MANAGER";
     case LOG_TIMESTAMP:         return "LOG_TIMESTAMP";
+    case BUFFER_MANAGER_EPOCH_GEN:  return "BUFFER_MANAGER_EPOCH_GEN";
+    case PER_CPU_BUFFER:        return "PER_CPU_BUFFER";
+    case STAGED_NT_FLUSH:       return "STAGED_NT_FLUSH";
+    case ALL_LOGGERS:           return "ALL_LOGGERS";
+    case ADDR_BASE_MARKER:      return "ADDR_BASE_MARKER";
+    case COMPACT_32:            return "COMPACT_32";
+    case DECODE_EVENTS:         return "DECODE_EVENTS";
+    case ARCHIVE_EVENTS:        return "ARCHIVE_EVENTS";
+    case SYNTHETIC_TRACE:       return "SYNTHETIC_TRACE";
+    case STACK_FILTER:          return "STACK_FILTER";
     default:
         char s[50] = {};
         std::sprintf(s, "Unknown LogOp(%d)", op);
@@ -142,7 +275,7 @@ run_no_sse(int64_t* array, int length)
 
 __attribute__((noinline))
 void
-__tsan_write8_func(uint64_t pc, void* addr, uint64_t val)
+__tsan_write8_func(uint64_t /* pc */, void* addr, uint64_t /* val */)
 {
     // Somehow if we don't escape "addr" here, calls to this function will be
     // optimized away regardless of the "noinline" attribute.
@@ -160,457 +293,539 @@ run_func(int64_t* array, int length)
     }
 }
 
-/**
- * Log just the memory access address into a small per-thread buffer. Wrap
- * around on overflow.
- *
- * Note: in this experiment, the event buffer pointer never changes so the
- * compiler will transform the code to load it once into a temporary local
- * variable.
- */
-__attribute__((always_inline))
-void __tsan_write8_log_addr(uint64_t pc, void* addr, uint64_t val)
-{
-    EventBuffer* logBuf = getLogBufferUnsafe();
-    logBuf->buf[logBuf->events] = (uint64_t) addr;
-    if (UNLIKELY(logBuf->events++ == BUFFER_SIZE[LOG_ADDR])) {
-        logBuf->events = 0;
-    }
-}
+/// Write the array from beginning to end.
+struct SequentialAccess {
+    int next;
 
-#if 0
-/// TODO: not sure why the following is actually slower than above; the assembly
-/// has one less instruction (10 vs. 11) but lower IPC; it does simplify the
-/// access, right?
-__attribute__((always_inline))
-void __tsan_write8_log_addr2(uint64_t pc, void* addr, uint64_t val)
-{
-    EventBuffer* logBuf = getLogBufferUnsafe();
-    (*logBuf->next) = (uint64_t) addr;
-    if (UNLIKELY(logBuf->next++ == logBuf->end)) {
-        logBuf->next = logBuf->buf;
+    explicit SequentialAccess(int /* length */) : next(0) {}
+    __attribute__((always_inline, target("no-sse")))
+    int nextIndex() { return next++; }
+};
+
+/// Write every STRIDE-th element of the array, in STRIDE passes.
+struct StridedAccess {
+    /// 128 bytes, i.e., two cache lines apart.
+    static const int STRIDE = 16;
+
+    int next;
+    int pass;
+    int length;
+
+    explicit StridedAccess(int length) : next(0), pass(0), length(length) {}
+
+    __attribute__((always_inline, target("no-sse")))
+    int
+    nextIndex()
+    {
+        int index = next;
+        next += STRIDE;
+        if (UNLIKELY(next >= length)) {
+            next = ++pass;
+        }
+        return index;
     }
-}
-#endif
+};
 
+/// Write the array in the order of randomOrder.
+struct RandomAccess {
+    const int* order;
+
+    explicit RandomAccess(int /* length */) : order(randomOrder.data()) {}
+    __attribute__((always_inline, target("no-sse")))
+    int nextIndex() { return *order++; }
+};
+
+/**
+ * Log events with the given Logger (see LoggerPolicies.h).
+ *
+ * \tparam L
+ *      Logger type, i.e. combination of policies.
+ * \tparam Capacity
+ *      # events in the event buffer; a compile-time constant like in the
+ *      original hand-written experiments.
+ * \tparam Pattern
+ *      Order in which to write the array.
+ */
+template <typename L, int Capacity, typename Pattern = SequentialAccess>
 __attribute__((noinline, target("no-sse")))
 void
-run_log_addr(int64_t* array, int length)
+run_logger(int64_t* array, int length)
 {
+    L logger(Capacity);
+    Pattern pattern(length);
+
     for (int i = 0; i < length; i++) {
-        int64_t* addr = &array[i];
-        __tsan_write8_log_addr(__LINE__, addr, i);
+        int64_t* addr = &array[pattern.nextIndex()];
+        logger.write8(__LINE__, addr, i);
         (*addr) = i;
     }
+    loggedBytes += uint64_t(length) * L::WORDS * EventBuffer::EVENT_SIZE;
 }
 
 /**
- * Based on LOG_ADDR, remove indirect access to EventBuffer::{events, buf} at
- * the source level.
- *
- * Note: this is just an experiment for the sake of curiosity; the generated
- * code should be the same as LOG_ADDR.
+ * Run the configured workload (see Workloads.h), logging with the given
+ * Logger.
  */
-__attribute__((always_inline))
-void __tsan_write8_log_addr_direct(uint64_t* const buf, int& events,
-        uint64_t pc, void* addr, uint64_t val) {
-    buf[events] = (uint64_t) addr;
-    if (UNLIKELY(events++ == BUFFER_SIZE[LOG_DIRECT_LOAD])) {
-        events = 0;
-    }
-}
-
-__attribute__((noinline, target("no-sse")))
+template <typename L, int Capacity>
 void
-run_log_addr_direct(int64_t* array, int length)
+run_logger_workload(int64_t* array, int length)
 {
-    int events = getLogBuffer()->events;
-    uint64_t* const buf = getLogBuffer()->buf;
+    L logger(Capacity);
+    runWorkload(&logger, &workloadState, array, length);
+    loggedBytes += uint64_t(length) * L::WORDS * EventBuffer::EVENT_SIZE;
+}
 
-    for (int i = 0; i < length; i++) {
-        int64_t* addr = &array[i];
-        __tsan_write8_log_addr_direct(buf, events, __LINE__, addr, i);
-        (*addr) = i;
+/// The policies behind each of the original logging experiments.
+typedef Logger<AddrLayout, GlobalBufPtr, NoPrefetch, NoTimestamp>
+        LogAddrLogger;
+typedef Logger<AddrLayout, LocalBufPtr, NoPrefetch, NoTimestamp>
+        LogDirectLoadLogger;
+typedef Logger<AddrLayout, GlobalBufPtr, BatchPrefetch, NoTimestamp>
+        PrefetchLogEntryLogger;
+typedef Logger<AddrLayout, VolatileBufPtr, NoPrefetch, NoTimestamp>
+        VolatileBufPtrLogger;
+typedef Logger<AddrLayout, CachedBufPtr, NoPrefetch, NoTimestamp>
+        CachedBufPtrLogger;
+typedef Logger<HeaderLayout, GlobalBufPtr, NoPrefetch, NoTimestamp>
+        LogHeaderLogger;
+typedef Logger<ValueLayout, GlobalBufPtr, NoPrefetch, NoTimestamp>
+        LogValueLogger;
+typedef Logger<Full64Layout, GlobalBufPtr, NoPrefetch, NoTimestamp>
+        LogSrcLocLogger;
+typedef Logger<Full64Layout, CachedBufPtr, BatchPrefetch, NoTimestamp>
+        LogFullLogger;
+typedef Logger<Full128Layout, CachedBufPtr, BatchPrefetch, NoTimestamp>
+        LogFull128Logger;
+typedef Logger<Full64Layout, CachedBufPtr, NoPrefetch, RdtscTimestamp>
+        LogTimestampLogger;
+
+/// A Logger instantiation that can be picked at runtime.
+struct LoggerCombination {
+    std::string name;
+    void (*run)(int64_t* array, int length);
+    void (*runWorkload)(int64_t* array, int length);
+};
+
+/// Collects every combination of logging policies (see forEachLogger()).
+struct LoggerCollector {
+    std::vector<LoggerCombination> combinations;
+
+    template <typename L>
+    void
+    visit()
+    {
+        combinations.push_back({L::name(),
+                &run_logger<L, EventBuffer::MAX_EVENTS>,
+                &run_logger_workload<L, EventBuffer::MAX_EVENTS>});
     }
+};
 
-    getLogBuffer()->events = events;
-}
+void
+__tsan_write8_staged_slow(EventBuffer::Ref* ref, EventBuffer* curBuf,
+        const uint64_t* staging, int& staged)
+{
+    // Flush the batch. The staging area stays in L1 while the event buffer
+    // is only ever written with non-temporal stores, so logging doesn't
+    // pollute the caches (and needs no prefetch).
+    streamStore(&ref->buf[ref->events], staging, staged);
+    ref->events += staged;
+    staged = 0;
 
-void prefetch_log_entries(uint64_t* curPos) {
-    // TODO: honestly, I have no clue if this is the best way to do prefetch.
-    // I observed some speedup compared to LOG_ADDR when buffer size is large,
-    // that's all. I don't even know what performance metrics I should be
-    // looking at to see how these SW prefetch change/improve the behavior/performance.
+    // Get a new event buffer if our current one has been reclaimed.
+    if (curBuf == NULL) {
+        // Note: a real implementation must fence the streaming stores before
+        // the old buffer is handed to a worker.
+        storeFence();
+        ref->updateLogBuffer(__buf_manager.allocBuffer());
+        return;
+    }
 
-    // Prefetch log entries that will be written in some future period.
-    // A cache line is usually 64-byte, which can hold 8 events.
-    int eventsPerLine = 64 / EventBuffer::EVENT_SIZE;
-    int prefetchCacheLines = EventBuffer::BATCH_SIZE / eventsPerLine;
-    // FIXME: the optimal prefetch distance should be determined by system
-    // memory latency and cycles per loop iteration (i.e., it has nothing
-    // to do with BATCH_SIZE)
-    int prefetchDist = eventsPerLine * prefetchCacheLines * 2;
-    for (int i = 0; i < prefetchCacheLines; i++) {
-        uint64_t* pos = curPos + prefetchDist + i * eventsPerLine;
-        __builtin_prefetch(pos, 1 /* prepare for writes */,
-                3 /* fetch to all cache levels*/);
+    if (UNLIKELY(ref->events >= BUFFER_SIZE[STAGED_NT_FLUSH])) {
+        // Note: the real implementation will not wrap around; instead, it will
+        // contact the buffer manager to advance the epoch.
+        ref->events = 0;
     }
 }
 
 /**
- * Based on LOG_ADDR, prefetch log entries into all levels of cache, preparing
- * for the writes.
- *
- * The prefetch is implemented using gcc builtins. Since write-prefetch is only
- * available as an ISA extension, in order to make sure the builtin is actually
- * compiled into the PREFETCHW instruction (as opposed to normal read-prefetch),
- * use compiler option "-march={broadwell, skylake, etc.}" or "-mprfchw".
+ * Based on LOG_FULL, write events into a staging area of one batch instead of
+ * the event buffer; the slow path flushes full batches with non-temporal
+ * stores (see streamStore()).
  */
-__attribute__((always_inline))
-void __tsan_write8_prefetch_log_entries(uint64_t pc, void* addr, uint64_t val)
+__attribute__((always_inline, target("no-sse")))
+void __tsan_write8_staged(EventBuffer::Ref* ref, uint64_t* staging,
+        int& staged, uint64_t pc, void* addr, uint64_t val)
 {
-    EventBuffer* logBuf = getLogBufferUnsafe();
-    logBuf->buf[logBuf->events] = (uint64_t) addr;
-    if (UNLIKELY(logBuf->events++ >= logBuf->nextRdtscTime)) {
-        if (UNLIKELY(logBuf->events >= BUFFER_SIZE[PREFETCH_LOG_ENTRY])) {
-            logBuf->events = 0;
-            logBuf->nextRdtscTime = EventBuffer::BATCH_SIZE;
-        }
-
-        // TODO: shall we move prefetch before if?
-        prefetch_log_entries(&logBuf->buf[logBuf->events]);
-        logBuf->nextRdtscTime += EventBuffer::BATCH_SIZE;
+    EventBuffer* curBuf = getLogBuffer();
+    Full64Layout::encode(&staging[staged], pc, addr, val);
+    if (UNLIKELY((++staged == EventBuffer::BATCH_SIZE) || (curBuf == NULL))) {
+        __tsan_write8_staged_slow(ref, curBuf, staging, staged);
     }
 }
 
 __attribute__((noinline, target("no-sse")))
 void
-run_prefetch_log_entries(int64_t* array, int length)
+run_staged_nt_flush(int64_t* array, int length)
 {
+    EventBuffer::Ref bufRef = getLogBufferRef();
+    alignas(64) uint64_t staging[EventBuffer::BATCH_SIZE];
+    int staged = 0;
+
     for (int i = 0; i < length; i++) {
         int64_t* addr = &array[i];
-        __tsan_write8_prefetch_log_entries(__LINE__, addr, i);
+        __tsan_write8_staged(&bufRef, staging, staged, __LINE__, addr, i);
         (*addr) = i;
     }
+
+    // Don't lose the last partial batch.
+    streamStore(&bufRef.buf[bufRef.events], staging, staged);
+    bufRef.events += staged;
+    if (bufRef.events >= BUFFER_SIZE[STAGED_NT_FLUSH]) {
+        bufRef.events = 0;
+    }
 }
 
-/**
- * Similar to LOG_ADDR, except that we use atomic operation to load the event
- * buffer pointer so that the compiler cannot hoist that into a temporary local
- * variable.
- */
-__attribute__((always_inline))
-void __tsan_write8_volatile_bufptr(uint64_t pc, void* addr, uint64_t val)
+__attribute__((noinline))
+void __tsan_write8_log_full_naive(uint64_t pc, void* addr, uint64_t val)
 {
     EventBuffer* logBuf = getLogBuffer();
-    logBuf->buf[logBuf->events] = (uint64_t) addr;
-    if (UNLIKELY(logBuf->events++ == BUFFER_SIZE[VOLATILE_BUF_PTR])) {
+    Full64Layout::encode(&logBuf->buf[logBuf->events], pc, addr, val);
+    if (UNLIKELY(logBuf->events++ == BUFFER_SIZE[LOG_FULL_NAIVE])) {
         logBuf->events = 0;
     }
 }
 
 __attribute__((noinline, target("no-sse")))
 void
-run_volatile_buffer_ptr(int64_t* array, int length)
+run_log_full_naive(int64_t* array, int length)
 {
     for (int i = 0; i < length; i++) {
         int64_t* addr = &array[i];
-        __tsan_write8_volatile_bufptr(__LINE__, addr, i);
+        __tsan_write8_log_full_naive(__LINE__, addr, i);
         (*addr) = i;
     }
 }
 
-// TODO: investigate why forcing noinline on the slow path could lead to
-// significantly worse performance.
 // __attribute__((noinline))
 void
-__tsan_write8_cached_bufptr_slow(EventBuffer::Ref* ref, EventBuffer* curBuf)
+__tsan_write8_buf_manager_slow(EventBuffer::Ref* ref, EventBuffer* curBuf)
 {
     // Get a new event buffer if our current one has been reclaimed.
     if (curBuf == NULL) {
-        // Note: a real implementation will have to deal with the last event
-        // properly, block at a barrier, etc.
+        // FIXME: what should we do about the latest event? Retract it from the
+        // old buffer? drop it? log it to the new buffer? Do we need to treat
+        // read/write atomic/non-atomic differently?
         ref->updateLogBuffer(__buf_manager.allocBuffer());
         return;
     }
 
+    // TODO: integrate prefetch!
     // But, most likely, the event buffer pointer will remain intact.
     ref->nextRdtscTime += EventBuffer::BATCH_SIZE;
-    if (UNLIKELY(ref->events >= BUFFER_SIZE[CACHED_BUF_PTR])) {
-        // Note: the real implementation will not wrap around; instead, it will
-        // contact the buffer manager to advance the epoch.
-        ref->events = 0;
-        ref->nextRdtscTime = EventBuffer::BATCH_SIZE;
+    if (UNLIKELY(ref->events >= ref->logBuf->capacity)) {
+        __buf_manager.tryIncEpoch(ref);
+        ref->updateLogBuffer(__buf_manager.allocBuffer());
+        return;
     }
+    ref->switchSegmentIfFull();
 }
 
-__attribute__((always_inline))
-void
-__tsan_write8_cached_bufptr(EventBuffer::Ref* ref, uint64_t pc,
-        void* addr, uint64_t val)
+/**
+ * Log an 8-byte memory access with the given header (TSAN_HDR_READ8 or
+ * TSAN_HDR_WRITE8).
+ */
+__attribute__((always_inline, target("no-sse")))
+void __tsan_access8_buf_manager(EventBuffer::Ref* ref, uint64_t header,
+        uint64_t pc, void* addr, uint64_t val)
 {
     EventBuffer* curBuf = getLogBuffer();
-    ref->buf[ref->events] = (uint64_t) addr;
-    if (UNLIKELY((ref->events++ >= ref->nextRdtscTime) || (curBuf == NULL))) {
-        __tsan_write8_cached_bufptr_slow(ref, curBuf);
+    // FIXME: I think we need to do checkAliveTime first before logging to
+    // ensure cut consistency (Update: doesn't matter; can't achieve cut
+    // consistency anyway without waiting until all threads ack'ed the end of
+    // current epoch)
+    // TODO(Update): with the new timeout barrier + cached buf ptr approach,
+    // we just need to retract the event if curBuf becomes NULL (really?).
+    encodeEvent<EventLayout64>(&ref->buf[ref->events], header, pc, val,
+            (uint64_t) addr);
+    if (UNLIKELY((curBuf == NULL) || (ref->events++ >= ref->nextRdtscTime))) {
+        __tsan_write8_buf_manager_slow(ref, curBuf);
     }
 }
 
+__attribute__((always_inline, target("no-sse")))
+void __tsan_write8_buf_manager(EventBuffer::Ref* ref, uint64_t pc, void* addr,
+        uint64_t val)
+{
+    __tsan_access8_buf_manager(ref, TSAN_HDR_WRITE8, pc, addr, val);
+}
+
 __attribute__((noinline, target("no-sse")))
 void
-run_cached_buffer_ptr(int64_t* array, int length)
+run_buf_manager(int64_t* array, int length)
 {
     EventBuffer::Ref bufRef = getLogBufferRef();
 
     for (int i = 0; i < length; i++) {
         int64_t* addr = &array[i];
-        __tsan_write8_cached_bufptr(&bufRef, __LINE__, addr, i);
+        __tsan_write8_buf_manager(&bufRef, __LINE__, addr, i);
         (*addr) = i;
     }
 }
 
 /**
- * (Ab)use the highest 4 bits of the address as the event header.
+ * Log an address base marker ahead of a memory access whose upper address bits
+ * differ from those of the previous access logged into the same buffer. Makes
+ * room for the marker first, so that the fast path never writes more than one
+ * event past its last check.
+ *
+ * \return
+ *      The current event buffer, which changes if the old one was reclaimed.
  */
-__attribute__((always_inline))
-void __tsan_write8_log_header(uint64_t pc, void* addr, uint64_t val)
+__attribute__((noinline))
+EventBuffer*
+__tsan_log_addr_base(EventBuffer::Ref* ref, EventBuffer* curBuf,
+        uint64_t addrBase)
 {
-    // Note: assigning the header as a byte by overwriting the highest byte
-    // seems to be much slower than bit manipulation.
-    EventBuffer* logBuf = getLogBufferUnsafe();
-    logBuf->buf[logBuf->events] =
-            TSAN_WRITE8 | (TSAN_HDR_ZERO_MASK & (uint64_t) addr);
-    if (UNLIKELY(logBuf->events++ == BUFFER_SIZE[LOG_HEADER])) {
-        logBuf->events = 0;
+    if ((curBuf == NULL) || (ref->events >= ref->nextRdtscTime)) {
+        __tsan_write8_buf_manager_slow(ref, curBuf);
+        curBuf = getLogBuffer();
     }
+    ref->buf[ref->events++] = TSAN_ADDR_BASE |
+            EventLayout64::addr().pack(addrBase);
+    ref->addrBase = addrBase;
+    return curBuf;
 }
 
-__attribute__((noinline, target("no-sse")))
-void
-run_log_header(int64_t* array, int length)
+__attribute__((always_inline, target("no-sse")))
+void __tsan_access8_addr_base(EventBuffer::Ref* ref, uint64_t header,
+        uint64_t pc, void* addr, uint64_t val)
 {
-    for (int i = 0; i < length; i++) {
-        int64_t* addr = &array[i];
-        __tsan_write8_log_header(__LINE__, addr, i);
-        (*addr) = i;
+    EventBuffer* curBuf = getLogBuffer();
+    uint64_t addrBase = addrBaseOf((uint64_t) addr);
+    if (UNLIKELY(addrBase != ref->addrBase)) {
+        curBuf = __tsan_log_addr_base(ref, curBuf, addrBase);
+    }
+    encodeEvent<EventLayout64>(&ref->buf[ref->events], header, pc, val,
+            (uint64_t) addr);
+    if (UNLIKELY((curBuf == NULL) || (ref->events++ >= ref->nextRdtscTime))) {
+        __tsan_write8_buf_manager_slow(ref, curBuf);
     }
 }
 
-/**
- * (Ab)use the next 8 bits of the address to store the last byte of the value.
- */
-__attribute__((always_inline))
-void __tsan_write8_log_value(uint64_t pc, void* addr, uint64_t val)
+__attribute__((always_inline, target("no-sse")))
+void __tsan_write8_addr_base(EventBuffer::Ref* ref, uint64_t pc, void* addr,
+        uint64_t val)
 {
-    val = uint64_t((char) val) << 52;
-    EventBuffer* logBuf = getLogBufferUnsafe();
-    logBuf->buf[logBuf->events] =
-            TSAN_WRITE8 | val | (TSAN_VAL_ZERO_MASK & (uint64_t)addr);
-    if (UNLIKELY(logBuf->events++ >= BUFFER_SIZE[LOG_VALUE])) {
-        logBuf->events = 0;
-    }
+    __tsan_access8_addr_base(ref, TSAN_HDR_WRITE8, pc, addr, val);
 }
 
 __attribute__((noinline, target("no-sse")))
 void
-run_log_value(int64_t* array, int length)
+run_addr_base(int64_t* array, int length)
 {
+    EventBuffer::Ref bufRef = getLogBufferRef();
+
     for (int i = 0; i < length; i++) {
         int64_t* addr = &array[i];
-        __tsan_write8_log_value(__LINE__, addr, i);
+        __tsan_write8_addr_base(&bufRef, __LINE__, addr, i);
         (*addr) = i;
     }
 }
 
 /**
- * (Ab)use the next 20 bits of the address to store a unique location ID (it's
- * just the last 20 bits of CALLERPC for now).
+ * State of the COMPACT_32 experiment: the 32-bit event stream, written into
+ * the storage of the thread's event buffer, and the location table of
+ * EventLayoutCompact32.
  */
-__attribute__((always_inline))
-void __tsan_write8_log_src_loc(uint64_t pc, void* addr, uint64_t val)
-{
-    EventBuffer* logBuf = getLogBufferUnsafe();
-    uint64_t loc = (pc << 44) >> 4;
-    val = uint64_t((char) val) << 32;
-    logBuf->buf[logBuf->events] =
-            TSAN_WRITE8 | loc | val | (TSAN_LOC_ZERO_MASK & (uint64_t) addr);
-    // Note: somehow pre-increment leads to better code being generated.
-    if (UNLIKELY(++logBuf->events >= BUFFER_SIZE[LOG_SRC_LOC])) {
-        logBuf->events = 0;
+struct CompactStream {
+    typedef EventLayoutCompact32 L;
+
+    explicit CompactStream(EventBuffer* logBuf)
+        : logBuf(logBuf)
+        , buf(reinterpret_cast<uint32_t*>(logBuf->buf))
+        , words(0)
+        , nextBatch(2 * EventBuffer::BATCH_SIZE)
+        , slotLoc()
+        , slotAddr()
+    {
+        logBuf->layout = L::ID;
+        resetSlots();
     }
-}
 
-__attribute__((noinline, target("no-sse")))
-void
-run_log_src_loc(int64_t* array, int length)
-{
-    for (int i = 0; i < length; i++) {
-        int64_t* addr = &array[i];
-        __tsan_write8_log_src_loc(__LINE__, addr, i);
-        (*addr) = i;
+    /// Forget the locations logged so far, so that the next access of each
+    /// location escapes to a full event.
+    void
+    resetSlots()
+    {
+        for (int i = 0; i < L::SLOTS; i++) {
+            slotLoc[i] = ~uint64_t(0);
+            slotAddr[i] = 0;
+        }
     }
-}
+
+    EventBuffer* logBuf;
+    uint32_t* buf;
+
+    /// # 32-bit words in the stream.
+    int words;
+
+    /// # words after which to run the slow path, i.e., once per batch worth
+    /// of 64-bit events.
+    int nextBatch;
+
+    /// Location and last address logged in each slot.
+    uint64_t slotLoc[L::SLOTS];
+    uint64_t slotAddr[L::SLOTS];
+};
 
 void
-__tsan_write8_log_full_slow(EventBuffer::Ref* ref, EventBuffer* curBuf)
+__tsan_write8_compact_slow(CompactStream* stream)
 {
-    // Get a new event buffer if our current one has been reclaimed.
-    if (curBuf == NULL) {
-        // Note: a real implementation will have to deal with the last event
-        // properly, block at a barrier, etc.
-        ref->updateLogBuffer(__buf_manager.allocBuffer());
-        return;
-    }
-
-    // But, most likely, the event buffer pointer will remain intact.
-    ref->nextRdtscTime += EventBuffer::BATCH_SIZE;
-    prefetch_log_entries(&ref->buf[ref->events]);
-    if (UNLIKELY(ref->events >= BUFFER_SIZE[LOG_FULL])) {
+    stream->nextBatch += 2 * EventBuffer::BATCH_SIZE;
+    prefetchLogEntries(reinterpret_cast<uint64_t*>(
+            &stream->buf[stream->words]));
+    if (UNLIKELY(stream->words >= 2 * BUFFER_SIZE[COMPACT_32])) {
         // Note: the real implementation will not wrap around; instead, it will
         // contact the buffer manager to advance the epoch.
-        ref->events = 0;
-        ref->nextRdtscTime = EventBuffer::BATCH_SIZE;
+        // The decoder starts over with an empty location table, so must we.
+        loggedBytes += uint64_t(stream->words) * sizeof(uint32_t);
+        stream->words = 0;
+        stream->nextBatch = 2 * EventBuffer::BATCH_SIZE;
+        stream->resetSlots();
     }
 }
 
-// TODO: would it be faster to use uint32_t pc? maybe, but pc is known at
-// compile-time so it probably doesn't matter if the write function is inlined.
-__attribute__((always_inline))
-void __tsan_write8_log_full(EventBuffer::Ref* ref, uint64_t pc, void* addr,
+__attribute__((always_inline, target("no-sse")))
+void __tsan_write8_compact(CompactStream* stream, uint64_t pc, void* addr,
         uint64_t val)
 {
-    EventBuffer* curBuf = getLogBuffer();
-    uint64_t loc = (pc << 44) >> 4;
-    val = uint64_t((char) val) << 32;
-    ref->buf[ref->events] =
-            TSAN_WRITE8 | loc | val | (TSAN_LOC_ZERO_MASK & (uint64_t) addr);
-    // Note: two small details that lead to noticeably better performance are
-    // 1) pre-increment and 2) evaluate `curBuf == NULL` later.
-    if (UNLIKELY((++ref->events >= ref->nextRdtscTime) || (curBuf == NULL))) {
-        __tsan_write8_log_full_slow(ref, curBuf);
+    typedef EventLayoutCompact32 L;
+    // Both are known at compile time.
+    uint64_t loc = L::loc().unpackWord(L::loc().pack(pc));
+    int slot = L::slotOf(loc);
+
+    int64_t delta = int64_t((uint64_t) addr - stream->slotAddr[slot]);
+    if (LIKELY((stream->slotLoc[slot] == loc) && L::fits(delta))) {
+        stream->buf[stream->words++] = L::encodeCompact(slot, val, delta);
+    } else {
+        // Escape to a full event.
+        uint64_t event = encodeWord<EventLayout64>(0, TSAN_HDR_WRITE8, pc, val,
+                (uint64_t) addr);
+        stream->buf[stream->words] = uint32_t(event >> 32);
+        stream->buf[stream->words + 1] = uint32_t(event);
+        stream->words += 2;
+        stream->slotLoc[slot] = loc;
+    }
+    stream->slotAddr[slot] = (uint64_t) addr;
+    if (UNLIKELY(stream->words >= stream->nextBatch)) {
+        __tsan_write8_compact_slow(stream);
     }
 }
 
+template <typename Pattern>
 __attribute__((noinline, target("no-sse")))
 void
-run_log_full(int64_t* array, int length)
+run_compact(int64_t* array, int length)
 {
-    EventBuffer::Ref bufRef = getLogBufferRef();
+    CompactStream stream(getLogBuffer());
+    Pattern pattern(length);
 
     for (int i = 0; i < length; i++) {
-        int64_t* addr = &array[i];
-        __tsan_write8_log_full(&bufRef, __LINE__, addr, i);
+        int64_t* addr = &array[pattern.nextIndex()];
+        __tsan_write8_compact(&stream, __LINE__, addr, i);
         (*addr) = i;
     }
-}
 
-__attribute__((always_inline))
-void __tsan_write8_log_full_128(EventBuffer::Ref* ref, uint64_t pc, void* addr,
-        uint64_t val)
-{
-    EventBuffer* curBuf = getLogBuffer();
-    uint64_t loc = (pc << 44) >> 4;
-    // Keep only the lower 32 bits of the value. Note that we can record up to
-    // 56 bits of the value if necessary (i.e., excluding 4-bit header, 20-bit
-    // location, and 48-bit address).
-    ref->buf[ref->events++] = TSAN_WRITE8 | loc | ((uint32_t) val);
-    ref->buf[ref->events] = (uint64_t) addr;
-    // Note: two small details that lead to noticeably better performance are
-    // 1) pre-increment and 2) evaluate `curBuf == NULL` later.
-    if (UNLIKELY((++ref->events >= ref->nextRdtscTime) || (curBuf == NULL))) {
-        __tsan_write8_log_full_slow(ref, curBuf);
+    loggedBytes += uint64_t(stream.words) * sizeof(uint32_t);
+    // Pad the stream to whole 64-bit words with half an escape, which the
+    // decoder ignores.
+    if (stream.words % 2) {
+        stream.buf[stream.words++] = ~uint32_t(0);
     }
+    stream.logBuf->events = stream.words / 2;
 }
 
-__attribute__((noinline, target("no-sse")))
 void
-run_log_full_128(int64_t* array, int length)
+__tsan_write8_epoch_gen_slow(EventBuffer::Ref* ref)
 {
-    EventBuffer::Ref bufRef = getLogBufferRef();
+    // The only place we find out about epoch changes.
+    if (UNLIKELY(epochChanged(ref->logBuf))) {
+        ref->updateLogBuffer(__buf_manager.allocBuffer());
+        return;
+    }
 
-    for (int i = 0; i < length; i++) {
-        int64_t* addr = &array[i];
-        __tsan_write8_log_full_128(&bufRef, __LINE__, addr, i);
-        (*addr) = i;
+    ref->nextRdtscTime += EventBuffer::BATCH_SIZE;
+    if (UNLIKELY(ref->events >= ref->logBuf->capacity)) {
+        __buf_manager.tryIncEpoch(ref);
+        ref->updateLogBuffer(__buf_manager.allocBuffer());
+        return;
     }
+    ref->switchSegmentIfFull();
 }
 
-__attribute__((noinline))
-void __tsan_write8_log_full_naive(uint64_t pc, void* addr, uint64_t val)
+/**
+ * Based on BUFFER_MANAGER, drop the per-event check of the event buffer
+ * pointer. Epoch changes are detected by polling __epoch_generation on the
+ * slow path, i.e. at most BATCH_SIZE events late.
+ */
+__attribute__((always_inline, target("no-sse")))
+void __tsan_access8_epoch_gen(EventBuffer::Ref* ref, uint64_t header,
+        uint64_t pc, void* addr, uint64_t val)
 {
-    uint64_t loc = (pc << 44) >> 4;
-    val = uint64_t((char) val) << 32;
-    EventBuffer* logBuf = getLogBuffer();
-    logBuf->buf[logBuf->events] =
-            TSAN_WRITE8 | loc | val | (TSAN_LOC_ZERO_MASK & (uint64_t) addr);
-    if (UNLIKELY(logBuf->events++ == BUFFER_SIZE[LOG_FULL_NAIVE])) {
-        logBuf->events = 0;
+    encodeEvent<EventLayout64>(&ref->buf[ref->events], header, pc, val,
+            (uint64_t) addr);
+    if (UNLIKELY(++ref->events >= ref->nextRdtscTime)) {
+        __tsan_write8_epoch_gen_slow(ref);
     }
 }
 
-__attribute__((noinline, target("no-sse")))
-void
-run_log_full_naive(int64_t* array, int length)
+__attribute__((always_inline, target("no-sse")))
+void __tsan_write8_epoch_gen(EventBuffer::Ref* ref, uint64_t pc, void* addr,
+        uint64_t val)
 {
-    for (int i = 0; i < length; i++) {
-        int64_t* addr = &array[i];
-        __tsan_write8_log_full_naive(__LINE__, addr, i);
-        (*addr) = i;
-    }
+    __tsan_access8_epoch_gen(ref, TSAN_HDR_WRITE8, pc, addr, val);
 }
 
-// __attribute__((noinline))
+__attribute__((noinline, target("no-sse")))
 void
-__tsan_write8_buf_manager_slow(EventBuffer::Ref* ref, EventBuffer* curBuf)
+run_epoch_gen(int64_t* array, int length)
 {
-    // Get a new event buffer if our current one has been reclaimed.
-    if (curBuf == NULL) {
-        // FIXME: what should we do about the latest event? Retract it from the
-        // old buffer? drop it? log it to the new buffer? Do we need to treat
-        // read/write atomic/non-atomic differently?
-        ref->updateLogBuffer(__buf_manager.allocBuffer());
-        return;
-    }
+    EventBuffer::Ref bufRef = getLogBufferRef();
 
-    // TODO: integrate prefetch!
-    // But, most likely, the event buffer pointer will remain intact.
-    ref->nextRdtscTime += EventBuffer::BATCH_SIZE;
-    if (UNLIKELY(ref->events >= BUFFER_SIZE[BUFFER_MANAGER])) {
-        __buf_manager.tryIncEpoch(ref);
-        ref->updateLogBuffer(__buf_manager.allocBuffer());
-        return;
+    for (int i = 0; i < length; i++) {
+        int64_t* addr = &array[i];
+        __tsan_write8_epoch_gen(&bufRef, __LINE__, addr, i);
+        (*addr) = i;
     }
 }
 
-__attribute__((always_inline))
-void __tsan_write8_buf_manager(EventBuffer::Ref* ref, uint64_t pc, void* addr,
-        uint64_t val)
+/**
+ * Based on BUFFER_MANAGER, append the event to the buffer of the current CPU
+ * with a restartable sequence. The slow path logs thread switch markers and
+ * ends the epoch when the buffer is full.
+ */
+__attribute__((always_inline, target("no-sse")))
+void __tsan_write8_per_cpu(struct rseq* rs, std::atomic<CpuBuffer*>* slots,
+        uint64_t owner, uint64_t pc, void* addr, uint64_t val)
 {
-    EventBuffer* curBuf = getLogBuffer();
-    uint64_t loc = (pc << 44) >> 4;
-    val = uint64_t((char) val) << 32;
-    // FIXME: I think we need to do checkAliveTime first before logging to
-    // ensure cut consistency (Update: doesn't matter; can't achieve cut
-    // consistency anyway without waiting until all threads ack'ed the end of
-    // current epoch)
-    // TODO(Update): with the new timeout barrier + cached buf ptr approach,
-    // we just need to retract the event if curBuf becomes NULL (really?).
-    ref->buf[ref->events] =
-            TSAN_WRITE8 | loc | val | (TSAN_LOC_ZERO_MASK & (uint64_t) addr);
-    if (UNLIKELY((curBuf == NULL) || (ref->events++ >= ref->nextRdtscTime))) {
-        __tsan_write8_buf_manager_slow(ref, curBuf);
+    uint64_t event = encodeWord<EventLayout64>(0, TSAN_HDR_WRITE8, pc, val,
+            (uint64_t) addr);
+    if (UNLIKELY(!rseqAppend(rs, slots, owner, event))) {
+        __cpu_buffers.appendSlow(owner, event);
     }
 }
 
 __attribute__((noinline, target("no-sse")))
 void
-run_buf_manager(int64_t* array, int length)
+run_per_cpu(int64_t* array, int length)
 {
-    EventBuffer::Ref bufRef = getLogBufferRef();
+    struct rseq* rs = PerCpuBuffers::threadRseq();
+    std::atomic<CpuBuffer*>* slots = __cpu_buffers.getSlots();
+    uint64_t owner = uint64_t(__thr_context.threadId);
 
     for (int i = 0; i < length; i++) {
         int64_t* addr = &array[i];
-        __tsan_write8_buf_manager(&bufRef, __LINE__, addr, i);
+        __tsan_write8_per_cpu(rs, slots, owner, __LINE__, addr, i);
         (*addr) = i;
     }
 }
@@ -620,12 +835,13 @@ run_buf_manager(int64_t* array, int length)
  * ID. The ID is monotonically increasing, effectively introducing a total order
  * among events.
  */
-__attribute__((always_inline))
-void __tsan_write8_global_counter(uint64_t pc, void* addr, uint64_t val)
+__attribute__((always_inline, target("no-sse")))
+void __tsan_write8_global_counter(uint64_t /* pc */, void* addr,
+        uint64_t /* val */)
 {
     EventBuffer* logBuf = getLogBufferUnsafe();
     uint64_t eventId =
-            __event_id_counter.fetch_add(1, std::memory_order_relaxed);
+            __atomic_fetch_add(&__event_id_counter, 1, __ATOMIC_RELAXED);
     logBuf->buf[logBuf->events] =
             (eventId << 32) | (TSAN_LOC_ZERO_MASK & (uint64_t) addr);
     if (UNLIKELY(logBuf->events++ == BUFFER_SIZE[GLOBAL_COUNTER])) {
@@ -645,59 +861,506 @@ run_global_counter(int64_t* array, int length)
 }
 
 /**
- * Write to an array of 64-bit integers sequentially. Manually instrumented
- * with calls to log the memory store operations.
+ * Log a store unless it's to the stack of the calling thread.
  *
- * \param logOp
- *      Selects the log operation to perform.
- * \param array
- *      64-bit integer array.
- * \param length
- *      Length of the array.
+ * \param stack
+ *      Bounds of our stack, copied from our Context.
+ * \return
+ *      True if the store has been logged.
  */
-__attribute__((noinline))
+__attribute__((always_inline, target("no-sse")))
+bool
+__tsan_write8_stack_filter(EventBuffer::Ref* ref, const StackBounds& stack,
+        uint64_t pc, void* addr, uint64_t val)
+{
+    if (isThreadPrivate(stack, addr)) {
+        return false;
+    }
+    __tsan_write8_buf_manager(ref, pc, addr, val);
+    return true;
+}
+
+template <StackFilter Filter>
+__attribute__((noinline, target("no-sse")))
 void
-run(LogOp logOp, int64_t* array, int length)
+run_stack_filter(int64_t* array, int length)
 {
-    switch (logOp) {
-        case NO_OP:
-            run_noop(array, length);
-            break;
-        case NO_SSE:
+    EventBuffer::Ref bufRef = getLogBufferRef();
+    StackBounds stack = __thr_context.stack;
+    uint64_t logged = 0;
+
+    // Stands in for the locals and spill slots of the callees of a real
+    // program. Escaped only to keep the compiler from dropping the stores.
+    int64_t frame[8];
+    escape(frame);
+
+    int i = 0;
+    while (i < length) {
+        for (int k = 0; (k < stackStores) && (i < length); k++, i++) {
+            int64_t* addr = &frame[i & 7];
+            if (Filter == NO_STACK_FILTER) {
+                __tsan_write8_buf_manager(&bufRef, __LINE__, addr, i);
+                logged++;
+            } else if (Filter == RUNTIME_STACK_FILTER) {
+                logged += __tsan_write8_stack_filter(&bufRef, stack, __LINE__,
+                        addr, i);
+            }
+            (*addr) = i;
+        }
+        if (i < length) {
+            // The runtime filter can't tell the array from the stack without
+            // checking.
+            int64_t* addr = &array[i];
+            if (Filter == RUNTIME_STACK_FILTER) {
+                logged += __tsan_write8_stack_filter(&bufRef, stack, __LINE__,
+                        addr, i);
+            } else {
+                __tsan_write8_buf_manager(&bufRef, __LINE__, addr, i);
+                logged++;
+            }
+            (*addr) = i;
+            i++;
+        }
+    }
+    escape(frame);
+    loggedBytes += logged * EventBuffer::EVENT_SIZE;
+}
+
+/**
+ * Based on BUFFER_MANAGER, but copy \p length synthetic events into the event
+ * buffers a batch at a time instead of logging the writes to the array.
+ */
+__attribute__((noinline))
+void
+run_synthetic(int64_t* array, int length)
+{
+    static thread_local std::unique_ptr<SyntheticTrace> trace;
+    if (!trace) {
+        trace.reset(new SyntheticTrace(traceProfile,
+                __thr_context.threadId));
+    }
+
+    EventBuffer::Ref bufRef = getLogBufferRef();
+    int i = 0;
+    while (i < length) {
+        EventBuffer* curBuf = getLogBuffer();
+        int n = std::min(length - i, bufRef.nextRdtscTime - bufRef.events);
+        if (curBuf && (n > 0)) {
+            trace->copy(&bufRef.buf[bufRef.events], n);
+            bufRef.events += n;
+            i += n;
+        }
+        if ((curBuf == NULL) || (bufRef.events >= bufRef.nextRdtscTime)) {
+            __tsan_write8_buf_manager_slow(&bufRef, curBuf);
+        }
+    }
+    escape(array);
+}
+
+// Adapters that expose the hand-written logging experiments as loggers (i.e.,
+// with `write8(pc, addr, val)`, `read8(pc, addr, val)` and `block(func)`) for
+// the workloads in Workloads.h.
+
+/**
+ * Base of the adapters (CRTP), which only have to define write8(): reads are
+ * logged like writes, for the experiments whose events don't carry the type
+ * of access, and blocking calls need no special care, since there's no fast
+ * path to leave.
+ */
+template <typename Log>
+struct LogAdapter {
+    __attribute__((always_inline))
+    void
+    read8(uint64_t pc, void* addr, uint64_t val)
+    {
+        static_cast<Log*>(this)->write8(pc, addr, val);
+    }
+
+    template <typename Func> void block(Func func) { func(); }
+};
+
+/**
+ * Base of the adapters that log through a Ref, which they drop around
+ * blocking calls.
+ */
+template <typename Log>
+struct RefLogAdapter : LogAdapter<Log> {
+    EventBuffer::Ref ref;
+
+    RefLogAdapter() : ref(getLogBufferRef()) {}
+
+    template <typename Func>
+    void
+    block(Func func)
+    {
+        blockOutsideFastPath(&ref, func);
+    }
+};
+
+struct NoOpLog : LogAdapter<NoOpLog> {
+    __attribute__((always_inline))
+    void write8(uint64_t /* pc */, void* /* addr */, uint64_t /* val */) {}
+};
+
+struct FuncCallLog : LogAdapter<FuncCallLog> {
+    __attribute__((always_inline))
+    void
+    write8(uint64_t pc, void* addr, uint64_t val)
+    {
+        __tsan_write8_func(pc, addr, val);
+    }
+};
+
+struct LogFullNaiveLog : LogAdapter<LogFullNaiveLog> {
+    __attribute__((always_inline))
+    void
+    write8(uint64_t pc, void* addr, uint64_t val)
+    {
+        __tsan_write8_log_full_naive(pc, addr, val);
+    }
+};
+
+struct GlobalCounterLog : LogAdapter<GlobalCounterLog> {
+    __attribute__((always_inline))
+    void
+    write8(uint64_t pc, void* addr, uint64_t val)
+    {
+        __tsan_write8_global_counter(pc, addr, val);
+    }
+};
+
+/// Signature of the __tsan_access8_* functions of the experiments whose
+/// events carry the type of access.
+typedef void (*Access8Func)(EventBuffer::Ref* ref, uint64_t header,
+        uint64_t pc, void* addr, uint64_t val);
+
+/**
+ * Adapter for the experiments whose events carry the type of access, which
+ * log both reads and writes with \p Access.
+ */
+template <Access8Func Access>
+struct Access8Log : RefLogAdapter<Access8Log<Access>> {
+    __attribute__((always_inline))
+    void
+    write8(uint64_t pc, void* addr, uint64_t val)
+    {
+        Access(&this->ref, TSAN_HDR_WRITE8, pc, addr, val);
+    }
+
+    __attribute__((always_inline))
+    void
+    read8(uint64_t pc, void* addr, uint64_t val)
+    {
+        Access(&this->ref, TSAN_HDR_READ8, pc, addr, val);
+    }
+};
+
+typedef Access8Log<__tsan_access8_buf_manager> BufManagerLog;
+typedef Access8Log<__tsan_access8_epoch_gen> EpochGenLog;
+typedef Access8Log<__tsan_access8_addr_base> AddrBaseLog;
+
+struct PerCpuLog : LogAdapter<PerCpuLog> {
+    struct rseq* rs;
+    std::atomic<CpuBuffer*>* slots;
+    uint64_t owner;
+
+    PerCpuLog()
+        : rs(PerCpuBuffers::threadRseq())
+        , slots(__cpu_buffers.getSlots())
+        , owner(uint64_t(__thr_context.threadId))
+    {}
+
+    __attribute__((always_inline))
+    void
+    write8(uint64_t pc, void* addr, uint64_t val)
+    {
+        __tsan_write8_per_cpu(rs, slots, owner, pc, addr, val);
+    }
+};
+
+/// The staged events are only written to the buffer once per batch, so they
+/// survive dropping the Ref around blocking calls.
+struct StagedLog : RefLogAdapter<StagedLog> {
+    alignas(64) uint64_t staging[EventBuffer::BATCH_SIZE];
+    int staged;
+
+    StagedLog() : staging(), staged(0) {}
+
+    ~StagedLog()
+    {
+        // Don't lose the last partial batch.
+        streamStore(&ref.buf[ref.events], staging, staged);
+        ref.events += staged;
+        if (ref.events >= BUFFER_SIZE[STAGED_NT_FLUSH]) {
+            ref.events = 0;
+        }
+    }
+
+    __attribute__((always_inline))
+    void
+    write8(uint64_t pc, void* addr, uint64_t val)
+    {
+        __tsan_write8_staged(&ref, staging, staged, pc, addr, val);
+    }
+};
+
+struct CompactLog : LogAdapter<CompactLog> {
+    CompactStream stream;
+
+    CompactLog() : stream(getLogBuffer()) {}
+
+    ~CompactLog()
+    {
+        loggedBytes += uint64_t(stream.words) * sizeof(uint32_t);
+        if (stream.words % 2) {
+            stream.buf[stream.words++] = ~uint32_t(0);
+        }
+        stream.logBuf->events = stream.words / 2;
+    }
+
+    __attribute__((always_inline))
+    void
+    write8(uint64_t pc, void* addr, uint64_t val)
+    {
+        __tsan_write8_compact(&stream, pc, addr, val);
+    }
+};
+
+/// The workloads only access the heap, so the stack filter never drops their
+/// events: the adapter measures what the checks cost. STATIC_STACK_FILTER
+/// logs the same as NO_STACK_FILTER here, since there are no locals to skip.
+template <StackFilter Filter>
+struct StackFilterLog : RefLogAdapter<StackFilterLog<Filter>> {
+    StackBounds stack;
+
+    StackFilterLog() : stack(__thr_context.stack) {}
+
+    __attribute__((always_inline))
+    void
+    write8(uint64_t pc, void* addr, uint64_t val)
+    {
+        if (Filter == RUNTIME_STACK_FILTER) {
+            __tsan_write8_stack_filter(&this->ref, stack, pc, addr, val);
+        } else {
+            __tsan_write8_buf_manager(&this->ref, pc, addr, val);
+        }
+    }
+
+    __attribute__((always_inline))
+    void
+    read8(uint64_t pc, void* addr, uint64_t val)
+    {
+        if ((Filter != RUNTIME_STACK_FILTER) || !isThreadPrivate(stack, addr)) {
+            __tsan_access8_buf_manager(&this->ref, TSAN_HDR_READ8, pc, addr,
+                    val);
+        }
+    }
+};
+
+/**
+ * Run the configured workload (see Workloads.h), logging with the given
+ * adapter.
+ */
+template <typename Log>
+void
+run_log_workload(int64_t* array, int length)
+{
+    Log log;
+    runWorkload(&log, &workloadState, array, length);
+}
+
+/**
+ * Run the configured workload instead of writing the array, logging with the
+ * logging variant of the given experiment.
+ */
+void
+run_workload(LogOp logOp, int64_t* array, int length)
+{
+    switch (logOp) {
+        case NO_OP:
+        case NO_SSE:
+            run_log_workload<NoOpLog>(array, length);
+            break;
+        case FUNC_CALL:
+            run_log_workload<FuncCallLog>(array, length);
+            break;
+        case LOG_ADDR:
+            run_logger_workload<LogAddrLogger, BUFFER_SIZE[LOG_ADDR]>(array,
+                    length);
+            break;
+        case LOG_DIRECT_LOAD:
+            run_logger_workload<LogDirectLoadLogger,
+                    BUFFER_SIZE[LOG_DIRECT_LOAD]>(array, length);
+            break;
+        case PREFETCH_LOG_ENTRY:
+            run_logger_workload<PrefetchLogEntryLogger,
+                    BUFFER_SIZE[PREFETCH_LOG_ENTRY]>(array, length);
+            break;
+        case VOLATILE_BUF_PTR:
+            run_logger_workload<VolatileBufPtrLogger,
+                    BUFFER_SIZE[VOLATILE_BUF_PTR]>(array, length);
+            break;
+        case CACHED_BUF_PTR:
+            run_logger_workload<CachedBufPtrLogger,
+                    BUFFER_SIZE[CACHED_BUF_PTR]>(array, length);
+            break;
+        case LOG_HEADER:
+            run_logger_workload<LogHeaderLogger, BUFFER_SIZE[LOG_HEADER]>(
+                    array, length);
+            break;
+        case LOG_VALUE:
+            run_logger_workload<LogValueLogger, BUFFER_SIZE[LOG_VALUE]>(array,
+                    length);
+            break;
+        case LOG_SRC_LOC:
+            run_logger_workload<LogSrcLocLogger, BUFFER_SIZE[LOG_SRC_LOC]>(
+                    array, length);
+            break;
+        case LOG_FULL:
+            run_logger_workload<LogFullLogger, BUFFER_SIZE[LOG_FULL]>(array,
+                    length);
+            break;
+        case LOG_FULL_128:
+            run_logger_workload<LogFull128Logger, BUFFER_SIZE[LOG_FULL_128]>(
+                    array, length);
+            break;
+        case LOG_FULL_NAIVE:
+            run_log_workload<LogFullNaiveLog>(array, length);
+            break;
+        case GLOBAL_COUNTER:
+            run_log_workload<GlobalCounterLog>(array, length);
+            break;
+        case BUFFER_MANAGER:
+            run_log_workload<BufManagerLog>(array, length);
+            break;
+        case LOG_TIMESTAMP:
+            run_logger_workload<LogTimestampLogger,
+                    BUFFER_SIZE[LOG_TIMESTAMP]>(array, length);
+            break;
+        case BUFFER_MANAGER_EPOCH_GEN:
+            run_log_workload<EpochGenLog>(array, length);
+            break;
+        case PER_CPU_BUFFER:
+            run_log_workload<PerCpuLog>(array, length);
+            break;
+        case STAGED_NT_FLUSH:
+            run_log_workload<StagedLog>(array, length);
+            break;
+        case ADDR_BASE_MARKER:
+            run_log_workload<AddrBaseLog>(array, length);
+            break;
+        case COMPACT_32:
+            run_log_workload<CompactLog>(array, length);
+            break;
+        case STACK_FILTER:
+            if (stackFilter == NO_STACK_FILTER) {
+                run_log_workload<StackFilterLog<NO_STACK_FILTER>>(array,
+                        length);
+            } else if (stackFilter == RUNTIME_STACK_FILTER) {
+                run_log_workload<StackFilterLog<RUNTIME_STACK_FILTER>>(array,
+                        length);
+            } else {
+                run_log_workload<StackFilterLog<STATIC_STACK_FILTER>>(array,
+                        length);
+            }
+            break;
+        default:
+            std::printf("LogOp %d doesn't run workloads\n", logOp);
+            break;
+    }
+}
+
+/**
+ * Run the instantiation of an experiment for the configured access pattern.
+ */
+void
+runWithPattern(int64_t* array, int length,
+        void (*sequential)(int64_t*, int), void (*strided)(int64_t*, int),
+        void (*random)(int64_t*, int))
+{
+    switch (accessPattern) {
+        case STRIDED:
+            strided(array, length);
+            break;
+        case RANDOM:
+            random(array, length);
+            break;
+        default:
+            sequential(array, length);
+            break;
+    }
+}
+
+/**
+ * Write to an array of 64-bit integers (sequentially, unless the experiment
+ * supports other access patterns). Manually instrumented
+ * with calls to log the memory store operations.
+ *
+ * \param logOp
+ *      Selects the log operation to perform.
+ * \param array
+ *      64-bit integer array.
+ * \param length
+ *      Length of the array.
+ */
+__attribute__((noinline))
+void
+run(LogOp logOp, int64_t* array, int length)
+{
+    if (workloadState.workload != DISJOINT_WRITES) {
+        run_workload(logOp, array, length);
+        return;
+    }
+    switch (logOp) {
+        case NO_OP:
+            run_noop(array, length);
+            break;
+        case NO_SSE:
             run_no_sse(array, length);
             break;
         case FUNC_CALL:
             run_func(array, length);
             break;
         case LOG_ADDR:
-            run_log_addr(array, length);
+            run_logger<LogAddrLogger, BUFFER_SIZE[LOG_ADDR]>(array, length);
             break;
         case PREFETCH_LOG_ENTRY:
-            run_prefetch_log_entries(array, length);
+            run_logger<PrefetchLogEntryLogger,
+                    BUFFER_SIZE[PREFETCH_LOG_ENTRY]>(array, length);
             break;
         case LOG_DIRECT_LOAD:
-            run_log_addr_direct(array, length);
+            run_logger<LogDirectLoadLogger,
+                    BUFFER_SIZE[LOG_DIRECT_LOAD]>(array, length);
             break;
         case VOLATILE_BUF_PTR:
-            run_volatile_buffer_ptr(array, length);
+            run_logger<VolatileBufPtrLogger,
+                    BUFFER_SIZE[VOLATILE_BUF_PTR]>(array, length);
             break;
         case CACHED_BUF_PTR:
-            run_cached_buffer_ptr(array, length);
+            run_logger<CachedBufPtrLogger,
+                    BUFFER_SIZE[CACHED_BUF_PTR]>(array, length);
             break;
         case LOG_HEADER:
-            run_log_header(array, length);
+            run_logger<LogHeaderLogger, BUFFER_SIZE[LOG_HEADER]>(array, length);
             break;
         case LOG_VALUE:
-            run_log_value(array, length);
+            run_logger<LogValueLogger, BUFFER_SIZE[LOG_VALUE]>(array, length);
             break;
         case LOG_SRC_LOC:
-            run_log_src_loc(array, length);
+            run_logger<LogSrcLocLogger, BUFFER_SIZE[LOG_SRC_LOC]>(array,
+                    length);
             break;
         case LOG_FULL:
-            run_log_full(array, length);
+            runWithPattern(array, length,
+                    run_logger<LogFullLogger, BUFFER_SIZE[LOG_FULL]>,
+                    run_logger<LogFullLogger, BUFFER_SIZE[LOG_FULL],
+                            StridedAccess>,
+                    run_logger<LogFullLogger, BUFFER_SIZE[LOG_FULL],
+                            RandomAccess>);
             break;
         case LOG_FULL_128:
-            run_log_full_128(array, length);
+            run_logger<LogFull128Logger, BUFFER_SIZE[LOG_FULL_128]>(array,
+                    length);
             break;
         case LOG_FULL_NAIVE:
             run_log_full_naive(array, length);
@@ -708,38 +1371,686 @@ run(LogOp logOp, int64_t* array, int length)
         case BUFFER_MANAGER:
             run_buf_manager(array, length);
             break;
-//        case LOG_TIMESTAMP:
-//            run_log_timestamp(array, length);
-//            break;
+        case LOG_TIMESTAMP:
+            run_logger<LogTimestampLogger, BUFFER_SIZE[LOG_TIMESTAMP]>(array,
+                    length);
+            break;
+        case BUFFER_MANAGER_EPOCH_GEN:
+            run_epoch_gen(array, length);
+            break;
+        case PER_CPU_BUFFER:
+            run_per_cpu(array, length);
+            break;
+        case STAGED_NT_FLUSH:
+            run_staged_nt_flush(array, length);
+            break;
+        case ADDR_BASE_MARKER:
+            run_addr_base(array, length);
+            break;
+        case COMPACT_32:
+            runWithPattern(array, length, run_compact<SequentialAccess>,
+                    run_compact<StridedAccess>, run_compact<RandomAccess>);
+            break;
+        case SYNTHETIC_TRACE:
+            run_synthetic(array, length);
+            break;
+        case STACK_FILTER:
+            if (stackFilter == NO_STACK_FILTER) {
+                run_stack_filter<NO_STACK_FILTER>(array, length);
+            } else if (stackFilter == RUNTIME_STACK_FILTER) {
+                run_stack_filter<RUNTIME_STACK_FILTER>(array, length);
+            } else {
+                run_stack_filter<STATIC_STACK_FILTER>(array, length);
+            }
+            break;
         default:
             std::printf("Unknown LogOp %d\n", logOp);
             break;
     }
 }
 
+/**
+ * Check if an experiment gets its event buffers from the buffer manager (as
+ * opposed to wrapping around a single per-thread buffer).
+ */
+bool
+usesBufferManager(LogOp logOp)
+{
+    return (logOp == BUFFER_MANAGER) || (logOp == BUFFER_MANAGER_EPOCH_GEN) ||
+            (logOp == PER_CPU_BUFFER) || (logOp == ADDR_BASE_MARKER) ||
+            (logOp == SYNTHETIC_TRACE) || (logOp == STACK_FILTER);
+}
+
+/**
+ * Main loop of an optional thread that runs a cache-sensitive workload next
+ * to the logging threads, to measure how much logging slows down the rest of
+ * the application (e.g., by evicting its working set). Chases pointers
+ * through a random cycle of cache lines until told to stop.
+ *
+ * \param workingSetKB
+ *      Size of the working set in KB.
+ * \param stop
+ *      Set when the logging threads are done.
+ */
 void
-workerMain(int tid, LogOp logOp, int64_t* array, int length)
+coRunnerMain(int workingSetKB, std::atomic<bool>* stop)
+{
+    PointerChase cycle(size_t(workingSetKB) * 1024);
+    uint64_t accesses = 0;
+    uint64_t startTime = rdtsc();
+    while (!stop->load(std::memory_order_relaxed)) {
+        cycle.chase(1024);
+        accesses += 1024;
+    }
+    uint64_t totalTime = rdtsc() - startTime;
+    printf("coRunner workingSetKB %d, accesses %.2fM, cyclesPerAccess %.2f\n",
+            workingSetKB, double(accesses) * 1e-6,
+            double(totalTime) / double(accesses));
+}
+
+/// Measurements of one thread in one run of an experiment.
+struct ThreadResult {
+    double writes;
+    double cyclesPerWrite;
+
+    /// Values of the performance counters; negative if unavailable.
+    double counters[PerfCounters::NUM_COUNTERS];
+};
+
+/**
+ * \param combination
+ *      Logger to run in the ALL_LOGGERS experiment; NULL otherwise.
+ * \param result
+ *      Where to store the measurements of the thread; may be NULL.
+ */
+void
+workerMain(int tid, LogOp logOp, const LoggerCombination* combination,
+        int64_t* array, int length, ThreadResult* result)
 {
     // Note: without the buffer manager, __log_buffer will always point to the
     // same EventBuffer allocated here.
-    if (logOp < BUFFER_MANAGER) {
-        __log_buffer = new EventBuffer();
+    if (!usesBufferManager(logOp)) {
+        __log_buffer = EventBuffer::create(BUFFER_SIZE[logOp]);
     }
 
+    loggedBytes = 0;
+    PerfCounters counters;
+    counters.start();
     uint64_t startTime = rdtsc();
 
     // Repeat the experiment many times.
     for (int i = 0; i < numIterations; i++) {
-        run(logOp, array, length);
+        if (combination && (workloadState.workload != DISJOINT_WRITES)) {
+            combination->runWorkload(array, length);
+        } else if (combination) {
+            combination->run(array, length);
+        } else {
+            run(logOp, array, length);
+        }
     }
 
     uint64_t totalTime = rdtsc() - startTime;
+    counters.stop();
     double numWriteOps = static_cast<double>(length) * numIterations * 1e-6;
     printf("threadId %d, writeOps %.2fM, cyclesPerWrite %.2f\n", tid,
             numWriteOps, totalTime / numWriteOps * 1e-6);
+    if (result) {
+        result->writes = numWriteOps * 1e6;
+        result->cyclesPerWrite = totalTime / numWriteOps * 1e-6;
+        for (int i = 0; i < PerfCounters::NUM_COUNTERS; i++) {
+            PerfCounters::Counter c = PerfCounters::Counter(i);
+            result->counters[i] = counters.available(c) ?
+                    counters.value(c) : -1;
+        }
+    }
+    if (loggedBytes) {
+        printf("threadId %d, bytesPerEvent %.2f\n", tid,
+                double(loggedBytes) / (numWriteOps * 1e6));
+    }
+
+    // Don't let the buffers of many consecutive experiments pile up.
+    if (!usesBufferManager(logOp)) {
+        EventBuffer::destroy(__log_buffer);
+        __log_buffer = NULL;
+    }
+}
+
+/**
+ * Run one experiment on \p numThreads threads, each writing its own part of
+ * \p array, and wait for them to finish.
+ *
+ * \param results
+ *      If not NULL, filled with the measurements of each thread.
+ */
+void
+runThreads(int numThreads, LogOp logOp, const LoggerCombination* combination,
+        int64_t* array, int length, std::vector<ThreadResult>* results = NULL)
+{
+    if (results) {
+        results->assign(numThreads, ThreadResult());
+    }
+    std::vector<std::thread> workers;
+    for (int i = 0; i < numThreads; i++) {
+        workers.emplace_back(workerMain, i, logOp, combination,
+                array + i * length, length, results ? &(*results)[i] : NULL);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+/**
+ * Dump the flight recorder as if an incident had happened, read the dump back
+ * and report its size and how long it took.
+ */
+void
+dumpFlightRecorder()
+{
+    bool compress = getEnvInt("FASTLOG_RECORDER_COMPRESS", 0) != 0;
+    int64_t startTime = steadyClockNs();
+    int dumped = __buf_manager.dumpFlightRecorder(NULL, compress);
+    int64_t dumpNs = steadyClockNs() - startTime;
+
+    const char* path = std::getenv("FASTLOG_RECORDER_PATH");
+    std::vector<FlightRecorderBuffer> buffers =
+            loadFlightRecorder(path ? path : "fastlog-recorder.bin");
+    size_t events = 0;
+    size_t bytes = 0;
+    int firstEpoch = INT_MAX;
+    int lastEpoch = -1;
+    for (const FlightRecorderBuffer& buf : buffers) {
+        events += buf.events.size();
+        bytes += sizeof(buf.record) + buf.record.bytes;
+        firstEpoch = std::min(firstEpoch, int(buf.record.epoch));
+        lastEpoch = std::max(lastEpoch, int(buf.record.epoch));
+    }
+    printf("recorderBuffers %d, recorderEpochs %d-%d, recorderEvents %lu, "
+           "recorderMB %.2f, compressed %d, dumpMs %.2f\n", dumped,
+            firstEpoch, lastEpoch, events, double(bytes) / (1 << 20),
+            compress, double(dumpNs) * 1e-6);
+}
+
+/**
+ * End the epoch while no thread logs to the per-CPU buffers, as a per-thread
+ * buffer filling up would, and check that the worker thread of the epoch
+ * still gets all of its buffers: the idle CPUs mustn't hold it open.
+ *
+ * \return
+ *      True if all epochs have been processed within a second.
+ */
+bool
+checkIdleCpus()
+{
+    __buf_manager.tryIncEpoch(__epoch_generation.value.load());
+    int64_t deadlineNs = steadyClockNs() + 1000000000L;
+    while (__buf_manager.pendingEpochs() > 0) {
+        if (steadyClockNs() > deadlineNs) {
+            printf("idleCpus stuck, pendingEpochs %d\n",
+                    __buf_manager.pendingEpochs());
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    printf("idleCpus OK\n");
+    return true;
+}
+
+/**
+ * Decode \p length synthetic events (mostly 8-byte writes, plus timestamps
+ * and address base markers) repeatedly with each decode kernel the CPU
+ * supports and a few header filters; report the throughput and a checksum of
+ * the columns, which should be the same for all kernels.
+ */
+void
+benchDecode(int length)
+{
+    EventBuffer* logBuf = EventBuffer::create(length);
+    std::mt19937_64 rng(length);
+    for (int i = 0; i < length; i++) {
+        uint64_t r = rng();
+        if (i % EventBuffer::BATCH_SIZE == 0) {
+            logBuf->buf[i] = TSAN_RDTSC | (TSAN_HDR_ZERO_MASK & r);
+        } else if (i % 1024 == 1) {
+            logBuf->buf[i] = TSAN_ADDR_BASE | (r & 0xFFFF);
+        } else {
+            logBuf->buf[i] = TSAN_WRITE8 | (TSAN_HDR_ZERO_MASK & r);
+        }
+    }
+    logBuf->events = length;
+
+    const DecodeKernel kernels[] = {DECODE_SCALAR, DECODE_AVX2, DECODE_AVX512};
+    const uint32_t filters[] = {EventDecoder::ALL_HEADERS,
+            EventDecoder::MEM_ACCESS_HEADERS,
+            EventDecoder::headerBit(TSAN_HDR_RDTSC)};
+    const int rounds = std::max(1, numIterations / 10);
+    for (uint32_t headers : filters) {
+        for (DecodeKernel kernel : kernels) {
+            if (!EventDecoder::supported(kernel)) {
+                continue;
+            }
+            EventDecoder decoder(headers, kernel);
+            uint64_t checksum = 0;
+            decoder.decode(logBuf, [&checksum](const EventColumns& c) {
+                for (int i = 0; i < c.size; i++) {
+                    checksum = checksum * 31 + c.header[i] + c.loc[i] +
+                            c.value[i] + c.addr[i];
+                }
+            });
+
+            uint64_t kept = 0;
+            int64_t startTime = steadyClockNs();
+            uint64_t startCycles = rdtsc();
+            for (int r = 0; r < rounds; r++) {
+                decoder.decode(logBuf, [&kept](const EventColumns& c) {
+                    kept += c.size;
+                    escape(const_cast<EventColumns*>(&c));
+                });
+            }
+            uint64_t cycles = rdtsc() - startCycles;
+            int64_t ns = steadyClockNs() - startTime;
+            double decoded = double(length) * rounds;
+            printf("kernel %s, headers 0x%04x, kept %.2f%%, GBps %.2f, "
+                   "cyclesPerEvent %.2f, checksum %016lx\n",
+                    EventDecoder::kernelName(kernel), headers,
+                    100.0 * double(kept) / decoded,
+                    decoded * EventBuffer::EVENT_SIZE / double(ns),
+                    double(cycles) / decoded, checksum);
+        }
+    }
+    EventBuffer::destroy(logBuf);
+}
+
+/**
+ * Fill the stack below the caller with garbage, so that callees which read
+ * uninitialized locals see something else than the zeros of fresh stack
+ * pages.
+ */
+__attribute__((noinline))
+void
+dirtyStack()
+{
+    uint8_t garbage[256 << 10];
+    std::memset(garbage, 0xA5, sizeof(garbage));
+    escape(garbage);
+}
+
+/**
+ * Compress and decompress \p length synthetic events that mimic a loop body
+ * with a few memory accesses per iteration (sequential, strided, random and
+ * fixed addresses, each from its own location) plus a timestamp per batch;
+ * report the compression ratio and throughput, and check the round trip. The
+ * stack is dirtied before each compression, so the check also catches
+ * uninitialized state leaking into the compressed stream.
+ */
+void
+benchArchive(int length)
+{
+    std::vector<uint64_t> events(length);
+    std::mt19937_64 rng(length);
+    const uint64_t heap = 0x7f0000000000;
+    for (int i = 0; i < length; i++) {
+        uint64_t iter = uint64_t(i) / 8;
+        uint64_t addr;
+        uint64_t val = iter;
+        switch (i % 8) {
+            case 0: case 1: case 2:
+                addr = heap + (i % 8) * (1 << 26) + iter * 8;
+                break;
+            case 3: case 4:
+                addr = heap + (1 << 28) + (i % 8) * (1 << 26) + iter * 64;
+                break;
+            case 5:
+                addr = heap + (rng() % (1 << 20)) * 8;
+                val = rng();
+                break;
+            default:
+                addr = 0x7ffc00001000 + (i % 8) * 8;
+                break;
+        }
+        events[i] = (i % EventBuffer::BATCH_SIZE == 0) ?
+                (TSAN_RDTSC | (TSAN_HDR_ZERO_MASK & (iter * 3000))) :
+                encodeWord<EventLayout64>(0, TSAN_HDR_WRITE8,
+                        1000 + i % 8 * 7, val, addr);
+    }
+
+    EventCodec codec;
+    std::vector<uint8_t> compressed;
+    compressed.reserve(events.size() * EventBuffer::EVENT_SIZE);
+    std::vector<uint64_t> restored;
+    restored.reserve(events.size());
+    const int rounds = std::max(1, numIterations / 100);
+    int64_t compressNs = 0;
+    int64_t decompressNs = 0;
+    for (int r = 0; r < rounds; r++) {
+        compressed.clear();
+        restored.clear();
+        dirtyStack();
+        int64_t startTime = steadyClockNs();
+        codec.compress(events.data(), length, &compressed);
+        compressNs += steadyClockNs() - startTime;
+        startTime = steadyClockNs();
+        codec.decompress(compressed.data(), &restored);
+        decompressNs += steadyClockNs() - startTime;
+    }
+
+    double rawBytes = double(length) * EventBuffer::EVENT_SIZE;
+    printf("events %d, compressionRatio %.2f, bitsPerEvent %.2f, "
+           "compressGBps %.2f, decompressGBps %.2f, roundTrip %s\n", length,
+            rawBytes / double(compressed.size()),
+            8.0 * double(compressed.size()) / length,
+            rawBytes * rounds / double(compressNs),
+            rawBytes * rounds / double(decompressNs),
+            (restored == events) ? "OK" : "MISMATCH");
+}
+
+/// Shuffle the indices visited by the RANDOM access pattern.
+void
+setRandomOrder(int length)
+{
+    randomOrder.resize(length);
+    for (int i = 0; i < length; i++) {
+        randomOrder[i] = i;
+    }
+    std::shuffle(randomOrder.begin(), randomOrder.end(),
+            std::mt19937_64(length));
+}
+
+/// Options of `FastLog --sweep`.
+struct SweepOptions {
+    SweepOptions()
+        : logOp(NO_OP)
+        , threads({1})
+        , lengths({1000000})
+        , bufferEvents({EventBuffer::MAX_EVENTS})
+        , workloads()
+        , repeats(5)
+        , out("results.json")
+    {}
+
+    LogOp logOp;
+    std::vector<int> threads;
+    std::vector<int> lengths;
+
+    /// Capacities of the event buffers to try; only for the experiments that
+    /// use the buffer manager.
+    std::vector<int> bufferEvents;
+
+    /// Workloads to run; just the one set via FASTLOG_WORKLOAD if empty.
+    std::vector<Workload> workloads;
+
+    /// # runs of each configuration.
+    int repeats;
+
+    std::string out;
+};
+
+/**
+ * Parse a comma-separated list of positive integers.
+ *
+ * \return
+ *      False if the list is malformed.
+ */
+bool
+parseIntList(const char* text, std::vector<int>* values)
+{
+    values->clear();
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        char* end;
+        long value = std::strtol(item.c_str(), &end, 10);
+        if ((*end != 0) || (value <= 0)) {
+            return false;
+        }
+        values->push_back(int(value));
+    }
+    return !values->empty();
+}
+
+/**
+ * Parse a comma-separated list of workload names.
+ *
+ * \return
+ *      False if the list is malformed.
+ */
+bool
+parseWorkloadList(const char* text, std::vector<Workload>* workloads)
+{
+    workloads->clear();
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        Workload workload = workloadFromString(item);
+        if (workload == INVALID_WORKLOAD) {
+            return false;
+        }
+        workloads->push_back(workload);
+    }
+    return !workloads->empty();
+}
+
+/**
+ * Parse `--sweep <logOp> [--threads N,..] [--lengths N,..] [--buffers N,..]
+ * [--workloads NAME,..] [--repeats N] [--iterations N] [--out FILE]`.
+ *
+ * \return
+ *      False if the options are malformed.
+ */
+bool
+parseSweepOptions(int argc, char** argv, SweepOptions* options)
+{
+    if (argc < 3) {
+        return false;
+    }
+    options->logOp = static_cast<LogOp>(atoi(argv[2]));
+    if ((options->logOp < 0) || (options->logOp >= INVALID_OP) ||
+            (options->logOp == ALL_LOGGERS) ||
+            (options->logOp == DECODE_EVENTS) ||
+            (options->logOp == ARCHIVE_EVENTS)) {
+        return false;
+    }
+    for (int i = 3; i < argc; i += 2) {
+        if (i + 1 == argc) {
+            return false;
+        }
+        std::string option = argv[i];
+        const char* value = argv[i + 1];
+        bool ok = true;
+        if (option == "--threads") {
+            ok = parseIntList(value, &options->threads);
+        } else if (option == "--lengths") {
+            ok = parseIntList(value, &options->lengths);
+        } else if (option == "--buffers") {
+            ok = parseIntList(value, &options->bufferEvents);
+        } else if (option == "--workloads") {
+            ok = parseWorkloadList(value, &options->workloads);
+        } else if (option == "--repeats") {
+            options->repeats = atoi(value);
+            ok = options->repeats > 0;
+        } else if (option == "--iterations") {
+            numIterations = atoi(value);
+            ok = numIterations > 0;
+        } else if (option == "--out") {
+            options->out = value;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Add the measurements of one run of a sweep to its results: cycles per write
+ * (from rdtsc, averaged over threads), and the counts per write (or in total,
+ * for page faults) of the performance counters available on all threads.
+ */
+void
+addSample(const std::vector<ThreadResult>& threads, BenchResult* result)
+{
+    double writes = 0;
+    double cyclesPerWrite = 0;
+    for (const ThreadResult& t : threads) {
+        writes += t.writes;
+        cyclesPerWrite += t.cyclesPerWrite / double(threads.size());
+    }
+    result->add("cyclesPerWrite", cyclesPerWrite);
+
+    for (int i = 0; i < PerfCounters::NUM_COUNTERS; i++) {
+        double total = 0;
+        bool available = true;
+        for (const ThreadResult& t : threads) {
+            available &= t.counters[i] >= 0;
+            total += t.counters[i];
+        }
+        if (!available) {
+            continue;
+        }
+        std::string name = PerfCounters::name(PerfCounters::Counter(i));
+        if (i == PerfCounters::PAGE_FAULTS) {
+            result->add(name, total);
+        } else {
+            result->add(name + "PerWrite", total / writes);
+        }
+    }
+}
+
+/**
+ * Run every combination of workload, # threads, array length and buffer
+ * capacity of a sweep several times, and write the per-write cost of each,
+ * with confidence intervals, to a JSON file that `FastLog --compare` can
+ * check against a baseline.
+ *
+ * \param array
+ *      Large enough for the largest # threads and length of the sweep.
+ */
+void
+runSweep(const SweepOptions& options, int64_t* array)
+{
+    std::vector<int> bufferEvents = options.bufferEvents;
+    if (!usesBufferManager(options.logOp)) {
+        bufferEvents.assign(1, 0);
+    }
+
+    // Flatten the configurations to keep the nesting in check.
+    struct Config {
+        Workload workload;
+        int threads;
+        int length;
+        int bufferEvents;
+    };
+    std::vector<Config> configs;
+    for (Workload workload : options.workloads) {
+        for (int numThreads : options.threads) {
+            for (int length : options.lengths) {
+                for (int events : bufferEvents) {
+                    configs.push_back({workload, numThreads, length, events});
+                }
+            }
+        }
+    }
+
+    std::vector<BenchResult> results;
+    for (const Config& config : configs) {
+        if (accessPattern == RANDOM) {
+            setRandomOrder(config.length);
+        }
+        if (config.bufferEvents > 0) {
+            __buf_manager.setBufferCapacity(config.bufferEvents);
+        }
+        BenchResult result;
+        result.logOp = opcodeToString(options.logOp);
+        result.workload = workloadToString(config.workload);
+        result.threads = config.threads;
+        result.length = config.length;
+        result.bufferEvents = config.bufferEvents;
+        printf("sweep %s\n", result.key().c_str());
+        for (int r = 0; r < options.repeats; r++) {
+            workloadState.init(config.workload, array, config.threads,
+                    config.length);
+            std::vector<ThreadResult> threads;
+            runThreads(config.threads, options.logOp, NULL, array,
+                    config.length, &threads);
+            addSample(threads, &result);
+        }
+        const MetricSamples* cycles = result.find("cyclesPerWrite");
+        printf("sweep %s: cyclesPerWrite %.2f +- %.2f\n",
+                result.key().c_str(), cycles->mean(), cycles->ci95());
+        results.push_back(result);
+    }
+    writeBenchResults(options.out.c_str(), results);
+    printf("Wrote %zu results to %s\n", results.size(), options.out.c_str());
+}
+
+/**
+ * Run the logging experiment \p logOp (or the sweep, if any) on the workload
+ * set via the environment variable FASTLOG_WORKLOAD.
+ *
+ * \param sweep
+ *      Sweep to run instead of a single experiment; NULL if none.
+ */
+void
+runWorkload(int numThreads, LogOp logOp, int length, SweepOptions* sweep)
+{
+    int64_t* array = new int64_t[int64_t(numThreads) * length];
+    const char* workloadName = std::getenv("FASTLOG_WORKLOAD");
+    Workload workload = workloadName ?
+            workloadFromString(workloadName) : DISJOINT_WRITES;
+    if (workload == INVALID_WORKLOAD) {
+        workload = DISJOINT_WRITES;
+    }
+    workloadState.init(workload, array, numThreads, length);
+    printf("workload %s\n", workloadToString(workload));
+    if (sweep) {
+        if (sweep->workloads.empty()) {
+            sweep->workloads.push_back(workload);
+        }
+        runSweep(*sweep, array);
+    } else if (logOp == ALL_LOGGERS) {
+        LoggerCollector collector;
+        forEachLogger(&collector);
+        for (const LoggerCombination& combination : collector.combinations) {
+            printf("logger %s\n", combination.name.c_str());
+            runThreads(numThreads, logOp, &combination, array, length);
+        }
+    } else {
+        runThreads(numThreads, logOp, NULL, array, length);
+    }
 }
 
 int main(int argc, char **argv) {
+    if ((argc >= 2) && (strcmp(argv[1], "--compare") == 0)) {
+        if ((argc != 4) && (argc != 5)) {
+            fprintf(stderr, "Usage: %s --compare <baseline.json> "
+                    "<results.json> [thresholdPct]\n", argv[0]);
+            return 2;
+        }
+        double thresholdPct = (argc == 5) ? atof(argv[4]) : 5.0;
+        int regressions = compareBenchResults(loadBenchResults(argv[2]),
+                loadBenchResults(argv[3]), thresholdPct);
+        return (regressions > 0) ? 1 : 0;
+    }
+    if ((argc >= 2) && (strcmp(argv[1], "--slowdown") == 0)) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s --slowdown <baseline.json> "
+                    "<label>=<results.json>...\n", argv[0]);
+            return 2;
+        }
+        std::vector<std::string> labels;
+        std::vector<std::vector<BenchResult>> instrumented;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            size_t eq = arg.find('=');
+            labels.push_back(arg.substr(0, eq));
+            instrumented.push_back(loadBenchResults(
+                    (eq == std::string::npos) ? argv[i] : argv[i] + eq + 1));
+        }
+        printSlowdowns(loadBenchResults(argv[2]), labels, instrumented);
+        return 0;
+    }
+
     // # threads writing.
     int numThreads = 1;
 
@@ -749,7 +2060,23 @@ int main(int argc, char **argv) {
     // Operation to perform when logging.
     LogOp logOp = NO_OP;
 
-    if (argc == 4) {
+    // Benchmark sweep (see runSweep()), if any.
+    bool sweeping = (argc >= 2) && (strcmp(argv[1], "--sweep") == 0);
+    SweepOptions sweep;
+
+    if (sweeping) {
+        if (!parseSweepOptions(argc, argv, &sweep)) {
+            fprintf(stderr, "Usage: %s --sweep <logOp> [--threads N,..] "
+                    "[--lengths N,..] [--buffers N,..] [--workloads NAME,..] "
+                    "[--repeats N] [--iterations N] [--out FILE]\n", argv[0]);
+            return 2;
+        }
+        numThreads = *std::max_element(sweep.threads.begin(),
+                sweep.threads.end());
+        length = *std::max_element(sweep.lengths.begin(),
+                sweep.lengths.end());
+        logOp = sweep.logOp;
+    } else if (argc == 4) {
         numThreads = atoi(argv[1]);
         length = atoi(argv[2]);
         logOp = static_cast<LogOp>(atoi(argv[3]));
@@ -758,14 +2085,107 @@ int main(int argc, char **argv) {
            "eventBatch %d\n", numThreads, length, opcodeToString(logOp).c_str(),
             BUFFER_SIZE[logOp], EventBuffer::BATCH_SIZE);
 
-    int64_t* array = new int64_t[numThreads * length];
-    std::thread* workers[numThreads];
-    for (int i = 0; i < numThreads; i++) {
-        workers[i] = new std::thread(workerMain, i, logOp, array + i * length,
-                length);
+    if ((logOp == LOG_FULL) || (logOp == COMPACT_32)) {
+        const char* pattern = std::getenv("FASTLOG_ACCESS_PATTERN");
+        std::string name = pattern ? pattern : "sequential";
+        if (name == "strided") {
+            accessPattern = STRIDED;
+        } else if (name == "random") {
+            accessPattern = RANDOM;
+            setRandomOrder(length);
+        } else {
+            name = "sequential";
+        }
+        printf("accessPattern %s\n", name.c_str());
+    }
+    if ((logOp == PREFETCH_LOG_ENTRY) || (logOp == LOG_FULL) ||
+            (logOp == LOG_FULL_128) || (logOp == COMPACT_32) ||
+            (logOp == ALL_LOGGERS)) {
+        calibratePrefetch();
+        printf("prefetchDist %d, prefetchLines %d, storeMissCycles %.1f, "
+               "cyclesPerEvent %.2f\n", __prefetch_config.distance,
+               __prefetch_config.lines, __prefetch_config.storeMissCycles,
+               __prefetch_config.cyclesPerEvent);
+    }
+    if (logOp == SYNTHETIC_TRACE) {
+        printf("traceProfile %s\n", traceProfile.toString().c_str());
+    }
+    if (logOp == STACK_FILTER) {
+        const char* filter = std::getenv("FASTLOG_STACK_FILTER");
+        std::string name = filter ? filter : "runtime";
+        if (name == "none") {
+            stackFilter = NO_STACK_FILTER;
+        } else if (name == "runtime") {
+            stackFilter = RUNTIME_STACK_FILTER;
+        } else if (name == "static") {
+            stackFilter = STATIC_STACK_FILTER;
+        } else {
+            fprintf(stderr, "Unknown FASTLOG_STACK_FILTER \"%s\" (expected "
+                    "none, runtime or static)\n", name.c_str());
+            return 2;
+        }
+        stackStores = std::max(0, int(getEnvInt("FASTLOG_STACK_STORES", 2)));
+        printf("stackFilter %s, stackStores %d\n", name.c_str(), stackStores);
+    }
+    if (__shared_region.enabled()) {
+        printf("sharedRegion %s\n", __shared_region.path().c_str());
+        fflush(stdout);
+    }
+    if (__runtime_stats.enabled()) {
+        printf("statsPage %s\n", __runtime_stats.path().c_str());
+    }
+    if (__remote_analyzers.enabled()) {
+        printf("analyzerNodes %s\n", getenv("FASTLOG_ANALYZER_NODES"));
+    }
+    if (logOp == BUFFER_MANAGER_EPOCH_GEN) {
+        __buf_manager.setNotifyMode(BufferManager::EPOCH_GENERATION);
+    }
+    if (logOp == PER_CPU_BUFFER) {
+        __cpu_buffers.init();
     }
-    for (std::thread* worker : workers) {
-        worker->join();
+
+    // Optionally run a cache-sensitive workload on the side.
+    int coRunnerKB = int(getEnvInt("FASTLOG_CORUN_KB", 0));
+    std::atomic<bool> coRunnerStop(false);
+    std::thread* coRunner = NULL;
+    if (coRunnerKB > 0) {
+        coRunner = new std::thread(coRunnerMain, coRunnerKB, &coRunnerStop);
+    }
+
+    if (logOp == DECODE_EVENTS) {
+        benchDecode(length);
+    } else if (logOp == ARCHIVE_EVENTS) {
+        benchArchive(length);
+    } else {
+        runWorkload(numThreads, logOp, length, sweeping ? &sweep : NULL);
+    }
+    if (coRunner) {
+        coRunnerStop = true;
+        coRunner->join();
+    }
+    if ((logOp == PER_CPU_BUFFER) &&
+            (getEnvInt("FASTLOG_IDLE_CPU_CHECK", 0) != 0) && !checkIdleCpus()) {
+        return 1;
+    }
+
+    if (usesBufferManager(logOp)) {
+        __buf_manager.printStats();
+        if (__buf_manager.flightRecorderEnabled()) {
+            dumpFlightRecorder();
+        }
+        if (__shared_region.enabled()) {
+            __shared_region.printStats();
+        }
+        if (__remote_analyzers.enabled()) {
+            // Let the analyzer nodes catch up to measure the throughput.
+            if (!__remote_analyzers.drain(5000000000L)) {
+                printf("Analyzer nodes haven't caught up\n");
+            }
+            __remote_analyzers.printStats();
+        }
+        if (__epoch_archive.enabled()) {
+            __epoch_archive.printStats();
+        }
     }
 
     return 0;
@@ -0,0 +1,185 @@
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include <sched.h>
+#include <system_error>
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Context.h"
+#include "LoggerConsts.h"
+#include "PerCpuBuffers.h"
+#include "RuntimeStats.h"
+
+#define LOCK(x) std::lock_guard<std::mutex> _(x)
+
+static int
+membarrier(int cmd)
+{
+    return int(syscall(__NR_membarrier, cmd, 0));
+}
+
+/**
+ * Install an event buffer for each CPU. Must be invoked once, before any
+ * thread logs to the per-CPU buffers.
+ */
+void
+PerCpuBuffers::init()
+{
+    // We rely on glibc (2.35+) to register an rseq area for each thread.
+    if (__rseq_size == 0) {
+        throw std::system_error(ENOSYS, std::system_category(),
+                "rseq not registered by glibc");
+    }
+    if (membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ) != 0) {
+        throw std::system_error(errno, std::system_category(), "membarrier");
+    }
+
+    LOCK(mutex);
+    numCpus = int(sysconf(_SC_NPROCESSORS_CONF));
+    slots = new std::atomic<CpuBuffer*>[numCpus];
+    spareSlots = new CpuBuffer*[numCpus];
+
+    cpuBufs = static_cast<CpuBuffer*>(
+            alignedAlloc(sizeof(CpuBuffer) * 2 * numCpus));
+    for (int cpu = 0; cpu < numCpus; cpu++) {
+        EventBuffer* logBuf = __buf_manager.allocCpuBuffer();
+        cpuBufs[cpu] = {CpuBuffer::NO_OWNER << 32,
+                uint64_t(logBuf->capacity), logBuf->buf, logBuf};
+        slots[cpu].store(&cpuBufs[cpu]);
+        spareSlots[cpu] = &cpuBufs[numCpus + cpu];
+    }
+}
+
+/**
+ * Get the rseq area of the calling thread, through which the kernel tells us
+ * the current CPU and which restartable sequence we are in.
+ */
+struct rseq*
+PerCpuBuffers::threadRseq()
+{
+    return reinterpret_cast<struct rseq*>(
+            static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+}
+
+/**
+ * Slow path of rseqAppend(): log a thread switch marker if another thread
+ * logged to the buffer of our CPU last, and start a new epoch if the buffer
+ * is full. Then append the event.
+ *
+ * \param owner
+ *      ID of the calling thread.
+ * \param event
+ *      Event to append.
+ */
+void
+PerCpuBuffers::appendSlow(uint64_t owner, uint64_t event)
+{
+    struct rseq* rs = threadRseq();
+    while (!rseqAppend(rs, slots, owner, event)) {
+        CpuBuffer* fullBuf;
+        if (rseqSwitchOwner(rs, slots, owner, TSAN_THREAD_SWITCH | owner,
+                &fullBuf)) {
+            // Claim our stats slot, in which worker threads will count the
+            // events that follow the marker.
+            if (__runtime_stats.enabled()) {
+                __runtime_stats.thread(int(owner));
+            }
+            continue;
+        }
+
+        // The buffer of our CPU is full. Note: we may have migrated since, in
+        // which case we just try again.
+        rotate(fullBuf);
+    }
+}
+
+/**
+ * End the current epoch: replace the buffers of all CPUs with new ones and
+ * hand the old ones to the worker thread of the epoch.
+ *
+ * \param fullBuf
+ *      The full buffer that prompted the call, as read from #slots. Nothing
+ *      to do if the buffers have already been replaced by another thread, in
+ *      which case \p fullBuf may even have been reused since.
+ */
+void
+PerCpuBuffers::rotate(CpuBuffer* fullBuf)
+{
+    LOCK(mutex);
+
+    // Slots only change under the mutex, so if the buffer is still installed
+    // it can't be recycled under our feet.
+    bool installed = false;
+    for (int cpu = 0; (cpu < numCpus) && !installed; cpu++) {
+        installed = (slots[cpu].load() == fullBuf);
+    }
+    if (!installed) {
+        return;
+    }
+    uint64_t state = __atomic_load_n(&fullBuf->state, __ATOMIC_RELAXED);
+    if (uint32_t(state) < fullBuf->capacity) {
+        return;
+    }
+    int epoch = fullBuf->logBuf->epoch;
+
+    // The buffers of all CPUs belong to the same epoch. Even if the buffer
+    // manager has moved on already (because of a per-thread buffer filling
+    // up), the old buffers must be closed.
+    __buf_manager.tryIncEpoch(epoch);
+    swapBuffers();
+}
+
+/**
+ * Replace the buffers of all CPUs if their epoch has ended already, e.g.
+ * because a per-thread buffer filled up. Otherwise they would only be closed
+ * once one of them fills up, so idle CPUs would hold the epoch open. Invoked
+ * by the idle sweep of worker threads (see
+ * BufferManager::revokeIdleBuffers()).
+ */
+void
+PerCpuBuffers::rotateStale()
+{
+    LOCK(mutex);
+    if (numCpus == 0) {
+        return;
+    }
+    if (slots[0].load()->logBuf->epoch ==
+            __epoch_generation.value.load(std::memory_order_acquire)) {
+        return;
+    }
+    swapBuffers();
+}
+
+/**
+ * Swap in new buffers for all CPUs, wait until no thread can append to the
+ * old ones any more and close them.
+ *
+ * \pre
+ *      The caller must hold #mutex.
+ */
+void
+PerCpuBuffers::swapBuffers()
+{
+    for (int cpu = 0; cpu < numCpus; cpu++) {
+        EventBuffer* logBuf = __buf_manager.allocCpuBuffer();
+        CpuBuffer* spare = spareSlots[cpu];
+        spare->state = CpuBuffer::NO_OWNER << 32;
+        spare->capacity = uint64_t(logBuf->capacity);
+        spare->buf = logBuf->buf;
+        spare->logBuf = logBuf;
+        spareSlots[cpu] = slots[cpu].exchange(spare);
+    }
+
+    // Abort the restartable sequences in progress on the old buffers; no
+    // thread can commit an event into them afterwards.
+    if (membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ) != 0) {
+        throw std::system_error(errno, std::system_category(), "membarrier");
+    }
+    for (int cpu = 0; cpu < numCpus; cpu++) {
+        CpuBuffer* old = spareSlots[cpu];
+        old->logBuf->events = int(uint32_t(old->state));
+        old->logBuf->close();
+    }
+}
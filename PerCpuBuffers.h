@@ -0,0 +1,251 @@
+#ifndef FASTLOG_PERCPUBUFFERS_H
+#define FASTLOG_PERCPUBUFFERS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <sys/rseq.h>
+
+#include "EventBuffer.h"
+#include "Utils.h"
+
+/// The event buffer assigned to one CPU in the current epoch, as seen by the
+/// restartable sequences that append events to it. Each one takes a cache
+/// line of its own since #state is written by whichever thread runs on the
+/// CPU.
+struct CACHE_ALIGNED CpuBuffer {
+    /// ID of the thread that logged the most recent event (upper 32 bits)
+    /// and # events in the buffer (lower 32 bits). Only ever updated by the
+    /// single store that commits a restartable sequence, so a thread
+    /// switch marker and the change of owner can't be torn apart.
+    uint64_t state;
+
+    /// # events the buffer can hold.
+    uint64_t capacity;
+
+    /// Storage of #logBuf.
+    uint64_t* buf;
+
+    /// The underlying event buffer.
+    EventBuffer* logBuf;
+
+    /// Owner ID of a buffer no thread has logged to yet.
+    static const uint64_t NO_OWNER = 0xFFFFFFFF;
+};
+
+// Field offsets are hard-coded in the restartable sequences below.
+static_assert(offsetof(CpuBuffer, state) == 0, "CpuBuffer layout");
+static_assert(offsetof(CpuBuffer, capacity) == 8, "CpuBuffer layout");
+static_assert(offsetof(CpuBuffer, buf) == 16, "CpuBuffer layout");
+
+/**
+ * Per-CPU event buffers: an alternative to per-thread event buffers for
+ * applications with far more threads than cores. Memory then scales with
+ * #cores instead of #threads.
+ *
+ * Threads on the same CPU share one buffer. Appending an event is a Linux
+ * restartable sequence (rseq), which the kernel aborts and restarts if the
+ * thread is preempted or migrated before it commits. Since the events of a
+ * buffer now come from different threads, a thread switch marker is logged
+ * every time the logging thread differs from the previous one.
+ *
+ * At the end of an epoch, the coordinator swaps in new buffers for all CPUs
+ * and uses membarrier(2) to abort the restartable sequences in flight on the
+ * old buffers, after which they can be closed. Buffers of an epoch that
+ * ended elsewhere are replaced by the idle sweep of its worker thread.
+ */
+class PerCpuBuffers {
+  public:
+    explicit PerCpuBuffers()
+        : mutex()
+        , numCpus(0)
+        , slots(NULL)
+        , cpuBufs(NULL)
+        , spareSlots(NULL)
+    {}
+
+    void init();
+    void appendSlow(uint64_t owner, uint64_t event);
+    void rotateStale();
+    static struct rseq* threadRseq();
+
+    /// Buffers of each CPU, indexed by CPU number.
+    std::atomic<CpuBuffer*>*
+    getSlots()
+    {
+        return slots;
+    }
+
+  private:
+    void rotate(CpuBuffer* fullBuf);
+    void swapBuffers();
+
+    /// Serializes epoch rotations.
+    std::mutex mutex;
+
+    /// # possible CPUs.
+    int numCpus;
+
+    /// Buffers of each CPU, indexed by CPU number.
+    std::atomic<CpuBuffer*>* slots;
+
+    /// Storage of all CpuBuffers (two per CPU), cache line aligned.
+    CpuBuffer* cpuBufs;
+
+    /// Buffers of each CPU to swap in at the next epoch change. Once swapped
+    /// out (and no restartable sequence can be using them any more), the old
+    /// buffers become the spares.
+    CpuBuffer** spareSlots;
+};
+
+/// Per-CPU event buffers shared by all threads. Only used if init()'ed.
+extern PerCpuBuffers __cpu_buffers;
+
+/**
+ * Append an event to the buffer of the CPU the calling thread is running on,
+ * using a restartable sequence.
+ *
+ * \param rs
+ *      The calling thread's rseq area (see PerCpuBuffers::threadRseq()).
+ * \param slots
+ *      Buffers of each CPU (see PerCpuBuffers::getSlots()).
+ * \param owner
+ *      ID of the calling thread.
+ * \param event
+ *      Event to append.
+ * \return
+ *      True on success; false if the buffer was last logged to by another
+ *      thread or is full, in which case PerCpuBuffers::appendSlow() must be
+ *      called instead.
+ */
+__attribute__((always_inline, target("no-sse")))
+inline bool
+rseqAppend(struct rseq* rs, std::atomic<CpuBuffer*>* slots, uint64_t owner,
+        uint64_t event)
+{
+retry:
+    asm goto(
+        // Critical section descriptor: version, flags, start_ip,
+        // post_commit_offset, abort_ip.
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        // On abort, the kernel jumps to 4 (which must be preceded by the
+        // rseq signature); just start over.
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp %l[retry]\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %c[rseqCsOff](%[rs])\n\t"
+        "1:\n\t"
+        "movl %c[cpuIdOff](%[rs]), %%eax\n\t"
+        "movq (%[slots], %%rax, 8), %%rdx\n\t"
+        "movq (%%rdx), %%rcx\n\t"
+        "movq %%rcx, %%rsi\n\t"
+        "shrq $32, %%rsi\n\t"
+        "cmpq %[owner], %%rsi\n\t"
+        "jne %l[slow]\n\t"
+        "movl %%ecx, %%esi\n\t"
+        "cmpq 8(%%rdx), %%rsi\n\t"
+        "jae %l[slow]\n\t"
+        "movq 16(%%rdx), %%rdi\n\t"
+        "movq %[event], (%%rdi, %%rsi, 8)\n\t"
+        "incq %%rcx\n\t"
+        // Commit.
+        "movq %%rcx, (%%rdx)\n\t"
+        "2:\n\t"
+        :
+        : [rs] "r" (rs), [slots] "r" (slots), [owner] "r" (owner),
+          [event] "r" (event),
+          [cpuIdOff] "i" (offsetof(struct rseq, cpu_id)),
+          [rseqCsOff] "i" (offsetof(struct rseq, rseq_cs))
+        : "rax", "rcx", "rdx", "rsi", "rdi", "memory", "cc"
+        : retry, slow);
+    return true;
+slow:
+    return false;
+}
+
+/**
+ * Log a thread switch marker to the buffer of the CPU the calling thread is
+ * running on and make the calling thread the owner of the buffer, using a
+ * restartable sequence.
+ *
+ * \param rs
+ *      The calling thread's rseq area.
+ * \param slots
+ *      Buffers of each CPU.
+ * \param owner
+ *      ID of the calling thread.
+ * \param marker
+ *      Thread switch marker event.
+ * \param[out] fullBuf
+ *      Buffer of the CPU, as read within the restartable sequence. Only
+ *      meaningful if the buffer is full.
+ * \return
+ *      True if the calling thread now owns the buffer of its CPU (or already
+ *      did, e.g. because it was migrated); false if the buffer is full, in
+ *      which case the epoch must be ended.
+ */
+__attribute__((always_inline))
+inline bool
+rseqSwitchOwner(struct rseq* rs, std::atomic<CpuBuffer*>* slots,
+        uint64_t owner, uint64_t marker, CpuBuffer** fullBuf)
+{
+retry:
+    asm goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp %l[retry]\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %c[rseqCsOff](%[rs])\n\t"
+        "1:\n\t"
+        "movl %c[cpuIdOff](%[rs]), %%eax\n\t"
+        "movq (%[slots], %%rax, 8), %%rdx\n\t"
+        "movq %%rdx, (%[fullBuf])\n\t"
+        "movq (%%rdx), %%rcx\n\t"
+        "movl %%ecx, %%esi\n\t"
+        "cmpq 8(%%rdx), %%rsi\n\t"
+        "jae %l[full]\n\t"
+        "shrq $32, %%rcx\n\t"
+        "cmpq %[owner], %%rcx\n\t"
+        "je %l[done]\n\t"
+        "movq 16(%%rdx), %%rdi\n\t"
+        "movq %[marker], (%%rdi, %%rsi, 8)\n\t"
+        "incq %%rsi\n\t"
+        "movq %[owner], %%rcx\n\t"
+        "shlq $32, %%rcx\n\t"
+        "orq %%rsi, %%rcx\n\t"
+        // Commit.
+        "movq %%rcx, (%%rdx)\n\t"
+        "2:\n\t"
+        :
+        : [rs] "r" (rs), [slots] "r" (slots), [owner] "r" (owner),
+          [marker] "r" (marker), [fullBuf] "r" (fullBuf),
+          [cpuIdOff] "i" (offsetof(struct rseq, cpu_id)),
+          [rseqCsOff] "i" (offsetof(struct rseq, rseq_cs))
+        : "rax", "rcx", "rdx", "rsi", "rdi", "memory", "cc"
+        : retry, done, full);
+done:
+    return true;
+full:
+    return false;
+}
+
+#endif //FASTLOG_PERCPUBUFFERS_H
@@ -0,0 +1,96 @@
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "PerfCounters.h"
+
+/**
+ * Open the counters of the calling thread (on any CPU), user space only.
+ */
+PerfCounters::PerfCounters()
+    : fds()
+    , values()
+{
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[NUM_COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                (PERF_COUNT_HW_CACHE_OP_WRITE << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    };
+
+    // Counters are opened one by one rather than as a group, so that one
+    // unsupported counter doesn't take the others down with it.
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                PERF_FLAG_FD_CLOEXEC));
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void
+PerfCounters::start()
+{
+    for (int fd : fds) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void
+PerfCounters::stop()
+{
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        values[i] = 0;
+        if (fds[i] < 0) {
+            continue;
+        }
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        // Count, time enabled, time running.
+        uint64_t data[3];
+        if ((read(fds[i], data, sizeof(data)) == sizeof(data)) &&
+                (data[2] > 0)) {
+            values[i] = double(data[0]) * double(data[1]) / double(data[2]);
+        }
+    }
+}
+
+const char*
+PerfCounters::name(Counter counter)
+{
+    switch (counter) {
+    case CYCLES:                return "cycles";
+    case INSTRUCTIONS:          return "instructions";
+    case BRANCH_MISSES:         return "branchMisses";
+    case L1D_STORE_MISSES:      return "l1dStoreMisses";
+    case PAGE_FAULTS:           return "pageFaults";
+    default:                    return "unknown";
+    }
+}
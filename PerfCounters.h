@@ -0,0 +1,59 @@
+#ifndef FASTLOG_PERFCOUNTERS_H
+#define FASTLOG_PERFCOUNTERS_H
+
+#include <cstdint>
+
+/**
+ * Hardware and software performance counters of the calling thread, read
+ * in-process through perf_event_open(2), so that the benchmark doesn't need
+ * to run under `perf stat` and can attribute counts to each thread.
+ *
+ * Counters the kernel or the CPU doesn't support (e.g., hardware counters in
+ * most VMs, or with a restrictive kernel.perf_event_paranoid) are simply
+ * unavailable; see available().
+ *
+ * Not thread-safe; each thread opens its own counters.
+ */
+class PerfCounters {
+  public:
+    enum Counter {
+        CYCLES,
+        INSTRUCTIONS,
+        BRANCH_MISSES,
+        L1D_STORE_MISSES,
+        PAGE_FAULTS,
+        NUM_COUNTERS,
+    };
+
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    void start();
+    void stop();
+
+    /// True if the counter could be opened.
+    bool
+    available(Counter counter) const
+    {
+        return fds[counter] >= 0;
+    }
+
+    /// Count between the last start() and stop(), scaled up if the kernel
+    /// had to multiplex the counter.
+    double
+    value(Counter counter) const
+    {
+        return values[counter];
+    }
+
+    static const char* name(Counter counter);
+
+  private:
+    int fds[NUM_COUNTERS];
+    double values[NUM_COUNTERS];
+};
+
+#endif //FASTLOG_PERFCOUNTERS_H
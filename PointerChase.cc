@@ -0,0 +1,30 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "PointerChase.h"
+
+/**
+ * Link the cache lines of a \p bytes large buffer into a random cycle.
+ */
+PointerChase::PointerChase(size_t bytes)
+    : lines(NULL)
+    , cur(NULL)
+{
+    size_t numLines = std::max(bytes / sizeof(Line), size_t(1));
+    lines = static_cast<Line*>(alignedAlloc(numLines * sizeof(Line)));
+    std::vector<size_t> order(numLines);
+    for (size_t i = 0; i < numLines; i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(numLines));
+    for (size_t i = 0; i < numLines; i++) {
+        lines[order[i]].next = &lines[order[(i + 1) % numLines]];
+    }
+    cur = &lines[order[0]];
+}
+
+PointerChase::~PointerChase()
+{
+    alignedFree(lines);
+}
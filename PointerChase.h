@@ -0,0 +1,51 @@
+#ifndef FASTLOG_POINTERCHASE_H
+#define FASTLOG_POINTERCHASE_H
+
+#include <cstddef>
+
+#include "Utils.h"
+
+/**
+ * A random cycle of cache lines to chase pointers through. Each step depends
+ * on the previous one and the hardware prefetchers can't guess the next line,
+ * so once the cycle is much larger than the last-level cache every step is a
+ * miss that goes all the way to memory; a smaller cycle keeps its share of
+ * the cache busy instead.
+ */
+class PointerChase {
+  public:
+    explicit PointerChase(size_t bytes);
+    ~PointerChase();
+
+    PointerChase(const PointerChase&) = delete;
+    PointerChase& operator=(const PointerChase&) = delete;
+
+    /**
+     * Take \p steps steps along the cycle, from where the previous call left
+     * off.
+     */
+    void
+    chase(int steps)
+    {
+        Line* line = cur;
+        for (int i = 0; i < steps; i++) {
+            line = line->next;
+        }
+        cur = line;
+    }
+
+  private:
+    /// Aligned even with FASTLOG_PACKED_LAYOUT: each step must touch a line
+    /// of its own.
+    struct alignas(CACHE_LINE_SIZE) Line {
+        Line* next;
+    };
+
+    /// All lines of the cycle, in memory order.
+    Line* lines;
+
+    /// Where the next call to chase() starts.
+    Line* cur;
+};
+
+#endif //FASTLOG_POINTERCHASE_H
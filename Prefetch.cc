@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "EventBuffer.h"
+#include "LoggerPolicies.h"
+#include "PointerChase.h"
+#include "Prefetch.h"
+#include "Utils.h"
+
+static const int EVENTS_PER_LINE = CACHE_LINE_SIZE / EventBuffer::EVENT_SIZE;
+
+/**
+ * # cache lines to prefetch per slow path: those a batch of events can span.
+ * Besides its BATCH_SIZE events, a batch may contain a timestamp, and a
+ * multi-word event may overshoot the end of the batch by a word.
+ */
+static int
+linesPerBatch()
+{
+    return (EventBuffer::BATCH_SIZE + 2 + EVENTS_PER_LINE - 1) /
+            EVENTS_PER_LINE;
+}
+
+/**
+ * Apply the overrides of the environment variables FASTLOG_PREFETCH_DIST (in
+ * events) and FASTLOG_PREFETCH_LINES, if any.
+ */
+static PrefetchConfig
+withOverrides(PrefetchConfig config)
+{
+    config.distance = std::max(0, int(getEnvInt("FASTLOG_PREFETCH_DIST",
+            config.distance)));
+    config.lines = std::max(0, int(getEnvInt("FASTLOG_PREFETCH_LINES",
+            config.lines)));
+    return config;
+}
+
+PrefetchConfig __prefetch_config = withOverrides({
+        EventBuffer::BATCH_SIZE * 2, linesPerBatch(), 0, 0});
+
+/**
+ * Measure the latency of a cache miss that goes all the way to memory by
+ * chasing pointers through a random cycle of cache lines much larger than the
+ * last-level cache. A store miss costs about the same (it has to fetch the
+ * line for ownership first).
+ */
+static double
+measureMissCycles()
+{
+    PointerChase cycle(64 << 20);
+    const int steps = 1 << 18;
+    uint64_t startTime = rdtsc();
+    cycle.chase(steps);
+    uint64_t cycles = rdtsc() - startTime;
+    return double(cycles) / steps;
+}
+
+/**
+ * Measure the cost of logging one event when the event buffer is in L1, i.e.
+ * the rate at which a thread that does nothing but logging consumes event
+ * buffer entries. Events go through a Logger with the layout of LOG_FULL
+ * (but without the prefetch being calibrated) into a small buffer that wraps
+ * around.
+ */
+static double
+measureEventCycles()
+{
+    // 32 KB; fits in any L1d.
+    const int events = 4096;
+    const int rounds = 256;
+    const int length = 1024;
+    static int64_t array[length];
+
+    // Log into a buffer of our own for the time being.
+    EventBuffer* savedBuf = getLogBuffer();
+    EventBuffer* logBuf = EventBuffer::create(events);
+    __atomic_store_n(&__log_buffer, logBuf, __ATOMIC_RELAXED);
+    uint64_t cycles;
+    {
+        Logger<Full64Layout, LocalBufPtr, NoPrefetch, NoTimestamp> logger(
+                events);
+        uint64_t startTime = rdtsc();
+        for (int i = 0; i < events * rounds; i++) {
+            int64_t* addr = &array[i % length];
+            logger.write8(__LINE__, addr, i);
+            (*addr) = i;
+        }
+        cycles = rdtsc() - startTime;
+    }
+    __atomic_store_n(&__log_buffer, savedBuf, __ATOMIC_RELAXED);
+    EventBuffer::destroy(logBuf);
+    return double(cycles) / (double(events) * rounds);
+}
+
+/**
+ * Choose the prefetch distance based on the memory latency and logging rate
+ * of this machine. Takes a few dozen milliseconds; invoke once at startup,
+ * before any thread logs.
+ *
+ * The environment variables FASTLOG_PREFETCH_DIST (in events) and
+ * FASTLOG_PREFETCH_LINES override the results, as they override the defaults
+ * when there is no calibration.
+ */
+void
+calibratePrefetch()
+{
+    PrefetchConfig config;
+    config.storeMissCycles = measureMissCycles();
+    config.cyclesPerEvent = std::max(measureEventCycles(), 0.1);
+
+    // A line prefetched when the write position is `distance` events behind
+    // it must arrive before we get there. Prefetches are only issued once per
+    // batch, so add a batch of slack and round up to whole lines.
+    int missEvents = int(config.storeMissCycles / config.cyclesPerEvent) + 1;
+    int distance = missEvents + EventBuffer::BATCH_SIZE;
+    distance = (distance + EVENTS_PER_LINE - 1) / EVENTS_PER_LINE *
+            EVENTS_PER_LINE;
+
+    // Prefetching fewer lines per batch than we consume would fall behind.
+    config.distance = distance;
+    config.lines = linesPerBatch();
+    __prefetch_config = withOverrides(config);
+}
@@ -0,0 +1,66 @@
+#ifndef FASTLOG_PREFETCH_H
+#define FASTLOG_PREFETCH_H
+
+#include <cstdint>
+
+#include "EventBuffer.h"
+
+/// How far ahead of the write position to prefetch event buffer entries, and
+/// how much to prefetch at a time (see prefetchLogEntries()).
+struct PrefetchConfig {
+    /// Distance, in events, between the current write position and the first
+    /// cache line to prefetch. Should cover the store miss latency at the
+    /// rate events are logged.
+    int distance;
+
+    /// # cache lines to prefetch on each slow path invocation (i.e., once per
+    /// BATCH_SIZE events).
+    int lines;
+
+    /// Measured latency of a store miss in cycles. 0 if not calibrated.
+    double storeMissCycles;
+
+    /// Measured cost of logging one event (without misses) in cycles. 0 if
+    /// not calibrated.
+    double cyclesPerEvent;
+};
+
+/// Prefetch settings used by all threads. Defaults to the old hard-coded
+/// distance of two batches until calibratePrefetch() is invoked; the
+/// environment overrides apply either way.
+extern PrefetchConfig __prefetch_config;
+
+void calibratePrefetch();
+
+/**
+ * Prefetch the event buffer entries that will be written some time after
+ * \p curPos into all levels of cache, preparing for the writes.
+ *
+ * The prefetch is implemented using gcc builtins. Since write-prefetch is only
+ * available as an ISA extension, in order to make sure the builtin is actually
+ * compiled into the PREFETCHW instruction (as opposed to normal read-prefetch),
+ * use compiler option "-march={broadwell, skylake, etc.}" or "-mprfchw".
+ */
+inline void
+prefetchLogEntries(uint64_t* curPos)
+{
+    // TODO: honestly, I have no clue if this is the best way to do prefetch.
+    // I observed some speedup compared to LOG_ADDR when buffer size is large,
+    // that's all. I don't even know what performance metrics I should be
+    // looking at to see how these SW prefetch change/improve the behavior/performance.
+
+    // Prefetch log entries that will be written in some future period.
+    // A cache line is usually 64-byte, which can hold 8 events. The distance
+    // is derived from the memory latency and cycles per event at startup
+    // (see calibratePrefetch()).
+    int eventsPerLine = 64 / EventBuffer::EVENT_SIZE;
+    int prefetchCacheLines = __prefetch_config.lines;
+    int prefetchDist = __prefetch_config.distance;
+    for (int i = 0; i < prefetchCacheLines; i++) {
+        uint64_t* pos = curPos + prefetchDist + i * eventsPerLine;
+        __builtin_prefetch(pos, 1 /* prepare for writes */,
+                3 /* fetch to all cache levels*/);
+    }
+}
+
+#endif //FASTLOG_PREFETCH_H
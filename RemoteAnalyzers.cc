@@ -0,0 +1,482 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "EventBuffer.h"
+#include "FlightRecorder.h"
+#include "RemoteAnalyzers.h"
+#include "Utils.h"
+
+#define LOCK(x) std::lock_guard<std::mutex> _(x)
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+RemoteAnalyzers::Node::Node()
+    : mutex()
+    , fd(-1)
+    , name()
+    , credits(0)
+    , outstanding(0)
+    , zerocopy(false)
+    , zerocopyCalls(0)
+    , zerocopyDone(0)
+    , zerocopyRanges()
+    , pending()
+    , done()
+    , rx()
+    , rxBytes(0)
+    , codec()
+    , compressed()
+    , sentBufs(0)
+    , sentEvents(0)
+    , sentBytes(0)
+    , ackedEvents(0)
+    , copiedSends(0)
+{}
+
+RemoteAnalyzers::RemoteAnalyzers()
+    : nodes()
+    , firstSendNs(0)
+    , lastAckNs(0)
+    , droppedBufs(0)
+{
+    const char* nodeList = std::getenv("FASTLOG_ANALYZER_NODES");
+    if (nodeList) {
+        connect(nodeList, getEnvInt("FASTLOG_NET_COMPRESS", 0) != 0);
+    }
+}
+
+RemoteAnalyzers::~RemoteAnalyzers()
+{
+    for (auto& node : nodes) {
+        close(node->fd);
+    }
+}
+
+/**
+ * Open a connection to each of the analyzer nodes. Retries for a while, so
+ * that nodes started together with the application have time to come up.
+ *
+ * \param nodeList
+ *      Comma-separated list of host:port.
+ * \param compressEvents
+ *      Compress events before sending them.
+ * \throw std::system_error
+ *      Some node couldn't be reached.
+ */
+void
+RemoteAnalyzers::connect(const std::string& nodeList, bool compressEvents)
+{
+    size_t begin = 0;
+    while (begin < nodeList.size()) {
+        size_t end = std::min(nodeList.find(',', begin), nodeList.size());
+        std::string name = nodeList.substr(begin, end - begin);
+        begin = end + 1;
+        size_t colon = name.rfind(':');
+        if (colon == std::string::npos) {
+            throw std::system_error(EINVAL, std::system_category(), name);
+        }
+        std::string host = name.substr(0, colon);
+        std::string port = name.substr(colon + 1);
+
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* addrs;
+        int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+        if (error != 0) {
+            throw std::system_error(EHOSTUNREACH, std::system_category(),
+                    name + ": " + gai_strerror(error));
+        }
+        int fd = -1;
+        for (int attempt = 0; (attempt < 50) && (fd < 0); attempt++) {
+            if (attempt > 0) {
+                usleep(100000);
+            }
+            fd = socket(addrs->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if ((fd >= 0) &&
+                    (::connect(fd, addrs->ai_addr, addrs->ai_addrlen) != 0)) {
+                error = errno;
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+        if (fd < 0) {
+            throw std::system_error(error, std::system_category(), name);
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::unique_ptr<Node> node(new Node());
+        node->fd = fd;
+        node->name = name;
+        node->zerocopy =
+                setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        if (compressEvents) {
+            node->codec.reset(new EventCodec());
+        }
+        nodes.push_back(std::move(node));
+    }
+}
+
+/**
+ * Process what a node has sent us (credits) and the completion notifications
+ * of our zerocopy sends to it, waiting up to \p timeoutMs for something to
+ * happen if needed.
+ *
+ * \pre
+ *      The caller must hold the lock of \p node.
+ * \return
+ *      False if the connection is gone.
+ */
+bool
+RemoteAnalyzers::poll(Node* node, int timeoutMs)
+{
+    struct pollfd pfd = {node->fd, POLLIN, 0};
+    if (::poll(&pfd, 1, timeoutMs) <= 0) {
+        return true;
+    }
+
+    // Credits.
+    while (true) {
+        char* dst = reinterpret_cast<char*>(&node->rx) + node->rxBytes;
+        ssize_t n = recv(node->fd, dst, sizeof(CreditMsg) - node->rxBytes,
+                MSG_DONTWAIT);
+        if (n == 0) {
+            return false;
+        }
+        if (n < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                    (errno != EINTR)) {
+                return false;
+            }
+            break;
+        }
+        node->rxBytes += size_t(n);
+        if (node->rxBytes == sizeof(CreditMsg)) {
+            node->credits += int(node->rx.credits);
+            node->outstanding -= std::min(node->outstanding,
+                    int(node->rx.credits));
+            node->ackedEvents += node->rx.events;
+            node->rxBytes = 0;
+            lastAckNs = steadyClockNs();
+        }
+    }
+
+    // Completions of zerocopy sends; each covers a range of send IDs.
+    char control[128];
+    struct msghdr msg;
+    while (node->zerocopy) {
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(node->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err err;
+            std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            completeZerocopy(node, err.ee_info, err.ee_data);
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // E.g., on loopback; the kernel copied the data after all.
+                node->copiedSends += err.ee_data - err.ee_info + 1;
+            }
+        }
+    }
+    while (!node->pending.empty() &&
+            (int32_t(node->pending.front().first - node->zerocopyDone) < 0)) {
+        node->done.push_back(node->pending.front().second);
+        node->pending.pop_front();
+    }
+    return true;
+}
+
+/**
+ * Record the completion of the zerocopy sends [\p first, \p last] to a node,
+ * and advance #zerocopyDone past all the sends completed so far without a
+ * gap. Send IDs wrap around, so they're only compared relative to each other.
+ */
+void
+RemoteAnalyzers::completeZerocopy(Node* node, uint32_t first, uint32_t last)
+{
+    std::vector<std::pair<uint32_t, uint32_t>>& ranges = node->zerocopyRanges;
+    ranges.push_back({first, last});
+    bool advanced = true;
+    while (advanced) {
+        advanced = false;
+        for (size_t i = 0; i < ranges.size(); i++) {
+            if (int32_t(ranges[i].first - node->zerocopyDone) > 0) {
+                continue;
+            }
+            if (int32_t(ranges[i].second + 1 - node->zerocopyDone) > 0) {
+                node->zerocopyDone = ranges[i].second + 1;
+            }
+            ranges[i] = ranges.back();
+            ranges.pop_back();
+            advanced = true;
+            break;
+        }
+    }
+}
+
+/**
+ * Check if any node has credits left, i.e., if the buffers of a new epoch
+ * have somewhere to go. Invoked by the buffer manager at the end of each
+ * epoch to decide whether to ship or drop it. Never blocks.
+ */
+bool
+RemoteAnalyzers::hasCredit()
+{
+    for (auto& node : nodes) {
+        // We are called under the monitor lock of the buffer manager, so
+        // don't wait for a sender that may be blocked waiting for a credit;
+        // the credits it has taken in so far will do.
+        std::unique_lock<std::mutex> lock(node->mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            poll(node.get(), 0);
+        }
+        if (node->credits.load() > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Choose the node to ship (all the buffers of) an epoch to: the one with the
+ * most credits, the epoch number breaking ties.
+ */
+int
+RemoteAnalyzers::assign(int epoch)
+{
+    int best = -1;
+    int bestCredits = -1;
+    int n = int(nodes.size());
+    for (int i = 0; i < n; i++) {
+        int k = (epoch + i) % n;
+        LOCK(nodes[k]->mutex);
+        poll(nodes[k].get(), 0);
+        if (nodes[k]->credits > bestCredits) {
+            best = k;
+            bestCredits = nodes[k]->credits;
+        }
+    }
+    return best;
+}
+
+/**
+ * Send the whole iovec array.
+ *
+ * \param flags
+ *      Flags for sendmsg(); with MSG_ZEROCOPY, the data must stay untouched
+ *      until the kernel reports the send complete (see poll()).
+ * \pre
+ *      The caller must hold the lock of \p node.
+ */
+bool
+RemoteAnalyzers::sendAll(Node* node, struct iovec* iov, int iovcnt, int flags)
+{
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = size_t(iovcnt);
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(node->fd, &msg, MSG_NOSIGNAL | flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((flags & MSG_ZEROCOPY) && (errno == ENOBUFS)) {
+                // Out of optmem for notifications; copy this time.
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            return false;
+        }
+        if (flags & MSG_ZEROCOPY) {
+            node->zerocopyCalls++;
+        }
+        node->sentBytes += uint64_t(sent);
+        while ((msg.msg_iovlen > 0) && (size_t(sent) >= msg.msg_iov->iov_len)) {
+            sent -= ssize_t(msg.msg_iov->iov_len);
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base =
+                    static_cast<char*>(msg.msg_iov->iov_base) + sent;
+            msg.msg_iov->iov_len -= size_t(sent);
+        }
+    }
+    return true;
+}
+
+/**
+ * Ship a closed event buffer to a node, waiting for a credit if needed. The
+ * buffer is owned by this class until it's returned by reclaim().
+ *
+ * \return
+ *      False if no credit came in time or the connection is gone; the
+ *      buffer is then still the caller's.
+ */
+bool
+RemoteAnalyzers::send(int nodeIndex, EventBuffer* logBuf, int64_t timeoutNs)
+{
+    Node* node = nodes[nodeIndex].get();
+    LOCK(node->mutex);
+    int64_t deadline = steadyClockNs() + timeoutNs;
+    while (node->credits == 0) {
+        int64_t now = steadyClockNs();
+        if ((now >= deadline) ||
+                !poll(node, int((deadline - now + 999999) / 1000000))) {
+            droppedBufs++;
+            return false;
+        }
+    }
+    int64_t expected = 0;
+    firstSendNs.compare_exchange_strong(expected, steadyClockNs());
+
+    bool ok;
+    if (node->codec && (logBuf->layout == EVENT_LAYOUT_64)) {
+        node->compressed.clear();
+        node->codec->compress(logBuf, &node->compressed);
+        FlightRecord record = FlightRecord::make(FlightRecord::COMPRESSED,
+                logBuf->epoch, logBuf->threadId, logBuf->layout,
+                logBuf->events, node->compressed.size());
+        struct iovec iov[2] = {{&record, sizeof(record)},
+                {node->compressed.data(), node->compressed.size()}};
+        ok = sendAll(node, iov, 2, 0);
+        node->done.push_back(logBuf);
+    } else {
+        // Send the events right out of the buffer. The record lives on the
+        // stack, so it must be copied.
+        FlightRecord record = FlightRecord::make(0, logBuf->epoch,
+                logBuf->threadId, logBuf->layout, logBuf->events,
+                size_t(logBuf->events) * EventBuffer::EVENT_SIZE);
+        struct iovec header = {&record, sizeof(record)};
+        std::vector<struct iovec> iov;
+        logBuf->forEachChunk([&iov](const uint64_t* events, int n) {
+            iov.push_back({const_cast<uint64_t*>(events),
+                    size_t(n) * EventBuffer::EVENT_SIZE});
+        });
+        uint32_t calls = node->zerocopyCalls;
+        ok = sendAll(node, &header, 1, MSG_MORE) && sendAll(node, iov.data(),
+                int(iov.size()), node->zerocopy ? MSG_ZEROCOPY : 0);
+        if (node->zerocopyCalls != calls) {
+            node->pending.push_back({node->zerocopyCalls - 1, logBuf});
+        } else {
+            node->done.push_back(logBuf);
+        }
+    }
+    if (!ok) {
+        // The buffer may be referenced by the kernel still; keep it.
+        droppedBufs++;
+        return true;
+    }
+    node->credits--;
+    node->outstanding++;
+    node->sentBufs++;
+    node->sentEvents += uint64_t(logBuf->events);
+    return true;
+}
+
+/**
+ * Tell a node that it has received all the buffers of an epoch.
+ */
+void
+RemoteAnalyzers::endEpoch(int nodeIndex, int epoch)
+{
+    Node* node = nodes[nodeIndex].get();
+    LOCK(node->mutex);
+    FlightRecord record = FlightRecord::make(FlightRecord::END_OF_EPOCH,
+            epoch, -1, EVENT_LAYOUT_64, 0, 0);
+    struct iovec iov = {&record, sizeof(record)};
+    sendAll(node, &iov, 1, 0);
+}
+
+/**
+ * Take back the buffers of a node that have been sent completely.
+ *
+ * \param timeoutNs
+ *      How long to wait for outstanding zerocopy sends to complete.
+ */
+void
+RemoteAnalyzers::reclaim(int nodeIndex, std::vector<EventBuffer*>* bufs,
+        int64_t timeoutNs)
+{
+    Node* node = nodes[nodeIndex].get();
+    LOCK(node->mutex);
+    int64_t deadline = steadyClockNs() + timeoutNs;
+    poll(node, 0);
+    while (!node->pending.empty() && (steadyClockNs() < deadline)) {
+        if (!poll(node, 1)) {
+            break;
+        }
+    }
+    bufs->insert(bufs->end(), node->done.begin(), node->done.end());
+    node->done.clear();
+}
+
+/**
+ * Wait until all nodes have analyzed all the buffers sent to them.
+ *
+ * \return
+ *      False on timeout.
+ */
+bool
+RemoteAnalyzers::drain(int64_t timeoutNs)
+{
+    int64_t deadline = steadyClockNs() + timeoutNs;
+    for (auto& node : nodes) {
+        LOCK(node->mutex);
+        while (node->outstanding > 0) {
+            int64_t now = steadyClockNs();
+            if ((now >= deadline) || !poll(node.get(),
+                    int((deadline - now + 999999) / 1000000))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void
+RemoteAnalyzers::printStats()
+{
+    uint64_t events = 0;
+    for (auto& node : nodes) {
+        LOCK(node->mutex);
+        printf("node %s, sentBufs %lu, sentEvents %lu, sentMB %.2f, "
+               "ackedEvents %lu, zerocopy %d, copiedSends %lu\n",
+                node->name.c_str(), node->sentBufs, node->sentEvents,
+                double(node->sentBytes) / (1 << 20), node->ackedEvents,
+                node->zerocopy, node->copiedSends);
+        events += node->ackedEvents;
+    }
+    double seconds = double(lastAckNs - firstSendNs) * 1e-9;
+    printf("analyzerNodes %lu, droppedBufs %lu, analyzedEvents %lu, "
+           "eventsPerSec %.2fM\n", nodes.size(), droppedBufs.load(), events,
+            (seconds > 0) ? double(events) / seconds * 1e-6 : 0.0);
+}
@@ -0,0 +1,147 @@
+#ifndef FASTLOG_REMOTEANALYZERS_H
+#define FASTLOG_REMOTEANALYZERS_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "EventCodec.h"
+
+struct EventBuffer;
+
+/**
+ * Message from an analyzer node to the application: the node is ready to
+ * take #credits more event buffers, and has analyzed #events more events.
+ * Nodes grant some credits upfront and one more per buffer analyzed.
+ */
+struct CreditMsg {
+    uint32_t credits;
+    uint32_t reserved;
+    uint64_t events;
+};
+
+/**
+ * TCP transport that ships the event buffers of completed epochs to a pool of
+ * analyzer nodes (FastLogAnalyzer --listen), so that analysis can scale out
+ * beyond the cores of one machine. Each buffer is sent as a FlightRecord
+ * followed by its events; an empty record with the END_OF_EPOCH flag marks
+ * the end of an epoch.
+ *
+ * - Each epoch goes to a single node (the one with the most credits), so
+ *   that nodes see whole epochs.
+ * - Raw events are sent right out of their segments with MSG_ZEROCOPY; the
+ *   buffers are recycled once the kernel reports the sends complete.
+ *   Compressed events (see EventCodec) are small and simply copied.
+ * - Credit-based flow control: a buffer is only sent to a node that has
+ *   granted a credit for it. When no node has any, the buffer manager drops
+ *   whole epochs instead of piling them up (see hasCredit()).
+ *
+ * Enabled by setting the environment variable FASTLOG_ANALYZER_NODES to a
+ * comma-separated list of host:port; FASTLOG_NET_COMPRESS=1 compresses the
+ * events.
+ *
+ * Thread-safe.
+ */
+class RemoteAnalyzers {
+  public:
+    RemoteAnalyzers();
+    ~RemoteAnalyzers();
+
+    RemoteAnalyzers(const RemoteAnalyzers&) = delete;
+    RemoteAnalyzers& operator=(const RemoteAnalyzers&) = delete;
+
+    /// True if event buffers are shipped to analyzer nodes.
+    bool
+    enabled() const
+    {
+        return !nodes.empty();
+    }
+
+    void connect(const std::string& nodeList, bool compressEvents);
+    bool hasCredit();
+    int assign(int epoch);
+    bool send(int node, EventBuffer* logBuf, int64_t timeoutNs);
+    void endEpoch(int node, int epoch);
+    void reclaim(int node, std::vector<EventBuffer*>* bufs,
+            int64_t timeoutNs = 0);
+    bool drain(int64_t timeoutNs);
+    void printStats();
+
+    /// How long to wait for a credit before giving up on a buffer.
+    static const int64_t CREDIT_TIMEOUT_NS = 100 * 1000000;
+
+  private:
+    /// Connection to one analyzer node.
+    struct Node {
+        Node();
+
+        /// Serializes all accesses to this node.
+        std::mutex mutex;
+
+        int fd;
+        std::string name;
+
+        /// # buffers the node is ready to take. Only updated with #mutex
+        /// held, but read without it by hasCredit().
+        std::atomic<int> credits;
+
+        /// # buffers sent whose credits haven't come back yet.
+        int outstanding;
+
+        /// True if MSG_ZEROCOPY is supported on this connection.
+        bool zerocopy;
+
+        /// # sendmsg() calls with MSG_ZEROCOPY so far, and # of them the
+        /// kernel has reported complete, counting only up to the first one
+        /// still in flight (i.e., sends [0, zerocopyDone) are all complete).
+        uint32_t zerocopyCalls;
+        uint32_t zerocopyDone;
+
+        /// Sends reported complete past #zerocopyDone, as ranges [first,
+        /// last] of send IDs. Completions may be reported out of order.
+        std::vector<std::pair<uint32_t, uint32_t>> zerocopyRanges;
+
+        /// Sent buffers waiting for their last zerocopy send to complete,
+        /// along with the ID of that send.
+        std::deque<std::pair<uint32_t, EventBuffer*>> pending;
+
+        /// Buffers that may be recycled.
+        std::vector<EventBuffer*> done;
+
+        /// Partial credit message received so far.
+        CreditMsg rx;
+        size_t rxBytes;
+
+        std::unique_ptr<EventCodec> codec;
+        std::vector<uint8_t> compressed;
+
+        /// Stats for printStats().
+        uint64_t sentBufs;
+        uint64_t sentEvents;
+        uint64_t sentBytes;
+        uint64_t ackedEvents;
+        uint64_t copiedSends;
+    };
+
+    bool poll(Node* node, int timeoutMs);
+    void completeZerocopy(Node* node, uint32_t first, uint32_t last);
+    bool sendAll(Node* node, struct iovec* iov, int iovcnt, int flags);
+
+    std::vector<std::unique_ptr<Node>> nodes;
+
+    /// Time (in steadyClockNs()) of the first send and of the last credit
+    /// received, to measure the end-to-end throughput.
+    std::atomic<int64_t> firstSendNs;
+    std::atomic<int64_t> lastAckNs;
+
+    /// # buffers that couldn't be sent (no credit or connection lost).
+    std::atomic<uint64_t> droppedBufs;
+};
+
+extern RemoteAnalyzers __remote_analyzers;
+
+#endif //FASTLOG_REMOTEANALYZERS_H
@@ -0,0 +1,162 @@
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "EventBuffer.h"
+#include "RuntimeStats.h"
+
+RuntimeStats::RuntimeStats()
+    : pagePath()
+    , page(NULL)
+{
+    const char* stats = std::getenv("FASTLOG_STATS");
+    if (stats && (std::string(stats) == "1")) {
+        init(defaultPath(getpid()).c_str());
+    } else if (stats && (stats[0] == '/')) {
+        init(stats);
+    }
+}
+
+/**
+ * Remove the stats page. The mapping itself stays until the process exits,
+ * since detached worker threads may still update it.
+ */
+RuntimeStats::~RuntimeStats()
+{
+    if (page) {
+        unlink(pagePath.c_str());
+    }
+}
+
+/**
+ * Create the stats page and start publishing the counters in it.
+ *
+ * \throw std::system_error
+ *      The page couldn't be created.
+ */
+void
+RuntimeStats::init(const char* path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(), path);
+    }
+    if (ftruncate(fd, sizeof(StatsPage)) != 0) {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::system_category(), path);
+    }
+    void* mem = mmap(NULL, sizeof(StatsPage), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);
+    if (mem == MAP_FAILED) {
+        throw std::system_error(error, std::system_category(), "mmap");
+    }
+
+    // The file is zero-filled, which is a valid initial state for all the
+    // counters.
+    StatsPage* newPage = static_cast<StatsPage*>(mem);
+    for (ThreadStats& thread : newPage->threads) {
+        thread.threadId = -1;
+    }
+    for (EpochStats& recent : newPage->recentEpochs) {
+        recent.epoch = -1;
+    }
+    newPage->appPid = getpid();
+    newPage->version = StatsPage::VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    newPage->magic = StatsPage::MAGIC;
+    pagePath = path;
+    page = newPage;
+}
+
+/**
+ * Record that a thread has switched to a new event buffer. Invoked by the
+ * thread itself.
+ *
+ * \param startNs
+ *      When the thread asked the buffer manager for the buffer.
+ * \param slowPath
+ *      True if it had to take the lock of the buffer manager.
+ */
+void
+RuntimeStats::bufferSwitched(int threadId, int64_t startNs, bool slowPath)
+{
+    ThreadStats* stats = thread(threadId);
+    if (stats == NULL) {
+        return;
+    }
+    stats->buffers.add(1);
+    if (slowPath) {
+        stats->slowPathHits.add(1);
+    }
+    stats->allocBufferNs.record(steadyClockNs() - startNs);
+}
+
+/**
+ * Record the end of an epoch in the ring of recent epochs. Invoked by the
+ * coordinator, under the monitor lock of the buffer manager.
+ *
+ * \param buffers
+ *      # event buffers allocated in the epoch.
+ */
+void
+RuntimeStats::epochEnded(int epoch, int64_t durationNs, int buffers)
+{
+    page->epoch.set(uint64_t(epoch + 1));
+    page->epochDurationNs.record(durationNs);
+    EpochStats* recent =
+            &page->recentEpochs[epoch % StatsPage::RECENT_EPOCHS];
+    recent->epoch.store(-1, std::memory_order_relaxed);
+    recent->durationNs.set(uint64_t(durationNs));
+    recent->buffers.set(uint64_t(buffers));
+    recent->events.set(0);
+    recent->epoch.store(epoch, std::memory_order_release);
+}
+
+/**
+ * Account for the events of an event buffer that is being recycled, in its
+ * thread and in its epoch (if still in the ring). Invoked under the monitor
+ * lock of the buffer manager.
+ *
+ * The events of a per-CPU buffer come from all the threads that ran on the
+ * CPU; worker threads attribute them as they decode the buffer instead (see
+ * threadEventsDecoded()).
+ */
+void
+RuntimeStats::bufferRecycled(const EventBuffer* buf)
+{
+    page->buffersInFlight.add(uint64_t(-1));
+    if (buf->epoch < 0) {
+        return;
+    }
+    EpochStats* recent =
+            &page->recentEpochs[buf->epoch % StatsPage::RECENT_EPOCHS];
+    if (recent->epoch.load(std::memory_order_relaxed) == buf->epoch) {
+        recent->events.add(uint64_t(buf->events));
+    }
+    if (buf->segmented) {
+        ThreadStats* stats = findThread(buf->threadId);
+        if (stats) {
+            stats->events.addShared(uint64_t(buf->events));
+        }
+    }
+}
+
+/**
+ * Account for a run of events of one thread in a per-CPU buffer, i.e., the
+ * events between two thread switch markers. Invoked by worker threads as
+ * they decode the buffer, possibly several at a time.
+ */
+void
+RuntimeStats::threadEventsDecoded(int threadId, uint64_t events)
+{
+    ThreadStats* stats = findThread(threadId);
+    if (stats) {
+        stats->events.addShared(events);
+    }
+}
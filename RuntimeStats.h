@@ -0,0 +1,266 @@
+#ifndef FASTLOG_RUNTIMESTATS_H
+#define FASTLOG_RUNTIMESTATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "Utils.h"
+
+struct EventBuffer;
+
+/// A counter that only one thread writes at a time (e.g., its owner, or
+/// whoever holds the monitor lock of the buffer manager), so it can be
+/// bumped without a locked instruction. Readers in other processes may see
+/// it a little behind.
+struct StatsCounter {
+    std::atomic<uint64_t> value;
+
+    void
+    add(uint64_t n)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+    }
+
+    /// add() for counters with several writers at a time.
+    void
+    addShared(uint64_t n)
+    {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void
+    set(uint64_t n)
+    {
+        value.store(n, std::memory_order_relaxed);
+    }
+
+    uint64_t
+    get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+/// Latency histogram with power-of-two buckets: bucket i counts the samples
+/// in [2^(i-1), 2^i) ns (bucket 0 counts 0 ns). Single writer, like
+/// StatsCounter.
+struct StatsHistogram {
+    static const int BUCKETS = 40;
+
+    StatsCounter counts[BUCKETS];
+
+    void
+    record(int64_t ns)
+    {
+        int bucket = (ns <= 0) ? 0 : 64 - __builtin_clzll(uint64_t(ns));
+        counts[(bucket < BUCKETS) ? bucket : BUCKETS - 1].add(1);
+    }
+
+    /// Upper bound (in ns) of the bucket holding the \p pct-th percentile
+    /// of the samples; 0 if there are none.
+    uint64_t
+    percentile(double pct) const
+    {
+        uint64_t total = 0;
+        for (const StatsCounter& c : counts) {
+            total += c.get();
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i].get();
+            if ((total > 0) && (double(seen) >= pct / 100.0 * double(total))) {
+                return uint64_t(1) << i;
+            }
+        }
+        return 0;
+    }
+};
+
+/// Counters of one application thread, written by the thread itself (except
+/// #events, which the buffer manager fills in as the thread's event buffers
+/// are recycled, and worker threads as they decode per-CPU buffers).
+struct CACHE_ALIGNED ThreadStats {
+    /// ID of the thread (see Context) that claimed the slot; -1 if the slot
+    /// was never used. Slots are never given back, so the counters of a
+    /// thread have no other writers.
+    std::atomic<int> threadId;
+
+    /// # event buffers the thread has switched to, i.e., # epochs it took
+    /// part in.
+    StatsCounter buffers;
+
+    /// # of those that took the slow path into the buffer manager (under its
+    /// lock) because no spare buffer had been armed for the thread.
+    StatsCounter slowPathHits;
+
+    /// # events logged in the thread's recycled event buffers. Events in
+    /// per-CPU buffers are only counted if a worker thread decodes them.
+    StatsCounter events;
+
+    /// Time spent in BufferManager::allocBuffer().
+    StatsHistogram allocBufferNs;
+};
+
+/// Summary of one epoch, in the ring of recent epochs.
+struct EpochStats {
+    std::atomic<int> epoch;
+    StatsCounter durationNs;
+
+    /// # event buffers of the epoch, and # events in those recycled so far.
+    StatsCounter buffers;
+    StatsCounter events;
+};
+
+/**
+ * Layout of the stats page, which other processes (see FastLogTop.cc) map
+ * read-only. Everything but the identification fields is updated in place
+ * with relaxed stores, so a reader may see a snapshot that is a little
+ * inconsistent (e.g., an epoch in the ring whose #events is still growing).
+ */
+struct StatsPage {
+    /// "FLST" in little-endian; identifies the page.
+    static const uint32_t MAGIC = 0x54534c46;
+
+    /// Bumped on incompatible changes to this layout.
+    static const uint32_t VERSION = 1;
+
+    /// # per-thread slots. A thread claims slot threadId % MAX_THREADS the
+    /// first time it's needed; if another thread got it first, the thread's
+    /// counters aren't published.
+    static const int MAX_THREADS = 256;
+
+    /// # entries in the ring of recent epochs.
+    static const int RECENT_EPOCHS = 64;
+
+    uint32_t magic;
+    uint32_t version;
+
+    /// Process ID of the application, so that readers can tell when it's
+    /// gone.
+    int32_t appPid;
+
+    /// Current epoch.
+    CACHE_ALIGNED StatsCounter epoch;
+
+    /// # epochs handed to worker threads (or forwarders/senders), and # of
+    /// those they haven't finished with yet.
+    StatsCounter handedOffEpochs;
+    StatsCounter workerQueueDepth;
+
+    /// # epochs no one processed because of too many active workers or no
+    /// credit from the analyzer nodes.
+    StatsCounter droppedEpochs;
+
+    /// # event buffers handed out and not recycled yet.
+    StatsCounter buffersInFlight;
+
+    /// Time spent by coordinators in BufferManager::tryIncEpoch(), and the
+    /// duration of epochs.
+    StatsHistogram tryIncEpochNs;
+    StatsHistogram epochDurationNs;
+
+    /// Recent epochs, indexed by epoch % RECENT_EPOCHS.
+    EpochStats recentEpochs[RECENT_EPOCHS];
+
+    ThreadStats threads[MAX_THREADS];
+};
+
+/**
+ * Publishes the counters of the logging runtime in a stats page mapped from
+ * a file in /dev/shm, for monitoring tools such as fastlog-top to read
+ * while the application runs. The counters are only updated on the slow
+ * paths of the runtime (epoch changes, event buffer switches), never per
+ * event.
+ *
+ * Enabled by setting the environment variable FASTLOG_STATS to 1 (page at
+ * /dev/shm/fastlog-<pid>.stats) or to the path of the page.
+ */
+class RuntimeStats {
+  public:
+    RuntimeStats();
+    ~RuntimeStats();
+
+    RuntimeStats(const RuntimeStats&) = delete;
+    RuntimeStats& operator=(const RuntimeStats&) = delete;
+
+    /// True if the runtime publishes its counters.
+    bool
+    enabled() const
+    {
+        return page != NULL;
+    }
+
+    /// Path of the stats page.
+    const std::string&
+    path() const
+    {
+        return pagePath;
+    }
+
+    /// The stats page; NULL if disabled.
+    StatsPage*
+    get()
+    {
+        return page;
+    }
+
+    /**
+     * Get the slot of the thread with the given ID, claiming it if it's
+     * still free.
+     *
+     * \return
+     *      The slot; NULL if another thread has claimed it.
+     */
+    ThreadStats*
+    thread(int threadId)
+    {
+        ThreadStats* stats = &page->threads[threadId % StatsPage::MAX_THREADS];
+        int owner = stats->threadId.load(std::memory_order_relaxed);
+        if ((owner < 0) && stats->threadId.compare_exchange_strong(owner,
+                threadId, std::memory_order_relaxed)) {
+            return stats;
+        }
+        return (owner == threadId) ? stats : NULL;
+    }
+
+    /**
+     * Get the slot of the thread with the given ID, without claiming it:
+     * for callers other than the thread itself.
+     *
+     * \return
+     *      The slot; NULL if the thread hasn't claimed it.
+     */
+    ThreadStats*
+    findThread(int threadId)
+    {
+        ThreadStats* stats = &page->threads[threadId % StatsPage::MAX_THREADS];
+        return (stats->threadId.load(std::memory_order_relaxed) == threadId) ?
+                stats : NULL;
+    }
+
+    void init(const char* path);
+    void bufferSwitched(int threadId, int64_t startNs, bool slowPath);
+    void epochEnded(int epoch, int64_t durationNs, int buffers);
+    void bufferRecycled(const EventBuffer* buf);
+    void threadEventsDecoded(int threadId, uint64_t events);
+
+    /// Where the stats page of process \p pid is by default.
+    static std::string
+    defaultPath(int pid)
+    {
+        return "/dev/shm/fastlog-" + std::to_string(pid) + ".stats";
+    }
+
+  private:
+    std::string pagePath;
+
+    /// NULL if disabled.
+    StatsPage* page;
+};
+
+/// Counters of the logging runtime, if published.
+extern RuntimeStats __runtime_stats;
+
+#endif //FASTLOG_RUNTIMESTATS_H
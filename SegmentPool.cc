@@ -0,0 +1,68 @@
+#include <new>
+#include <sys/mman.h>
+#include "SegmentPool.h"
+#include "SharedRegion.h"
+
+#define LOCK(x) std::lock_guard<std::mutex> _(x)
+
+/**
+ * Obtain a segment from the pool. Invoked by application threads on the slow
+ * path when the current segment of their event buffer is full.
+ *
+ * \return
+ *      An unused segment. Its pages may not have been faulted in yet.
+ */
+EventSegment*
+SegmentPool::alloc()
+{
+    LOCK(mutex);
+    if (freeSegments == NULL) {
+        // Reserve a new chunk of address space; physical memory is assigned
+        // lazily when the segments are written. Take it from the shared
+        // region, if any, so that the analyzer process can see the events;
+        // once the region is exhausted, fall back to private memory.
+        size_t chunkSize = size_t(EventSegment::SIZE) * SEGMENTS_PER_CHUNK;
+        char* chunk = NULL;
+        if (__shared_region.enabled()) {
+            chunk = static_cast<char*>(__shared_region.allocChunk(chunkSize));
+        }
+        if (chunk == NULL) {
+            chunk = static_cast<char*>(mmap(NULL, chunkSize,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+            if (chunk == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+        }
+        chunks.push_back(chunk);
+        for (int i = SEGMENTS_PER_CHUNK - 1; i >= 0; i--) {
+            EventSegment* segment = reinterpret_cast<EventSegment*>(
+                    chunk + size_t(i) * EventSegment::SIZE);
+            segment->next = freeSegments;
+            segment->faultedIn = false;
+            freeSegments = segment;
+        }
+    }
+
+    EventSegment* segment = freeSegments;
+    freeSegments = segment->next;
+    segment->next = NULL;
+    return segment;
+}
+
+/**
+ * Return a chain of segments to the pool.
+ *
+ * \param first
+ *      First segment of the chain.
+ * \param last
+ *      Last segment of the chain (reachable from \p first via
+ *      EventSegment::next).
+ */
+void
+SegmentPool::free(EventSegment* first, EventSegment* last)
+{
+    LOCK(mutex);
+    last->next = freeSegments;
+    freeSegments = first;
+}
@@ -0,0 +1,69 @@
+#ifndef FASTLOG_SEGMENTPOOL_H
+#define FASTLOG_SEGMENTPOOL_H
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "Utils.h"
+
+/// A fixed-size piece of storage for events. Event buffers managed by the
+/// buffer manager are chains of segments, so their memory footprint grows
+/// with the # events actually logged rather than their capacity.
+struct EventSegment {
+    /// # bytes of a segment, header included.
+    static const int SIZE = 256 * 1024;
+
+    /// # events a segment has room for.
+    static const int SLOTS = (SIZE - CACHE_LINE_SIZE) / 8;
+
+    /// Next segment in the same event buffer. NULL if this is the last one.
+    EventSegment* next;
+
+    /// Index (within the event buffer) of the first event in this segment.
+    int begin;
+
+    /// True once all pages of the segment have been touched (see
+    /// EventBuffer::prefault()), so it never needs to be prefaulted again.
+    bool faultedIn;
+
+    /// Storage used to hold events. Starts on its own cache line, away from
+    /// the header written by the segment pool.
+    alignas(CACHE_LINE_SIZE) uint64_t events[];
+};
+
+/**
+ * Pool of event segments shared by all event buffers. Memory is obtained from
+ * the OS in large chunks and never returned; segments of processed event
+ * buffers are recycled instead.
+ */
+class SegmentPool {
+  public:
+    explicit SegmentPool()
+        : mutex()
+        , freeSegments(NULL)
+        , chunks()
+    {}
+
+    EventSegment* alloc();
+    void free(EventSegment* first, EventSegment* last);
+
+  private:
+    /// Protects the pool. Segments are allocated once every SLOTS events or
+    /// so, so this lock is hardly contended.
+    std::mutex mutex;
+
+    /// Free segments, linked via EventSegment::next.
+    EventSegment* freeSegments;
+
+    /// Memory chunks segments are carved out of.
+    std::vector<void*> chunks;
+
+    /// # segments to carve out of each chunk requested from the OS.
+    static const int SEGMENTS_PER_CHUNK = 64;
+};
+
+/// The segment pool shared by all threads.
+extern SegmentPool __segment_pool;
+
+#endif //FASTLOG_SEGMENTPOOL_H
@@ -0,0 +1,290 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "EventBuffer.h"
+#include "SharedRegion.h"
+
+#define LOCK(x) std::lock_guard<std::mutex> _(x)
+
+extern char** environ;
+
+SharedRegion::SharedRegion()
+    : mutex()
+    , fd(-1)
+    , regionPath()
+    , header(NULL)
+    , allocatedBytes(0)
+    , inFlight()
+    , reclaimed(0)
+    , tail(0)
+    , stalled(false)
+    , broken(false)
+    , reclaimedBufs()
+    , publishedBufs(0)
+    , publishedEvents(0)
+    , droppedBufs(0)
+{
+    size_t bytes = size_t(getEnvInt("FASTLOG_SHM_MB", 0)) << 20;
+    if (bytes > 0) {
+        init(bytes);
+        const char* analyzer = std::getenv("FASTLOG_ANALYZER");
+        if (analyzer) {
+            spawnAnalyzer(analyzer);
+        }
+    }
+}
+
+/**
+ * Create the region. Event segments allocated from now on live in it.
+ *
+ * \param bytes
+ *      Size of the region. Physical memory is only assigned to the parts
+ *      that are written.
+ * \throw std::system_error
+ *      The region couldn't be created.
+ */
+void
+SharedRegion::init(size_t bytes)
+{
+    fd = int(memfd_create("fastlog", MFD_CLOEXEC));
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(), "memfd_create");
+    }
+    if (ftruncate(fd, off_t(bytes)) != 0) {
+        throw std::system_error(errno, std::system_category(), "ftruncate");
+    }
+    void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (mem == MAP_FAILED) {
+        throw std::system_error(errno, std::system_category(), "mmap");
+    }
+
+    header = new (mem) SharedRegionHeader();
+    header->magic = SharedRegionHeader::MAGIC;
+    header->version = SharedRegionHeader::VERSION;
+    header->size = bytes;
+    header->dataOffset = (sizeof(SharedRegionHeader) + 4095) & ~size_t(4095);
+    header->appBase = reinterpret_cast<uint64_t>(mem);
+    header->appPid = getpid();
+    header->tail = 0;
+    header->head = 0;
+    allocatedBytes = header->dataOffset;
+    regionPath = "/proc/" + std::to_string(getpid()) + "/fd/" +
+            std::to_string(fd);
+}
+
+/**
+ * Start an analyzer process, passing it the path of the region as its only
+ * argument.
+ *
+ * \throw std::system_error
+ *      The process couldn't be started.
+ */
+void
+SharedRegion::spawnAnalyzer(const char* executable)
+{
+    pid_t pid;
+    char* argv[] = {const_cast<char*>(executable),
+            const_cast<char*>(regionPath.c_str()), NULL};
+    int error = posix_spawn(&pid, executable, NULL, NULL, argv, environ);
+    if (error != 0) {
+        throw std::system_error(error, std::system_category(), executable);
+    }
+}
+
+/**
+ * Carve \p bytes out of the region. Invoked by the segment pool. Lock-free.
+ *
+ * \return
+ *      The memory; NULL if the region is exhausted.
+ */
+void*
+SharedRegion::allocChunk(size_t bytes)
+{
+    size_t offset = allocatedBytes.fetch_add(bytes);
+    if (offset + bytes > header->size) {
+        allocatedBytes.fetch_sub(bytes);
+        return NULL;
+    }
+    return reinterpret_cast<char*>(header) + offset;
+}
+
+/**
+ * Check if all the events of a (closed) buffer are in the region, i.e., the
+ * analyzer can see them. The segment pool falls back to private memory once
+ * the region is exhausted.
+ */
+bool
+SharedRegion::contains(const EventBuffer* logBuf) const
+{
+    if (!logBuf->segmented) {
+        return false;
+    }
+    const char* begin = reinterpret_cast<const char*>(header);
+    const char* end = begin + header->size;
+    for (EventSegment* seg = logBuf->firstSegment; seg; seg = seg->next) {
+        const char* p = reinterpret_cast<const char*>(seg);
+        if ((p < begin) || (p >= end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Hand a closed event buffer over to the analyzer, waiting for room in the
+ * ring if needed (unless the analyzer is known to be stalled). The buffer is
+ * owned by the region until it's returned by reclaim().
+ *
+ * \param[out] ticket
+ *      Position of the buffer in the ring; see waitForAnalyzer().
+ * \param timeoutNs
+ *      How long to wait for room in the ring.
+ * \return
+ *      False if the ring is still full after \p timeoutNs nanoseconds.
+ */
+bool
+SharedRegion::publish(EventBuffer* logBuf, int* ticket, int64_t timeoutNs)
+{
+    int64_t deadline = steadyClockNs() + timeoutNs;
+    while (true) {
+        int head;
+        {
+            LOCK(mutex);
+            head = collect();
+            if (broken) {
+                return false;
+            }
+            const uint32_t slots = SharedRegionHeader::RING_SLOTS;
+            if (uint32_t(tail) - uint32_t(reclaimed) < slots) {
+                uint32_t slot = uint32_t(tail) % slots;
+                SharedBufferDesc& desc = header->ring[slot];
+                desc.epoch = logBuf->epoch;
+                desc.threadId = logBuf->threadId;
+                desc.events = logBuf->events;
+                desc.layout = logBuf->layout;
+                desc.firstSegment =
+                        reinterpret_cast<uint64_t>(logBuf->firstSegment);
+                inFlight[slot] = logBuf;
+                *ticket = tail++;
+                header->tail.store(tail, std::memory_order_release);
+                futexWake(&header->tail, true);
+
+                publishedBufs++;
+                publishedEvents += uint64_t(logBuf->events);
+                return true;
+            }
+            if (stalled) {
+                return false;
+            }
+        }
+        int64_t now = steadyClockNs();
+        if (now >= deadline) {
+            stalled = true;
+            return false;
+        }
+        futexWait(&header->head, head, deadline - now, true);
+    }
+}
+
+/**
+ * Move the buffers the analyzer is done with to #reclaimedBufs. If the
+ * analyzer moved #head anywhere but within the buffers it was handed, it's
+ * considered broken: all the buffers are taken back, and none is published
+ * from then on.
+ *
+ * \pre
+ *      The caller must hold the lock.
+ * \return
+ *      Current #head (clamped to the buffers published).
+ */
+int
+SharedRegion::collect()
+{
+    int head = header->head.load(std::memory_order_acquire);
+    if (!broken && (uint32_t(head) - uint32_t(reclaimed) >
+            uint32_t(tail) - uint32_t(reclaimed))) {
+        fprintf(stderr, "Analyzer moved head to %d, outside of [%d, %d]; "
+                "not handing it any more buffers\n", head, reclaimed, tail);
+        broken = true;
+        stalled = true;
+    }
+    if (broken) {
+        head = tail;
+    } else if (head != reclaimed) {
+        stalled = false;
+    }
+    while (reclaimed != head) {
+        uint32_t slot = uint32_t(reclaimed) % SharedRegionHeader::RING_SLOTS;
+        reclaimedBufs.push_back(inFlight[slot]);
+        inFlight[slot] = NULL;
+        reclaimed++;
+    }
+    return head;
+}
+
+/**
+ * Take back the buffers the analyzer is done with.
+ *
+ * \param[out] bufs
+ *      Buffers reclaimed, to recycle.
+ */
+void
+SharedRegion::reclaim(std::vector<EventBuffer*>* bufs)
+{
+    LOCK(mutex);
+    collect();
+    bufs->insert(bufs->end(), reclaimedBufs.begin(), reclaimedBufs.end());
+    reclaimedBufs.clear();
+}
+
+/**
+ * Wait until the analyzer is done with the buffer published with the given
+ * ticket.
+ *
+ * \return
+ *      False if it's still not done after \p timeoutNs nanoseconds, or right
+ *      away if the analyzer is stalled.
+ */
+bool
+SharedRegion::waitForAnalyzer(int ticket, int64_t timeoutNs)
+{
+    int64_t deadline = steadyClockNs() + timeoutNs;
+    while (true) {
+        int head = header->head.load(std::memory_order_acquire);
+        if (int(uint32_t(head) - uint32_t(ticket)) > 0) {
+            return true;
+        }
+        int64_t now = steadyClockNs();
+        if (stalled || (now >= deadline)) {
+            stalled = true;
+            return false;
+        }
+        futexWait(&header->head, head, deadline - now, true);
+    }
+}
+
+/**
+ * Record a buffer that was recycled without being analyzed.
+ */
+void
+SharedRegion::countDropped()
+{
+    LOCK(mutex);
+    droppedBufs++;
+}
+
+void
+SharedRegion::printStats()
+{
+    LOCK(mutex);
+    printf("sharedBufs %lu, sharedEvents %lu, droppedBufs %lu, "
+           "analyzedBufs %d, sharedMB %.2f\n", publishedBufs, publishedEvents,
+            droppedBufs, header->head.load(),
+            double(allocatedBytes.load()) / (1 << 20));
+}
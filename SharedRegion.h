@@ -0,0 +1,174 @@
+#ifndef FASTLOG_SHAREDREGION_H
+#define FASTLOG_SHAREDREGION_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+struct EventBuffer;
+
+/// An event buffer handed over to the analyzer process. Its events are left
+/// in place, in the segments the application logged them into.
+struct SharedBufferDesc {
+    int32_t epoch;
+    int32_t threadId;
+    int32_t events;
+    uint8_t layout;
+
+    /// Address (in the application) of the first segment of the buffer.
+    uint64_t firstSegment;
+};
+
+/**
+ * Control block at the start of a shared region. The rest of the region is
+ * carved into event segments (see SegmentPool).
+ *
+ * Closed event buffers are passed to the analyzer through a ring of
+ * descriptors: the application publishes a buffer by filling in the slot at
+ * #tail and bumping #tail; the analyzer bumps #head once it is done with the
+ * buffer at #head, upon which the application may recycle it. Since #head
+ * only moves past a buffer after it has been analyzed, a restarted analyzer
+ * picks up where the previous one left off.
+ */
+struct SharedRegionHeader {
+    /// "FLSM" in little-endian; identifies the region.
+    static const uint32_t MAGIC = 0x4d534c46;
+
+    /// Bumped on incompatible changes to this header.
+    static const uint32_t VERSION = 1;
+
+    /// # descriptors in the ring.
+    static const int RING_SLOTS = 256;
+
+    uint32_t magic;
+    uint32_t version;
+
+    /// # bytes of the region, this header included.
+    uint64_t size;
+
+    /// Offset of the first event segment.
+    uint64_t dataOffset;
+
+    /// Address of the region in the application. Pointers stored in the
+    /// region (e.g., EventSegment::next) are relative to it.
+    uint64_t appBase;
+
+    /// Process ID of the application, so that the analyzer can tell when
+    /// it's gone.
+    int32_t appPid;
+
+    /// # buffers published by the application so far. Also the futex word
+    /// the analyzer sleeps on.
+    CACHE_ALIGNED std::atomic<int> tail;
+
+    /// # buffers the analyzer is done with so far. Also the futex word the
+    /// application sleeps on.
+    CACHE_ALIGNED std::atomic<int> head;
+
+    CACHE_ALIGNED SharedBufferDesc ring[RING_SLOTS];
+};
+
+/**
+ * Shared memory (memfd) backing the event segments of all event buffers, so
+ * that a separate analyzer process (see Analyzer.cc) can process closed
+ * epochs without any copying. Analysis then no longer competes with the
+ * application for its heap, caches and CPUs, and a crash of the analyzer
+ * doesn't take the application down with it.
+ *
+ * Enabled by setting the environment variable FASTLOG_SHM_MB to the size of
+ * the region; FASTLOG_ANALYZER names an analyzer executable to spawn. The
+ * analyzer attaches to the region through /proc/<pid>/fd (see path()).
+ */
+class SharedRegion {
+  public:
+    SharedRegion();
+
+    SharedRegion(const SharedRegion&) = delete;
+    SharedRegion& operator=(const SharedRegion&) = delete;
+
+    /// True if events are logged into shared memory.
+    bool
+    enabled() const
+    {
+        return header != NULL;
+    }
+
+    /// Path under which other processes can open the region.
+    const std::string&
+    path() const
+    {
+        return regionPath;
+    }
+
+    void init(size_t bytes);
+    void spawnAnalyzer(const char* executable);
+    void* allocChunk(size_t bytes);
+    bool contains(const EventBuffer* logBuf) const;
+    bool publish(EventBuffer* logBuf, int* ticket, int64_t timeoutNs);
+    void reclaim(std::vector<EventBuffer*>* bufs);
+    bool waitForAnalyzer(int ticket, int64_t timeoutNs);
+    void countDropped();
+    void printStats();
+
+    /// How long to wait for room in the ring (or for the analyzer to finish
+    /// a buffer) before giving up. Keeps a slow or dead analyzer from holding
+    /// the application's memory. Once given up, publish() and
+    /// waitForAnalyzer() don't wait anymore until the analyzer makes
+    /// progress.
+    static const int64_t HANDOFF_TIMEOUT_NS = 100 * 1000000;
+
+  private:
+    int collect();
+
+    /// Serializes publish() and reclaim(), i.e., forwarder threads.
+    std::mutex mutex;
+
+    /// memfd of the region; -1 if disabled.
+    int fd;
+
+    std::string regionPath;
+
+    /// The region, mapped at the same address for the lifetime of the
+    /// application. NULL if disabled.
+    SharedRegionHeader* header;
+
+    /// # bytes of the region handed out by allocChunk().
+    std::atomic<size_t> allocatedBytes;
+
+    /// Published buffers, indexed by ticket % RING_SLOTS.
+    EventBuffer* inFlight[SharedRegionHeader::RING_SLOTS];
+
+    /// Ticket of the next buffer to take back from the ring.
+    int reclaimed;
+
+    /// Ticket of the next buffer to publish. Same as #tail in the header,
+    /// which the analyzer could scribble on.
+    int tail;
+
+    /// Set once we gave up waiting on the analyzer; cleared once it moves
+    /// #head again. Until then, buffers that don't fit in the ring are
+    /// dropped right away.
+    std::atomic<bool> stalled;
+
+    /// Set once the analyzer moved #head outside of [#reclaimed, #tail]. It
+    /// isn't handed any buffer from then on.
+    bool broken;
+
+    /// Buffers taken back from the ring but not yet returned by reclaim().
+    std::vector<EventBuffer*> reclaimedBufs;
+
+    /// Stats for printStats().
+    uint64_t publishedBufs;
+    uint64_t publishedEvents;
+    uint64_t droppedBufs;
+};
+
+/// The region event segments are allocated from, if any.
+extern SharedRegion __shared_region;
+
+#endif //FASTLOG_SHAREDREGION_H
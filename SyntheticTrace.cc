@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include "EventBuffer.h"
+#include "LoggerConsts.h"
+#include "SyntheticTrace.h"
+#include "Utils.h"
+
+TraceProfile::TraceProfile()
+    : localityPct(int(getEnvInt("FASTLOG_GEN_LOCALITY", 90)))
+    , sharedPct(int(getEnvInt("FASTLOG_GEN_SHARED_PCT", 10)))
+    , readPct(int(getEnvInt("FASTLOG_GEN_READ_PCT", 70)))
+    , syncPerK(int(getEnvInt("FASTLOG_GEN_SYNC_PER_K", 2)))
+    , workingSetKB(int(std::min<int64_t>(MAX_WORKING_SET_KB,
+            std::max<int64_t>(0,
+                    getEnvInt("FASTLOG_GEN_WORKING_SET_KB", 1024)))))
+    , locations(std::max(1, int(getEnvInt("FASTLOG_GEN_LOCATIONS", 256))))
+{}
+
+std::string
+TraceProfile::toString() const
+{
+    char s[200];
+    snprintf(s, sizeof(s), "locality %d%%, shared %d%%, reads %d%%, "
+            "syncPerK %d, workingSetKB %d, locations %d", localityPct,
+            sharedPct, readPct, syncPerK, workingSetKB, locations);
+    return s;
+}
+
+/**
+ * Generate the template of a thread.
+ *
+ * \param threadId
+ *      Seeds the generator, so that threads don't log the exact same events.
+ */
+SyntheticTrace::SyntheticTrace(const TraceProfile& profile, int threadId)
+    : events(TEMPLATE_EVENTS)
+    , next(0)
+{
+    // All addresses are within one 4GB region, so that the 64-bit layout can
+    // keep them whole without address base markers: the private data of each
+    // thread, then the shared data, then the locks.
+    const uint64_t heap = 0x7f0000000000;
+    const uint64_t workingSet = std::max(uint64_t(64),
+            uint64_t(profile.workingSetKB) << 10);
+    const uint64_t shared = heap + workingSet * 64;
+    const uint64_t locks = shared + workingSet;
+    const uint64_t privateBase = heap + workingSet * uint64_t(threadId % 64);
+    const int LOCKS = 64;
+
+    // Each location walks its own stream of addresses with its own stride.
+    std::mt19937_64 rng(uint64_t(threadId) * 7919 + 1);
+    std::vector<uint64_t> offsets(profile.locations);
+    std::vector<uint64_t> strides(profile.locations);
+    for (int i = 0; i < profile.locations; i++) {
+        offsets[i] = (rng() % workingSet) & ~uint64_t(7);
+        strides[i] = uint64_t(8) << (rng() % 4);
+    }
+
+    uint64_t heldLock = 0;
+    int releaseAt = -1;
+    for (int i = 0; i < TEMPLATE_EVENTS; i++) {
+        uint64_t r = rng();
+        if (i == releaseAt) {
+            events[i] = encodeWord<EventLayout64>(0, TSAN_HDR_RELEASE, 0, 0,
+                    heldLock);
+            releaseAt = -1;
+            continue;
+        }
+        if ((releaseAt < 0) && (int(r % 1000) < profile.syncPerK)) {
+            // Short critical section of a few accesses.
+            heldLock = locks + ((r >> 10) % LOCKS) * 64;
+            releaseAt = i + 1 + int((r >> 20) % 16);
+            events[i] = encodeWord<EventLayout64>(0, TSAN_HDR_ACQUIRE, 0, 0,
+                    heldLock);
+            continue;
+        }
+
+        int loc = int((r >> 10) % uint64_t(profile.locations));
+        if (int((r >> 30) % 100) < profile.localityPct) {
+            offsets[loc] = (offsets[loc] + strides[loc]) % workingSet;
+        } else {
+            offsets[loc] = ((r >> 32) % workingSet) & ~uint64_t(7);
+        }
+        bool isShared = int((r >> 40) % 100) < profile.sharedPct;
+        bool isRead = int((r >> 50) % 100) < profile.readPct;
+        uint64_t addr = (isShared ? shared : privateBase) + offsets[loc];
+        events[i] = encodeWord<EventLayout64>(0,
+                isRead ? TSAN_HDR_READ8 : TSAN_HDR_WRITE8, 1000 + loc,
+                uint64_t(i), addr);
+    }
+}
+
+/**
+ * Copy the next \p n events of the template to \p dst, wrapping around.
+ */
+void
+SyntheticTrace::copy(uint64_t* dst, int n)
+{
+    while (n > 0) {
+        int count = std::min(n, TEMPLATE_EVENTS - next);
+        std::memcpy(dst, &events[next], size_t(count) * sizeof(uint64_t));
+        dst += count;
+        n -= count;
+        next = (next + count) % TEMPLATE_EVENTS;
+    }
+}
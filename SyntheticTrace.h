@@ -0,0 +1,73 @@
+#ifndef FASTLOG_SYNTHETICTRACE_H
+#define FASTLOG_SYNTHETICTRACE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Knobs of the event mix produced by SyntheticTrace. Each can be set via the
+ * environment variable in its comment.
+ */
+struct TraceProfile {
+    TraceProfile();
+
+    std::string toString() const;
+
+    /// % memory accesses that continue the address stream of their location
+    /// (sequential or strided); the others jump to a random address in the
+    /// working set. FASTLOG_GEN_LOCALITY.
+    int localityPct;
+
+    /// % memory accesses to addresses shared by all threads.
+    /// FASTLOG_GEN_SHARED_PCT.
+    int sharedPct;
+
+    /// % memory accesses that are reads. FASTLOG_GEN_READ_PCT.
+    int readPct;
+
+    /// # lock acquire/release pairs per 1000 events. FASTLOG_GEN_SYNC_PER_K.
+    int syncPerK;
+
+    /// Size of the working set of each thread, and of the data shared by all
+    /// threads, in KB. FASTLOG_GEN_WORKING_SET_KB, at most
+    /// MAX_WORKING_SET_KB.
+    int workingSetKB;
+
+    /// Largest working set for which the data of 64 threads, the shared data
+    /// and the locks (see SyntheticTrace()) still fit in one 4GB region.
+    static const int MAX_WORKING_SET_KB =
+            int((((uint64_t(1) << 32) - 4096) / 65) >> 10);
+
+    /// # distinct locations (i.e., instrumented instructions).
+    /// FASTLOG_GEN_LOCATIONS.
+    int locations;
+};
+
+/**
+ * Generator of realistic streams of 64-bit events for one thread, to drive
+ * the consumer side (worker threads, archive, analyzers) without building
+ * instrumented programs.
+ *
+ * The events are generated upfront into a template of TEMPLATE_EVENTS events
+ * that copy() then hands out over and over, so that producing events costs
+ * about as much as a memcpy() and the consumers are the bottleneck.
+ */
+class SyntheticTrace {
+  public:
+    SyntheticTrace(const TraceProfile& profile, int threadId);
+
+    void copy(uint64_t* dst, int n);
+
+    /// # events in the template.
+    static const int TEMPLATE_EVENTS = 1 << 20;
+
+  private:
+    /// Events cycled through by copy().
+    std::vector<uint64_t> events;
+
+    /// Index of the next template event to copy.
+    int next;
+};
+
+#endif //FASTLOG_SYNTHETICTRACE_H
@@ -1,11 +1,70 @@
 #ifndef FASTLOG_UTILS_H
 #define FASTLOG_UTILS_H
 
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <linux/futex.h>
+#include <new>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #define LIKELY(x)     __builtin_expect(!!(x), 1)
 #define UNLIKELY(x)   __builtin_expect(!!(x), 0)
 
+#define CACHE_LINE_SIZE 64
+
+/// Start a new cache line, to keep data written by different threads apart
+/// (e.g., the owner of an event buffer vs. the buffer manager). Building with
+/// FASTLOG_PACKED_LAYOUT turns this off to measure what false sharing costs.
+#ifdef FASTLOG_PACKED_LAYOUT
+#define CACHE_ALIGNED
+#define PAGE_ALIGNED
+#else
+#define CACHE_ALIGNED alignas(CACHE_LINE_SIZE)
+#define PAGE_ALIGNED alignas(4096)
+#endif
+
+/**
+ * Allocate memory for objects of an over-aligned type (e.g., with fields on
+ * cache lines of their own). Neither operator new nor std::allocator honors
+ * over-alignment in C++11, so such objects must be constructed in memory
+ * from here with placement new.
+ *
+ * \param bytes
+ *      Size of the allocation.
+ * \param alignment
+ *      Alignment of the allocation; a power of two multiple of
+ *      sizeof(void*).
+ * \return
+ *      The memory, to be released with alignedFree().
+ * \throw std::bad_alloc
+ *      Out of memory.
+ */
+inline void*
+alignedAlloc(size_t bytes, size_t alignment = CACHE_LINE_SIZE)
+{
+    void* mem;
+    if (posix_memalign(&mem, alignment, bytes) != 0) {
+        throw std::bad_alloc();
+    }
+    return mem;
+}
+
+/**
+ * Release memory allocated with alignedAlloc(); NULL is ignored.
+ */
+inline void
+alignedFree(void* mem)
+{
+    std::free(mem);
+}
+
 inline void
 escape(void* p)
 {
@@ -26,4 +85,89 @@ rdtsc()
     return (((uint64_t)hi << 32) | lo);
 }
 
+/**
+ * Copy \p n 64-bit words to \p dst with non-temporal stores (MOVNTI), which
+ * go through the write-combining buffers straight to memory instead of
+ * evicting useful cache lines. Written in assembly so that it can be used
+ * from code compiled with target("no-sse").
+ *
+ * Non-temporal stores are weakly ordered; call storeFence() before handing
+ * \p dst over to another thread.
+ */
+inline void
+streamStore(uint64_t* dst, const uint64_t* src, int n)
+{
+    for (int i = 0; i < n; i++) {
+        asm volatile("movnti %1, %0" : "=m" (dst[i]) : "r" (src[i]));
+    }
+}
+
+inline void
+storeFence()
+{
+    asm volatile("sfence" : : : "memory");
+}
+
+/**
+ * Wall-clock time in nanoseconds, from a monotonic clock. Unlike rdtsc(), no
+ * calibration is needed to convert it to real time.
+ */
+inline int64_t
+steadyClockNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Read an integer from an environment variable.
+ *
+ * \return
+ *      Value of the variable; \p defaultValue if it's not set.
+ */
+inline int64_t
+getEnvInt(const char* name, int64_t defaultValue)
+{
+    const char* value = std::getenv(name);
+    return value ? std::strtoll(value, NULL, 10) : defaultValue;
+}
+
+/**
+ * Block the calling thread until another thread calls futexWake() on the same
+ * word, unless the word no longer holds the expected value. May return
+ * spuriously, so callers must re-check their wait condition.
+ *
+ * \param timeoutNs
+ *      Give up after this many nanoseconds. Negative means wait forever.
+ * \param shared
+ *      True if the word is in memory shared with other processes.
+ * \return
+ *      False if the wait timed out; true otherwise.
+ */
+inline bool
+futexWait(std::atomic<int>* word, int expected, int64_t timeoutNs = -1,
+        bool shared = false)
+{
+    struct timespec timeout;
+    timeout.tv_sec = timeoutNs / 1000000000;
+    timeout.tv_nsec = timeoutNs % 1000000000;
+    long ret = syscall(SYS_futex, reinterpret_cast<int*>(word),
+            shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, expected,
+            (timeoutNs < 0) ? NULL : &timeout, NULL, 0);
+    return (ret == 0) || (errno != ETIMEDOUT);
+}
+
+/**
+ * Wake up all threads blocked in futexWait() on the given word.
+ *
+ * \param shared
+ *      True if the word is in memory shared with other processes.
+ */
+inline void
+futexWake(std::atomic<int>* word, bool shared = false)
+{
+    syscall(SYS_futex, reinterpret_cast<int*>(word),
+            shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
 #endif //FASTLOG_UTILS_H
@@ -1,26 +1,265 @@
 #ifndef FASTLOG_WORKER_H
 #define FASTLOG_WORKER_H
 
+#include <memory>
 #include <vector>
 #include "BufferManager.h"
+#include "EpochArchive.h"
+#include "EventDecoder.h"
+#include "LoggerConsts.h"
+#include "RemoteAnalyzers.h"
+#include "RuntimeStats.h"
+#include "SharedRegion.h"
 
+/**
+ * Main loop of a worker thread that processes the event buffers of one epoch.
+ * Buffers are processed in the order they are closed, as soon as they are
+ * closed, so the worker doesn't have to wait for the slowest thread to finish
+ * the epoch before it can start.
+ *
+ * \param bufferManager
+ *      Buffer manager to return the event buffers to.
+ * \param buffers
+ *      Event buffers allocated in the epoch.
+ * \param queue
+ *      Queue the event buffers will be pushed onto as they are closed.
+ */
 static void
-workerMain(BufferManager* bufferManager, std::vector<EventBuffer*> buffers)
+workerMain(BufferManager* bufferManager, std::vector<EventBuffer*> buffers,
+        ClosedBufferQueue* queue)
 {
-    // Wait until all buffers are safe to read.
-    for (auto buf : buffers) {
-        while (!buf->closed) {}
-    }
-
-    // TODO: dummy workers simply count the number of events.
+    // TODO: dummy workers simply decode the events and count memory accesses.
     int events = 0;
-    for (auto buf : buffers) {
-        events += buf->events;
+    int accesses = 0;
+    EventDecoder decoder;
+
+    // Compress the buffers into the archive, if any, and recycle them right
+    // away rather than at the end of the epoch.
+    bool archiving = __epoch_archive.enabled();
+    std::unique_ptr<EventCodec> codec(archiving ? new EventCodec() : NULL);
+    ArchivedEpoch archived(buffers.empty() ? -1 : buffers[0]->epoch);
+
+    size_t processed = 0;
+    while (processed < buffers.size()) {
+        int closed = queue->closedBufs;
+        size_t batch;
+        EventBuffer* buf = queue->popAll(&batch);
+        if (buf == NULL) {
+            // Sleep until the next buffer is closed. Don't let idle threads
+            // hold the epoch open forever though.
+            if (!queue->waitForMore(closed,
+                    BufferManager::REVOKE_TIMEOUT_NS)) {
+                bufferManager->revokeIdleBuffers();
+            }
+            continue;
+        }
+        if (processed + batch == buffers.size()) {
+            // The last buffer of the epoch has been closed: the transition
+            // is over, however long processing the batch takes.
+            queue->allClosedTime = rdtsc();
+        }
+
+        int64_t startNs = steadyClockNs();
+        while (buf != NULL) {
+            // Upper address bits of the memory accesses that follow; markers
+            // are logged into every buffer that needs them.
+            uint64_t addrBase = 0;
+            bool truncated = (buf->layout != EVENT_LAYOUT_128);
+
+            // The events of a per-CPU buffer come in runs of one thread,
+            // each one after a thread switch marker; attribute them here
+            // rather than under the lock of the buffer manager.
+            bool attributing = __runtime_stats.enabled() && !buf->segmented;
+            int runThread = -1;
+            int runStart = events;
+            decoder.decode(buf, [&](const EventColumns& c) {
+                int base = events;
+                events += c.size;
+                for (int i = 0; i < c.size; i++) {
+                    if (c.header[i] == TSAN_HDR_ADDR_BASE) {
+                        addrBase = c.addr[i];
+                    } else if (c.header[i] & TSAN_HDR_MEM_ACCESS) {
+                        accesses++;
+                        // TODO: hand the access to the actual analysis.
+                        uint64_t addr = truncated ?
+                                rebuildAddr(addrBase, c.addr[i]) : c.addr[i];
+                        (void) addr;
+                    } else if (attributing &&
+                            (c.header[i] == TSAN_HDR_THREAD_SWITCH)) {
+                        if (runThread >= 0) {
+                            __runtime_stats.threadEventsDecoded(runThread,
+                                    uint64_t(base + i - runStart));
+                        }
+                        runThread = int(c.addr[i]);
+                        runStart = base + i + 1;
+                    }
+                }
+            });
+            if (attributing && (runThread >= 0)) {
+                __runtime_stats.threadEventsDecoded(runThread,
+                        uint64_t(events - runStart));
+            }
+            processed++;
+
+            EventBuffer* next = buf->nextClosed;
+            if (archiving) {
+                EpochArchive::archive(buf, codec.get(), &archived);
+                bufferManager->recycleClosed(buf);
+            }
+            buf = next;
+        }
+        queue->busyNs += steadyClockNs() - startNs;
     }
-    printf("Worker thread processed %d events\n", events);
+    queue->processedEvents = uint64_t(events);
+    printf("Worker thread processed %d events (%d memory accesses)\n", events,
+            accesses);
 
     // Return buffers back to the manager.
-    bufferManager->release(&buffers);
+    if (archiving) {
+        __epoch_archive.add(&archived);
+        buffers.clear();
+    }
+    bufferManager->release(&buffers, queue);
+}
+
+/**
+ * Main loop of a forwarder thread, which stands in for the worker thread of
+ * an epoch when the analysis is done out of process: it hands the event
+ * buffers over to the analyzer through the shared region as they are closed,
+ * and recycles them once the analyzer is done with them. Buffers the analyzer
+ * can't see, or doesn't make room for in time, are recycled unanalyzed.
+ *
+ * \param bufferManager
+ *      Buffer manager to return the event buffers to.
+ * \param buffers
+ *      Event buffers allocated in the epoch.
+ * \param queue
+ *      Queue the event buffers will be pushed onto as they are closed.
+ */
+static void
+forwarderMain(BufferManager* bufferManager, std::vector<EventBuffer*> buffers,
+        ClosedBufferQueue* queue)
+{
+    std::vector<EventBuffer*> done;
+    auto recycleDone = [&]() {
+        __shared_region.reclaim(&done);
+        for (EventBuffer* buf : done) {
+            bufferManager->recycleClosed(buf);
+        }
+        done.clear();
+    };
+
+    size_t processed = 0;
+    bool published = false;
+    int lastTicket = 0;
+    while (processed < buffers.size()) {
+        int closed = queue->closedBufs;
+        size_t batch;
+        EventBuffer* buf = queue->popAll(&batch);
+        if (buf == NULL) {
+            if (!queue->waitForMore(closed,
+                    BufferManager::REVOKE_TIMEOUT_NS)) {
+                bufferManager->revokeIdleBuffers();
+            }
+            continue;
+        }
+        if (processed + batch == buffers.size()) {
+            // The transition is over; see workerMain().
+            queue->allClosedTime = rdtsc();
+        }
+
+        while (buf != NULL) {
+            EventBuffer* next = buf->nextClosed;
+            int ticket;
+            if (__shared_region.contains(buf) && __shared_region.publish(buf,
+                    &ticket, SharedRegion::HANDOFF_TIMEOUT_NS)) {
+                published = true;
+                lastTicket = ticket;
+            } else {
+                __shared_region.countDropped();
+                bufferManager->recycleClosed(buf);
+            }
+            processed++;
+            buf = next;
+        }
+        recycleDone();
+    }
+
+    // Give the analyzer a chance to finish the epoch so that its buffers are
+    // recycled right away; otherwise, some later forwarder will do it.
+    if (published) {
+        __shared_region.waitForAnalyzer(lastTicket,
+                SharedRegion::HANDOFF_TIMEOUT_NS);
+    }
+    recycleDone();
+    buffers.clear();
+    bufferManager->release(&buffers, queue);
+}
+
+/**
+ * Main loop of a sender thread, which stands in for the worker thread of an
+ * epoch when the analysis is done by remote analyzer nodes: it ships the event
+ * buffers to the node assigned to the epoch as they are closed, and recycles
+ * them once sent. Buffers the node doesn't grant a credit for in time are
+ * recycled unanalyzed.
+ *
+ * \param bufferManager
+ *      Buffer manager to return the event buffers to.
+ * \param buffers
+ *      Event buffers allocated in the epoch.
+ * \param queue
+ *      Queue the event buffers will be pushed onto as they are closed.
+ */
+static void
+senderMain(BufferManager* bufferManager, std::vector<EventBuffer*> buffers,
+        ClosedBufferQueue* queue)
+{
+    int epoch = buffers.empty() ? -1 : buffers[0]->epoch;
+    int node = __remote_analyzers.assign(epoch);
+    std::vector<EventBuffer*> done;
+    auto recycleDone = [&](int64_t timeoutNs) {
+        __remote_analyzers.reclaim(node, &done, timeoutNs);
+        for (EventBuffer* buf : done) {
+            bufferManager->recycleClosed(buf);
+        }
+        done.clear();
+    };
+
+    size_t processed = 0;
+    while (processed < buffers.size()) {
+        int closed = queue->closedBufs;
+        size_t batch;
+        EventBuffer* buf = queue->popAll(&batch);
+        if (buf == NULL) {
+            if (!queue->waitForMore(closed,
+                    BufferManager::REVOKE_TIMEOUT_NS)) {
+                bufferManager->revokeIdleBuffers();
+            }
+            continue;
+        }
+        if (processed + batch == buffers.size()) {
+            // The transition is over; see workerMain().
+            queue->allClosedTime = rdtsc();
+        }
+
+        while (buf != NULL) {
+            EventBuffer* next = buf->nextClosed;
+            if (!__remote_analyzers.send(node, buf,
+                    RemoteAnalyzers::CREDIT_TIMEOUT_NS)) {
+                bufferManager->recycleClosed(buf);
+            }
+            processed++;
+            buf = next;
+        }
+        recycleDone(0);
+    }
+
+    // Give the last zerocopy sends a chance to complete so that the buffers
+    // are recycled right away; otherwise, some later sender will do it.
+    __remote_analyzers.endEpoch(node, epoch);
+    recycleDone(RemoteAnalyzers::CREDIT_TIMEOUT_NS);
+    buffers.clear();
+    bufferManager->release(&buffers, queue);
 }
 
 #endif //FASTLOG_WORKER_H
@@ -0,0 +1,376 @@
+#ifndef FASTLOG_WORKLOADS_H
+#define FASTLOG_WORKLOADS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+// Multi-threaded workloads to run the logging experiments against, besides
+// the original one (each thread writing its own slice of the array from
+// beginning to end), which is the best case for logging: no contention, no
+// sharing, perfect locality. Each workload is a template over a logger that
+// exposes `write8(pc, addr, val)`, `read8(pc, addr, val)` and `block(func)`
+// (see the Logger class in LoggerPolicies.h and the adapters in Main.cc), so
+// that it can drive every logging variant. block() runs a call that may
+// block, such as locking a contended mutex, outside of the logger's fast path
+// (see Context::inFastPath).
+
+/// Workload of an experiment; set via the environment variable
+/// FASTLOG_WORKLOAD (see workloadFromString()).
+enum Workload {
+    /// Each thread writes its own slice of the array sequentially.
+    DISJOINT_WRITES,
+
+    /// Threads increment a counter protected by a mutex.
+    SHARED_COUNTER,
+
+    /// Threads pass items through a bounded queue protected by a mutex;
+    /// even threads mostly produce and odd threads mostly consume.
+    PRODUCER_CONSUMER,
+
+    /// Threads look up (80%) and update (20%) random keys in a hash map with
+    /// striped locks.
+    HASH_MAP,
+
+    /// Each thread follows a random cycle of pointers through its slice of
+    /// the array.
+    POINTER_CHASE,
+
+    /// Threads read or write (50/50) random elements of the whole array.
+    RANDOM_RW,
+
+    /// Like RANDOM_RW, but 95% reads.
+    READ_MOSTLY,
+
+    INVALID_WORKLOAD,
+};
+
+inline const char*
+workloadToString(Workload workload)
+{
+    switch (workload) {
+    case DISJOINT_WRITES:       return "DISJOINT_WRITES";
+    case SHARED_COUNTER:        return "SHARED_COUNTER";
+    case PRODUCER_CONSUMER:     return "PRODUCER_CONSUMER";
+    case HASH_MAP:              return "HASH_MAP";
+    case POINTER_CHASE:         return "POINTER_CHASE";
+    case RANDOM_RW:             return "RANDOM_RW";
+    case READ_MOSTLY:           return "READ_MOSTLY";
+    default:                    return "INVALID_WORKLOAD";
+    }
+}
+
+/**
+ * Parse the name of a workload (case-sensitive, as printed by
+ * workloadToString()) or its number.
+ *
+ * \return
+ *      INVALID_WORKLOAD if there's no such workload.
+ */
+inline Workload
+workloadFromString(const std::string& name)
+{
+    for (int i = 0; i < INVALID_WORKLOAD; i++) {
+        if ((name == workloadToString(Workload(i))) ||
+                (name == std::to_string(i))) {
+            return Workload(i);
+        }
+    }
+    return INVALID_WORKLOAD;
+}
+
+/**
+ * Data shared by the threads running a workload, set up by init() before the
+ * threads start.
+ */
+struct WorkloadState {
+    /// # slots in the producer/consumer queue.
+    static const int QUEUE_SLOTS = 1024;
+
+    /// # buckets of the hash map, and # locks guarding them.
+    static const int MAP_BUCKETS = 1 << 16;
+    static const int MAP_STRIPES = 64;
+
+    struct alignas(CACHE_LINE_SIZE) Stripe {
+        std::mutex mutex;
+    };
+
+    struct Bucket {
+        int64_t key;
+        int64_t value;
+    };
+
+    WorkloadState()
+        : workload(DISJOINT_WRITES)
+        , array(NULL)
+        , length(0)
+        , totalLength(0)
+        , counterMutex()
+        , counter(0)
+        , queueMutex()
+        , queueHead(0)
+        , queueTail(0)
+        , queue()
+        , stripes()
+        , buckets()
+    {}
+
+    /**
+     * \param array
+     *      Array of \p numThreads slices of \p length elements, which the
+     *      array-based workloads run on.
+     */
+    void
+    init(Workload workload, int64_t* array, int numThreads, int length)
+    {
+        this->workload = workload;
+        this->array = array;
+        this->length = length;
+        totalLength = int64_t(numThreads) * length;
+        if (workload == POINTER_CHASE) {
+            // One random cycle per slice, of indices within the slice.
+            std::vector<int> order(length);
+            std::mt19937_64 rng(length);
+            for (int t = 0; t < numThreads; t++) {
+                for (int i = 0; i < length; i++) {
+                    order[i] = i;
+                }
+                std::shuffle(order.begin(), order.end(), rng);
+                int64_t* slice = array + int64_t(t) * length;
+                for (int i = 0; i < length; i++) {
+                    slice[order[i]] = order[(i + 1) % length];
+                }
+            }
+        }
+        if (workload == HASH_MAP) {
+            buckets.assign(MAP_BUCKETS, Bucket{-1, 0});
+        }
+    }
+
+    Workload workload;
+    int64_t* array;
+
+    /// # elements of each thread's slice, and of the whole array.
+    int length;
+    int64_t totalLength;
+
+    std::mutex counterMutex;
+    int64_t counter;
+
+    std::mutex queueMutex;
+    int64_t queueHead;
+    int64_t queueTail;
+    int64_t queue[QUEUE_SLOTS];
+
+    Stripe stripes[MAP_STRIPES];
+    std::vector<Bucket> buckets;
+};
+
+/// Small, fast PRNG for the workloads (xorshift64*).
+struct WorkloadRng {
+    uint64_t state;
+
+    explicit WorkloadRng(uint64_t seed)
+        : state(seed * 0x9e3779b97f4a7c15 + 1)
+    {}
+
+    __attribute__((always_inline))
+    uint64_t
+    next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1d;
+    }
+};
+
+/// Racy, but well-defined, plain loads and stores of shared data.
+__attribute__((always_inline))
+inline int64_t
+loadRelaxed(int64_t* addr)
+{
+    return __atomic_load_n(addr, __ATOMIC_RELAXED);
+}
+
+__attribute__((always_inline))
+inline void
+storeRelaxed(int64_t* addr, int64_t val)
+{
+    __atomic_store_n(addr, val, __ATOMIC_RELAXED);
+}
+
+/**
+ * Lock \p mutex; if it's contended, wait for it outside of the fast path of
+ * \p log. Use with `std::lock_guard<std::mutex>(*mutex, std::adopt_lock)`.
+ */
+template <typename Log>
+inline void
+lockOutsideFastPath(Log* log, std::mutex* mutex)
+{
+    if (!mutex->try_lock()) {
+        log->block([mutex]() { mutex->lock(); });
+    }
+}
+
+template <typename Log>
+void
+runSharedCounter(Log* log, WorkloadState* state, int accesses)
+{
+    for (int i = 0; i < accesses; i += 2) {
+        lockOutsideFastPath(log, &state->counterMutex);
+        std::lock_guard<std::mutex> _(state->counterMutex, std::adopt_lock);
+        int64_t val = state->counter;
+        log->read8(__LINE__, &state->counter, val);
+        log->write8(__LINE__, &state->counter, val + 1);
+        state->counter = val + 1;
+    }
+}
+
+template <typename Log>
+void
+runProducerConsumer(Log* log, WorkloadState* state, int tid, int accesses)
+{
+    // Threads fall back to the other role when the queue is full (or empty)
+    // rather than block, so that they never wait for each other forever.
+    bool producer = (tid % 2 == 0);
+    for (int i = 0; i < accesses; i += 2) {
+        lockOutsideFastPath(log, &state->queueMutex);
+        std::lock_guard<std::mutex> _(state->queueMutex, std::adopt_lock);
+        bool full = state->queueTail - state->queueHead ==
+                WorkloadState::QUEUE_SLOTS;
+        bool empty = state->queueTail == state->queueHead;
+        if ((producer && !full) || empty) {
+            int64_t* slot = &state->queue[state->queueTail %
+                    WorkloadState::QUEUE_SLOTS];
+            log->write8(__LINE__, slot, i);
+            *slot = i;
+            log->write8(__LINE__, &state->queueTail, state->queueTail + 1);
+            state->queueTail++;
+        } else {
+            int64_t* slot = &state->queue[state->queueHead %
+                    WorkloadState::QUEUE_SLOTS];
+            log->read8(__LINE__, slot, *slot);
+            escape(slot);
+            log->write8(__LINE__, &state->queueHead, state->queueHead + 1);
+            state->queueHead++;
+        }
+    }
+}
+
+template <typename Log>
+void
+runHashMap(Log* log, WorkloadState* state, WorkloadRng* rng, int accesses)
+{
+    const int mask = WorkloadState::MAP_BUCKETS - 1;
+    int i = 0;
+    while (i < accesses) {
+        uint64_t r = rng->next();
+        // Keys fill about half of the buckets.
+        int64_t key = int64_t((r >> 16) % (WorkloadState::MAP_BUCKETS / 2));
+        bool update = (r % 100) < 20;
+        int bucket = int((uint64_t(key) * 0x9e3779b97f4a7c15) >> 48) & mask;
+        std::mutex* mutex =
+                &state->stripes[bucket % WorkloadState::MAP_STRIPES].mutex;
+        lockOutsideFastPath(log, mutex);
+        std::lock_guard<std::mutex> _(*mutex, std::adopt_lock);
+        // Linear probing. Probes may run into buckets of other stripes, but
+        // keys only ever change from empty, so at worst a key ends up in the
+        // map twice, which doesn't matter here.
+        while (true) {
+            WorkloadState::Bucket* b = &state->buckets[bucket];
+            int64_t k = loadRelaxed(&b->key);
+            log->read8(__LINE__, &b->key, uint64_t(k));
+            i++;
+            if ((k == key) || (k < 0)) {
+                if (update) {
+                    log->write8(__LINE__, &b->value, uint64_t(r));
+                    storeRelaxed(&b->value, int64_t(r));
+                    storeRelaxed(&b->key, key);
+                } else {
+                    log->read8(__LINE__, &b->value, 0);
+                    escape(&b->value);
+                }
+                i++;
+                break;
+            }
+            bucket = (bucket + 1) & mask;
+        }
+    }
+}
+
+template <typename Log>
+void
+runPointerChase(Log* log, int64_t* slice, int accesses)
+{
+    int64_t next = 0;
+    for (int i = 0; i < accesses; i++) {
+        int64_t* addr = &slice[next];
+        next = *addr;
+        log->read8(__LINE__, addr, uint64_t(next));
+    }
+    escape(&next);
+}
+
+template <typename Log>
+void
+runRandomAccesses(Log* log, WorkloadState* state, WorkloadRng* rng,
+        int accesses, int readPct)
+{
+    for (int i = 0; i < accesses; i++) {
+        uint64_t r = rng->next();
+        int64_t* addr = &state->array[(r >> 8) % uint64_t(state->totalLength)];
+        if (int(r % 100) < readPct) {
+            int64_t val = loadRelaxed(addr);
+            log->read8(__LINE__, addr, uint64_t(val));
+        } else {
+            log->write8(__LINE__, addr, i);
+            storeRelaxed(addr, i);
+        }
+    }
+}
+
+/**
+ * Run (about) \p length logged memory accesses of the configured workload
+ * other than DISJOINT_WRITES, which every experiment implements itself.
+ *
+ * \param slice
+ *      The calling thread's slice of the array.
+ */
+template <typename Log>
+__attribute__((noinline))
+void
+runWorkload(Log* log, WorkloadState* state, int64_t* slice, int length)
+{
+    int tid = int((slice - state->array) / state->length);
+    static thread_local WorkloadRng rng(uint64_t(tid) + 1);
+    switch (state->workload) {
+        case SHARED_COUNTER:
+            runSharedCounter(log, state, length);
+            break;
+        case PRODUCER_CONSUMER:
+            runProducerConsumer(log, state, tid, length);
+            break;
+        case HASH_MAP:
+            runHashMap(log, state, &rng, length);
+            break;
+        case POINTER_CHASE:
+            runPointerChase(log, slice, length);
+            break;
+        case RANDOM_RW:
+            runRandomAccesses(log, state, &rng, length, 50);
+            break;
+        case READ_MOSTLY:
+            runRandomAccesses(log, state, &rng, length, 95);
+            break;
+        default:
+            break;
+    }
+}
+
+#endif //FASTLOG_WORKLOADS_H
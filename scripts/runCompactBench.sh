@@ -0,0 +1,13 @@
+#!/bin/bash
+# Compare cycles per write and bytes per event of 64-bit events (LOG_FULL) and
+# 32-bit delta events (COMPACT_32) on sequential, strided and random writes.
+length=${1:-10000000}
+for pattern in sequential strided random;
+do
+	for op in 11 22;
+	do
+		sudo FASTLOG_ACCESS_PATTERN=$pattern cset shield --exec -- \
+			./FastLog 1 $length $op | \
+			grep -E "^numThreads|^accessPattern|cyclesPerWrite|bytesPerEvent"
+	done
+done
@@ -0,0 +1,12 @@
+#!/bin/bash
+# Compare the two ways of notifying threads about epoch changes (i.e.,
+# BUFFER_MANAGER vs. BUFFER_MANAGER_EPOCH_GEN) as #threads grows.
+length=${1:-100000}
+for threads in 1 2 4 8 16 32 64 128 256;
+do
+	for op in 15 17;
+	do
+		sudo cset shield --exec -- ./FastLog $threads $length $op | \
+			grep -E "^numThreads|cyclesPerWrite|^epochs"
+	done
+done
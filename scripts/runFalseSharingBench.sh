@@ -0,0 +1,25 @@
+#!/bin/bash
+# Measure the coherence traffic (HITM, i.e. loads that hit a line modified in
+# another core's cache) caused by the placement of the event buffer, context
+# and TLS fields: the default cache line separated layout vs. the packed one
+# (FASTLOG_PACKED_LAYOUT). Run from the root of the source tree; requires
+# perf with c2c support.
+threads=${1:-8}
+length=${2:-100000}
+export FASTLOG_BUFFER_EVENTS=${FASTLOG_BUFFER_EVENTS:-1000000}
+for layout in OFF ON;
+do
+	dir=build-packed-$layout
+	cmake -S . -B $dir -DCMAKE_BUILD_TYPE=Release \
+		-DFASTLOG_PACKED_LAYOUT=$layout > /dev/null
+	cmake --build $dir -j > /dev/null
+	for op in 15 17 18;
+	do
+		echo "FASTLOG_PACKED_LAYOUT=$layout op=$op"
+		sudo -E perf c2c record -o $dir/perf.c2c.$op -- \
+			./$dir/FastLog $threads $length $op | \
+			grep -E "cyclesPerWrite|^epochs"
+		sudo perf c2c report -i $dir/perf.c2c.$op --stats 2>/dev/null | \
+			grep -E "Load HITM|Load Local HITM|Load Remote HITM|Store HITM"
+	done
+done
@@ -0,0 +1,18 @@
+#!/bin/bash
+# Check that idle CPUs don't hold an epoch open: after the per-CPU buffer
+# experiment, FastLog ends the epoch while no thread logs (as a per-thread
+# buffer filling up would) and waits for its worker thread, which only gets
+# the buffers of the idle CPUs through its idle sweep. Pinning all threads to
+# one CPU leaves the buffers of the others empty throughout the run. Run from
+# the build directory.
+#
+# Usage: runIdleCpuTest.sh [threads] [length]
+set -o pipefail
+threads=${1:-4}
+length=${2:-1000000}
+for run in 1 2 3;
+do
+	FASTLOG_IDLE_CPU_CHECK=1 taskset -c 0 ./FastLog $threads $length 18 |
+		grep "^idleCpus" || { echo "run $run failed"; exit 1; }
+done
+echo "idle CPU test OK"
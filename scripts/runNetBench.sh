@@ -0,0 +1,23 @@
+#!/bin/bash
+# Measure the end-to-end analysis throughput (events/s) when the event
+# buffers are shipped to 1-4 analyzer nodes over loopback TCP, each node
+# spending COST ns per 1000 events on top of decoding. Set
+# FASTLOG_NET_COMPRESS=1 to compress the events on the wire.
+threads=${1:-4}
+length=${2:-100000}
+cost=${3:-2000}
+port=7400
+for nodes in 1 2 3 4;
+do
+	list=""
+	for i in $(seq 1 $nodes);
+	do
+		./FastLogAnalyzer --listen $((port + i)) --cost $cost > /dev/null &
+		list="$list${list:+,}127.0.0.1:$((port + i))"
+	done
+	sleep 0.2
+	FASTLOG_ANALYZER_NODES=$list ./FastLog $threads $length 15 | \
+		grep -E "^analyzerNodes [0-9]+,|Skip processing" | sort | uniq -c
+	wait
+	port=$((port + nodes))
+done
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Stress the reuse of closed-buffer queues: build with FASTLOG_STRESS_PUSH,
+# which yields between linking a closed buffer into its queue and counting it,
+# and run many short epochs so that queues of epochs whose worker is done are
+# reused while owners are still inside push(). Assertions are on (Debug), so a
+# queue reset under a late pusher shows up as a dropped epoch recycling a
+# buffer that is still open. Run from the root of the source tree.
+#
+# Usage: runPushStress.sh [runs] [threads] [length]
+set -o pipefail
+runs=${1:-20}
+threads=${2:-8}
+length=${3:-20000}
+dir=build-stress-push
+cmake -S . -B $dir -DCMAKE_BUILD_TYPE=Debug -DFASTLOG_STRESS_PUSH=ON \
+	> /dev/null || exit 1
+cmake --build $dir -j --target FastLog > /dev/null || exit 1
+export FASTLOG_BUFFER_EVENTS=${FASTLOG_BUFFER_EVENTS:-4096}
+for run in $(seq $runs);
+do
+	# Alternate between the worker path and the flight recorder, which drops
+	# epochs (and reuses their queues) without any worker.
+	if ((run % 2)); then
+		unset FASTLOG_RECORDER_EPOCHS
+	else
+		export FASTLOG_RECORDER_EPOCHS=2
+	fi
+	for op in 15 17;
+	do
+		./$dir/FastLog $threads $length $op | grep "^epochs" || {
+			echo "run $run, op $op failed"
+			exit 1
+		}
+	done
+done
+echo "push stress OK"
@@ -0,0 +1,17 @@
+#!/bin/bash
+# Measure the cycle and event-volume tradeoff of filtering stores to the
+# stack (STACK_FILTER experiment): log everything, drop stack addresses with
+# a bounds check at runtime, or don't instrument non-escaping locals at all.
+# bytesPerEvent is # bytes logged per memory access.
+threads=${1:-1}
+length=${2:-1000000}
+for stores in 0 1 2 4 8;
+do
+	for filter in none runtime static;
+	do
+		echo "stackStores $stores, stackFilter $filter"
+		FASTLOG_STACK_STORES=$stores FASTLOG_STACK_FILTER=$filter \
+			./FastLog $threads $length 26 | \
+			grep -E "cyclesPerWrite|bytesPerEvent"
+	done
+done
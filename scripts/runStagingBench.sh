@@ -0,0 +1,15 @@
+#!/bin/bash
+# Measure the slowdown of both the logger and a co-running cache-sensitive
+# workload (pointer chasing over FASTLOG_CORUN_KB) when events are written
+# directly (LOG_FULL), with prefetch (PREFETCH_LOG_ENTRY), or through an L1
+# staging area flushed with non-temporal stores (STAGED_NT_FLUSH). NO_OP is
+# the baseline.
+length=${1:-10000000}
+for kb in 32 256 1024 8192;
+do
+	for op in 0 5 11 19;
+	do
+		sudo FASTLOG_CORUN_KB=$kb cset shield --exec -- ./FastLog 1 $length $op | \
+			grep -E "^numThreads|cyclesPerWrite|^coRunner"
+	done
+done
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Sweep # threads, array length and buffer size for each logging experiment
+# with the harness built into FastLog (per-thread perf counters, repeated
+# runs, confidence intervals), write results/<op>.json, and, if a baseline
+# directory is given, flag regressions against the results saved there.
+#
+# Usage: runSweep.sh [baselineDir]
+baseline=$1
+mkdir -p results
+status=0
+# Every logging experiment except ALL_LOGGERS (20), which runs all logger
+# combinations at once, and the experiments that don't log an array: the
+# decode, archive and synthetic trace benchmarks (23-25). The stack filter
+# (26) needs its own settings; see runStackFilterBench.sh.
+for op in {0..19} 21 22;
+do
+	./FastLog --sweep $op --threads 1,2,4 --lengths 100000,10000000 \
+		--buffers 65536,1048576 --repeats 5 --iterations 100 \
+		--out results/$op.json | grep "cyclesPerWrite"
+	if [ -n "$baseline" ] && [ -f "$baseline/$op.json" ]; then
+		./FastLog --compare "$baseline/$op.json" results/$op.json || status=1
+	fi
+done
+exit $status
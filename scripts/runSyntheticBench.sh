@@ -0,0 +1,14 @@
+#!/bin/bash
+# Measure the throughput of the worker threads (events per second of worker
+# time) and the epoch latency on synthetic traces (SYNTHETIC_TRACE), varying
+# one knob of the event mix at a time (see TraceProfile in SyntheticTrace.h).
+length=${1:-100000}
+run() {
+	env "$@" ./FastLog $threads $length 25 | \
+		grep -E "^traceProfile|^analyzedEpochs"
+}
+threads=2
+for pct in 0 50 90 100; do run FASTLOG_GEN_LOCALITY=$pct; done
+for pct in 0 10 50; do run FASTLOG_GEN_SHARED_PCT=$pct; done
+for k in 0 2 20 100; do run FASTLOG_GEN_SYNC_PER_K=$k; done
+for threads in 1 2 4 8; do echo "numThreads $threads"; run; done
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Run every workload of Workloads.h three ways with the benchmark harness of
+# FastLog (`FastLog --sweep`), and report the slowdown of TSan and FastLog
+# over the uninstrumented program for each workload and # threads:
+#  - uninstrumented: NO_SSE, i.e., plain stores without logging;
+#  - tsan: the same, in the FastLogTsan build (-fsanitize=thread);
+#  - fastlog: BUFFER_MANAGER, i.e., full events logged via the runtime.
+# Invoked by the tsan-comparison build target.
+#
+# Usage: runTsanComparison.sh [FastLog] [FastLogTsan]
+# Environment: THREADS, LENGTHS, REPEATS, ITERATIONS, OUT (result directory).
+
+# A sweep that fails must fail the script, even if it printed some results.
+set -o pipefail
+
+fastlog=${1:-./FastLog}
+fastlogTsan=${2:-./FastLogTsan}
+threads=${THREADS:-1,2,4}
+lengths=${LENGTHS:-100000}
+repeats=${REPEATS:-5}
+iterations=${ITERATIONS:-100}
+out=${OUT:-tsan-comparison}
+workloads=DISJOINT_WRITES,SHARED_COUNTER,PRODUCER_CONSUMER,HASH_MAP,\
+POINTER_CHASE,RANDOM_RW,READ_MOSTLY
+
+mkdir -p "$out"
+sweep() {
+	"$1" --sweep $2 --workloads $workloads --threads $threads \
+		--lengths $lengths --repeats $repeats --iterations $iterations \
+		--out "$out/$3.json" | grep "^sweep .*cyclesPerWrite" || exit 1
+}
+sweep "$fastlog" 1 uninstrumented
+sweep "$fastlogTsan" 1 tsan
+sweep "$fastlog" 15 fastlog
+"$fastlog" --slowdown "$out/uninstrumented.json" tsan="$out/tsan.json" \
+	fastlog="$out/fastlog.json"
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Run every logging experiment against every workload of Workloads.h, to see
+# how the slowdown of logging changes with contention and sharing (the
+# default DISJOINT_WRITES workload is the best case). Pass ALL_LOGGERS=1 to
+# also run every combination of logging policies.
+threads=${1:-4}
+length=${2:-100000}
+ops="0 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 21 22"
+if [ -n "$ALL_LOGGERS" ]; then
+	ops="$ops 20"
+fi
+for workload in DISJOINT_WRITES SHARED_COUNTER PRODUCER_CONSUMER HASH_MAP \
+		POINTER_CHASE RANDOM_RW READ_MOSTLY;
+do
+	for op in $ops;
+	do
+		FASTLOG_WORKLOAD=$workload ./FastLog $threads $length $op | \
+			grep -E "^numThreads|^workload|^logger|cyclesPerWrite"
+	done
+done